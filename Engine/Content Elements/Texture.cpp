@@ -35,6 +35,7 @@ namespace MyEngine {
                 Read(file, this->rawData[i]);
 			
             lodepng_decode_memory(&this->Pixels, &this->Width, &this->Height, this->rawData, this->rawDataSize, LCT_RGBA, 8);
+            this->updateMips();
 		}
 		this->IsLoaded = true;
     }
@@ -53,6 +54,10 @@ namespace MyEngine {
         this->rawData = new byte[this->rawDataSize];
         memcpy(this->rawData, texture.rawData, this->rawDataSize);
 
+        this->mips = texture.mips;
+        if (this->mips.empty())
+            this->updateMips();
+
         this->IsLoaded = true;
     }
     
@@ -92,6 +97,7 @@ namespace MyEngine {
 		this->Changed = true;
 
         this->updateRawData();
+        this->updateMips();
 	}
 
 	Color4 Texture::GetColor(uint x, uint y) const
@@ -109,17 +115,25 @@ namespace MyEngine {
 
 	Color4 Texture::GetColor(float u, float v) const
 	{
-		u = (float)((u - floor(u)) * this->Width);
-		v = (float)((v - floor(v)) * this->Height);
-		uint x = (uint)(u);
-		uint y = (uint)(v);
-		Color4 c1 = this->GetColor(x, y);
-		Color4 c2 = this->GetColor((x + 1) % this->Width, y);
-		Color4 c3 = this->GetColor(x, (y + 1) % this->Height);
-		Color4 c4 = this->GetColor((x + 1) % this->Width, (y + 1) % this->Height);
-		u -= (int)u;
-		v -= (int)v;
-		return linearFilter(c1, c2, c3, c4, u, v);
+		return this->getLevelColor(0, u, v);
+	}
+
+	Color4 Texture::GetColor(float u, float v, float lod) const
+	{
+		uint levels = (uint)this->mips.size();
+		if (!(lod > 0.0f) || levels == 0)
+			return this->getLevelColor(0, u, v);
+		if (lod >= levels)
+			return this->getLevelColor(levels, u, v);
+
+		uint level = (uint)lod;
+		float t = lod - level;
+		return this->getLevelColor(level, u, v) * (1.0f - t) + this->getLevelColor(level + 1, u, v) * t;
+	}
+
+	float Texture::GetLodBias() const
+	{
+		return 0.5f * log2((float)this->Width * this->Height);
 	}
 
 	void Texture::SetColor(uint x, uint y, const Color4& color)
@@ -131,6 +145,7 @@ namespace MyEngine {
 			this->Pixels[(y * this->Width + x) * 4 + 2] = (byte)(color.b * 255);
 			this->Pixels[(y * this->Width + x) * 4 + 3] = (byte)(color.a * 255);
             this->Changed = true;
+            this->mips.clear(); // rebuilt by the copies the renderers take
 		}
     }
 
@@ -146,6 +161,7 @@ namespace MyEngine {
         }
 
         this->updateRawData();
+        this->updateMips();
     }
 
     void Texture::updateRawData()
@@ -157,6 +173,81 @@ namespace MyEngine {
         lodepng_encode_memory(&this->rawData, (size_t*)&this->rawDataSize, (byte*)this->Pixels, this->Width, this->Height, LCT_RGBA, 8);
     }
 
+    void Texture::updateMips()
+    {
+        this->mips.clear();
+        if (this->Pixels == NULL)
+            return;
+
+        // every level averages 2x2 texels of the previous one, the odd last row / column is clamped
+        uint width = this->Width;
+        uint height = this->Height;
+        const byte* pixels = this->Pixels;
+        while (width > 1 || height > 1)
+        {
+            MipLevel level;
+            level.width = max(width / 2, 1u);
+            level.height = max(height / 2, 1u);
+            level.pixels.resize(level.width * level.height * 4);
+            for (uint y = 0; y < level.height; y++)
+            {
+                uint y0 = min(y * 2, height - 1);
+                uint y1 = min(y * 2 + 1, height - 1);
+                for (uint x = 0; x < level.width; x++)
+                {
+                    uint x0 = min(x * 2, width - 1);
+                    uint x1 = min(x * 2 + 1, width - 1);
+                    for (uint c = 0; c < 4; c++)
+                    {
+                        uint sum = pixels[(y0 * width + x0) * 4 + c] + pixels[(y0 * width + x1) * 4 + c] +
+                                   pixels[(y1 * width + x0) * 4 + c] + pixels[(y1 * width + x1) * 4 + c];
+                        level.pixels[(y * level.width + x) * 4 + c] = (byte)((sum + 2) / 4);
+                    }
+                }
+            }
+
+            this->mips.push_back(move(level));
+            width = this->mips.back().width;
+            height = this->mips.back().height;
+            pixels = this->mips.back().pixels.data();
+        }
+    }
+
+    Color4 Texture::getLevelColor(uint level, float u, float v) const
+    {
+        uint width = level == 0 ? this->Width : this->mips[level - 1].width;
+        uint height = level == 0 ? this->Height : this->mips[level - 1].height;
+        const byte* pixels = level == 0 ? this->Pixels : this->mips[level - 1].pixels.data();
+        if (pixels == NULL || width == 0 || height == 0)
+            return Color4::Black();
+
+        // wrapped bilinear lookup straight from the level's texels
+        u = (u - floor(u)) * width;
+        v = (v - floor(v)) * height;
+        uint x0 = min((uint)u, width - 1);
+        uint y0 = min((uint)v, height - 1);
+        uint x1 = x0 + 1 < width ? x0 + 1 : 0;
+        uint y1 = y0 + 1 < height ? y0 + 1 : 0;
+        u -= x0;
+        v -= y0;
+
+        const byte* p1 = pixels + (y0 * width + x0) * 4;
+        const byte* p2 = pixels + (y0 * width + x1) * 4;
+        const byte* p3 = pixels + (y1 * width + x0) * 4;
+        const byte* p4 = pixels + (y1 * width + x1) * 4;
+        float w1 = (1.0f - u) * (1.0f - v) / 255.0f;
+        float w2 = u * (1.0f - v) / 255.0f;
+        float w3 = (1.0f - u) * v / 255.0f;
+        float w4 = u * v / 255.0f;
+
+        Color4 c;
+        c.r = p1[0] * w1 + p2[0] * w2 + p3[0] * w3 + p4[0] * w4;
+        c.g = p1[1] * w1 + p2[1] * w2 + p3[1] * w3 + p4[1] * w4;
+        c.b = p1[2] * w1 + p2[2] * w2 + p3[2] * w3 + p4[2] * w4;
+        c.a = p1[3] * w1 + p2[3] * w2 + p3[3] * w3 + p4[3] * w4;
+        return c;
+    }
+
 
     void* Texture::get(const string& name)
     {
@@ -26,6 +26,8 @@ namespace MyEngine {
         void Init(uint width, uint height);
 		Color4 GetColor(uint x, uint y) const;
 		Color4 GetColor(float u, float v) const;
+		Color4 GetColor(float u, float v, float lod) const; // trilinear, lod is the mip level (log2 of the texels per sample)
+		float GetLodBias() const; // level of a footprint of 1 in texture coordinates
 		void SetColor(uint x, uint y, const Color4& color);
         void SetBGRAData(const byte* data);
 
@@ -34,11 +36,20 @@ namespace MyEngine {
 		virtual ContentElement* Clone() const override;
 
     protected:
+        struct MipLevel
+        {
+            uint width, height;
+            vector<byte> pixels; // RGBA
+        };
+
         int rawDataSize;
         byte* rawData;
+        vector<MipLevel> mips; // box filtered levels after the level 0 (Pixels), cleared when the pixels change
 
         void init();
         void updateRawData();
+        void updateMips();
+        Color4 getLevelColor(uint level, float u, float v) const;
         virtual void* get(const string& name);
 	};
 
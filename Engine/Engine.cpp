@@ -12,6 +12,7 @@
 #include "Managers\AnimationManager.h"
 #include "Renderers\IrrRenderer.h"
 #include "Renderers\CPURayRenderer.h"
+#include "Renderers\WavefrontRenderer.h"
 
 
 namespace MyEngine {
@@ -43,8 +44,12 @@ namespace MyEngine {
 
 	Engine::Engine()
 	{
-		ofstream ofile(LOG_FILE);
-		ofile.close();
+		// the engine mode processes, e.g. the render nodes, don't log and share the editor's folder
+		if (Engine::Mode != EngineMode::EEngine)
+		{
+			ofstream ofile(LOG_FILE);
+			ofile.close();
+		}
         Engine::Log(LogType::ELog, "Engine", "Create engine");
 
         this->Started = false;
@@ -70,6 +75,27 @@ namespace MyEngine {
 	}
 
 
+    void Engine::SetProductionRenderer(RendererType type)
+    {
+        if (this->ProductionRenderer && this->ProductionRenderer->Type == type)
+            return;
+
+        this->ProductionRenderer.reset();
+        switch (type)
+        {
+        case RendererType::ECPURayRenderer:
+            this->ProductionRenderer = make_shared<CPURayRenderer>(this);
+            break;
+        case RendererType::EWavefrontRenderer:
+            this->ProductionRenderer = make_shared<WavefrontRenderer>(this);
+            break;
+        default:
+            throw "ArgumentException: type";
+        }
+        Engine::Log(LogType::ELog, "Engine", "Production renderer changed to " + to_string(type));
+    }
+
+
     map<string, long long> Engine::GetProfilerData()
     {
         return Profiler::GetDurations();
@@ -37,6 +37,8 @@ namespace MyEngine {
 		static bool IsSelected(uint id);
 	};
 
+	enum RendererType;
+
 	class Engine
 	{
     private:
@@ -58,6 +60,8 @@ namespace MyEngine {
 		Engine();
 		~Engine();
 
+        void SetProductionRenderer(RendererType type);
+
         static map<string, long long> GetProfilerData();
 		static void Log(LogType type, const string& category, const string& text);
 	};
@@ -3,6 +3,8 @@
 #include "stdafx.h"
 #include "CPURayRenderer.h"
 
+#include <direct.h>
+
 #pragma warning(push, 3)
 namespace embree {
 #include <Embree\rtcore.h>
@@ -15,11 +17,15 @@ namespace embree {
 
 #include "..\Engine.h"
 #include "..\Utils\Config.h"
+#include "..\Utils\Utils.h"
+#include "..\Utils\IOUtils.h"
+#include "..\Utils\MappedFile.h"
 #include "..\Utils\Types\Random.h"
 #include "..\Utils\Types\Thread.h"
 #include "..\Utils\Types\Profiler.h"
 #include "..\Managers\SceneManager.h"
 #include "..\Managers\ContentManager.h"
+#include "..\Managers\AnimationManager.h"
 #include "..\Scene Elements\Camera.h"
 #include "..\Scene Elements\Light.h"
 #include "..\Scene Elements\RenderElement.h"
@@ -31,22 +37,37 @@ namespace MyEngine {
 
     pair<unsigned, Random> Random::rg_table[Random::RGENS];
     function<int()> Random::threadIdFunc;
+    unsigned Random::tableVersion = 0;
+    __declspec(thread) Random* Random::threadGen = NULL;
+    __declspec(thread) unsigned Random::threadGenVersion = 0;
+    unsigned Sampler::directions[Sampler::SOBOL_DIMENSIONS][32];
+    __declspec(thread) Sampler Sampler::current;
 
     const int CPURayRenderer::VALID[RAYS] = { -1, -1, -1, -1 };
+    const float CPURayRenderer::ERROR_MIN_MEAN = 0.05f;
+    const float CPURayRenderer::IRRADIANCE_MAP_MIN_DIST = 1.0f;
+    const float CPURayRenderer::FOG_RANGE = 3.16f; // 0.001 transmittance
+    const float CPURayRenderer::BLOOM_THRESHOLD = 1.0f;
+    __declspec(thread) CPURayRenderer::ShadowContext* CPURayRenderer::shadowContext = NULL;
+    ThreadLocal<vector<CPURayRenderer::LightSample>> CPURayRenderer::lightSamples;
+    __declspec(thread) CPURayRenderer::GIPathCounts CPURayRenderer::giPathCounts;
+
 
 
-    CPURayRenderer::CPURayRenderer(Engine* owner) :
-        ProductionRenderer(owner, RendererType::ECPURayRenderer),
-        lightCacheKdTree(3)
+    CPURayRenderer::CPURayRenderer(Engine* owner, RendererType type) :
+        ProductionRenderer(owner, type),
+        irrMapKdTree(2)
     {
         this->RegionSize = 64;
         this->Preview = true;
         this->VolumetricFog = true;
         this->MinSamples = 1;
         this->MaxSamples = 4;
-        this->SampleThreshold = 0.01f;
+        this->SampleThreshold = 0.05f;
+        this->Sampling = SamplerType::ESobolSampler;
         this->MaxLights = 8;
         this->MaxDepth = 4;
+        this->RouletteDepth = 2;
         this->GI = true;
         this->GISamples = 4;
         this->IrradianceMap = true;
@@ -56,40 +77,113 @@ namespace MyEngine {
         this->IrradianceMapColorThreshold = 0.3f;
         this->LightCache = true;
         this->LightCacheSampleSize = 0.1f;
+        this->GICache = false;
         this->Animation = false;
         this->AnimationResetCaches = false;
+        this->Progressive = false;
+        this->ProgressiveTime = 0.0f;
+        this->ProgressiveNoise = 0.01f;
+        this->RenderNodes = 0;
+        this->CheckpointTime = 0.0f;
+        this->Exposure = 1.0f;
+        this->ToneMapping = false;
+        this->SRGB = false;
+        this->Bloom = 0.0f;
+        this->Denoise = false;
+        this->denoised = false;
 
         this->thread->defThreadPool();
+        this->regionBuffers.resize(this->thread->workersCount());
         this->thread->defMutex("regions");
-        this->thread->defMutex("lights", mutex_type::read_write);
-        this->thread->defMutex("lightCache", mutex_type::read_write);
+        this->thread->defMutex("nodes");
+        this->thread->defMutex("node");
+        this->thread->defMutex("checkpoint", mutex_type::read_write);
+        this->thread->defMutex("sequence");
 
         this->phasePofiler = make_shared<Profiler>();
 
+        this->packetSize = 4;
+        this->refinePass = false;
+        this->progressPixels = 0;
+        this->giPaths = 0;
+        this->giRays = 0;
+        this->lightCacheShared = false;
+        this->nodesWorkers = 0;
+        this->progressiveIteration = 0;
+        this->progressiveFinish = false;
+        this->nodesListening = false;
+        this->nodesFrame = 0;
+        this->sequence = false;
+        this->sequenceFps = 30.0f;
+        this->sequenceEndTime = 0.0f;
+        this->sequenceFrame = 0;
+        this->sequenceNext = false;
+        this->checkpoints = false;
+        this->checkpointing = false;
+        this->checkpointKey = 0;
+        this->resuming = false;
+        // the device and the scenes live as long as the renderer, so the next Start only updates what changed
+        this->rtcDevice = embree::rtcNewDevice();
+        embree::rtcDeviceSetErrorFunction(this->rtcDevice, (embree::RTCErrorFunc)&onRTCError);
         this->rtcScene = NULL;
+        this->rtcSystemScene = NULL;
         this->rtcIrrMapScene = NULL;
+        this->froxelsX = this->froxelsY = 0;
+        this->froxelsFar = 0.0f;
+        for (int i = 0; i < AOVS_COUNT; i++)
+            this->aovBuffers[i] = NULL;
     }
 
     CPURayRenderer::~CPURayRenderer()
     {
         this->IsStarted = false;
+        // the render nodes end when their connections are closed
+        this->nodesListening = false;
+        if (this->nodesAcceptor.joinable())
+            this->nodesAcceptor.join();
+        for (auto& node : this->renderNodes)
+        {
+            if (node->driver.joinable())
+                node->driver.join();
+            node->socket.close();
+        }
+        this->renderNodes.clear();
+        this->nodesProcesses.clear();
+        this->nodeSocket.close();
         this->thread->joinWorkers();
+        this->joinSequencePreparer();
+        this->imageWriter.finish();
+        if (this->checkpointWriter.joinable())
+            this->checkpointWriter.join();
 
         // clear scene
-        if (this->rtcScene != NULL)
-        {
-            this->Regions.clear();
-            this->contentElements.clear();
+        this->Regions.clear();
+        this->contentElements.clear();
 
-            this->rtcInstances.clear();
-            for (const auto& rtcGeom : this->rtcGeometries)
-                embree::rtcDeleteScene(rtcGeom.second);
-            this->rtcGeometries.clear();
+        this->rtcInstances.clear();
+        this->rtcSystemInstances.clear();
+        this->rtcSceneInstances.clear();
+        this->rtcSystemSceneInstances.clear();
+        if (this->rtcScene != NULL)
             embree::rtcDeleteScene(this->rtcScene);
-            this->rtcScene = NULL;
-            embree::rtcDeleteDevice(this->rtcDevice);
-            this->rtcDevice = NULL;
+        this->rtcScene = NULL;
+        if (this->rtcSystemScene != NULL)
+            embree::rtcDeleteScene(this->rtcSystemScene);
+        this->rtcSystemScene = NULL;
+        if (this->rtcIrrMapScene != NULL)
+            embree::rtcDeleteScene(this->rtcIrrMapScene);
+        this->rtcIrrMapScene = NULL;
+        for (auto rtcGeometries : { &this->rtcGeometries, &this->rtcLightGeometries, &this->rtcDynamicGeometries })
+        {
+            for (const auto& rtcGeom : *rtcGeometries)
+                embree::rtcDeleteScene(rtcGeom.second.rtcGeometry);
+            rtcGeometries->clear();
         }
+        for (const auto& rtcGeometry : this->rtcReleasedGeometries)
+            embree::rtcDeleteScene(rtcGeometry);
+        this->rtcReleasedGeometries.clear();
+        embree::rtcDeleteDevice(this->rtcDevice);
+        this->rtcDevice = NULL;
 
         Engine::Log(LogType::ELog, "CPURayRenderer", "DeInit CPU Ray Renderer");
     }
@@ -97,7 +191,12 @@ namespace MyEngine {
 
     vector<string> CPURayRenderer::GetBufferNames()
     {
-        return{ "Diffuse", "Specular", "DirectLight", "IndirectLight", "TotalLight", "Lighted", "Reflection", "Refraction", "Samples", "Depth", "Normals", "Final" };
+        vector<string> result;
+        for (int i = 0; i < AOVS_COUNT; i++)
+            result.push_back(getAOVName(i));
+        if (this->Denoise) // before Final, it's the last one
+            result.insert(result.end() - 1, "Denoised");
+        return result;
     }
 
     vector<Region> CPURayRenderer::GetActiveRegions()
@@ -108,10 +207,10 @@ namespace MyEngine {
         if (!this->IsStarted)
             return result;
 
-        for (const auto& region : this->Regions)
+        for (const auto& tile : this->tileScheduler.getActive())
         {
-            if (region.active)
-                result.push_back(region);
+            result.push_back(Region(tile.x, tile.y, tile.w, tile.h));
+            result.back().active = true;
         }
         return result;
     }
@@ -123,11 +222,10 @@ namespace MyEngine {
         if (!this->IsStarted)
             return 0.0;
 
-        int finshed = 0;
-        for (int i = 0; i < this->nextRagion; i++)
-            finshed += this->Regions[i].w * this->Regions[i].h;
+        if (this->progressiveIteration > 0 && this->ProgressiveTime > 0.0f)
+            return min(this->GetRenderTime() / this->ProgressiveTime, 1.0) * 100;
 
-        return ((double)finshed / (this->Width * this->Height)) * 100;
+        return ((double)this->progressPixels / (this->Width * this->Height)) * 100;
     }
 
     bool CPURayRenderer::Init(uint width, uint height)
@@ -138,12 +236,14 @@ namespace MyEngine {
         const auto& bufferNames = this->GetBufferNames();
         for (const auto& bufferName : bufferNames)
             this->Buffers[bufferName].init(width, height);
+        for (int i = 0; i < AOVS_COUNT; i++)
+            this->aovBuffers[i] = &this->Buffers[getAOVName(i)];
+        this->Display.init(width, height);
 
         Random::initRandom((int)Now, []() -> int { return (int)this_thread::get_id().hash(); });
+        Sampler::initSobol();
         this->generateRegions();
 
-        embree::rtcDeviceSetErrorFunction(this->rtcDevice, (embree::RTCErrorFunc)&onRTCError);
-
         Engine::Log(LogType::ELog, "CPURayRenderer", "Init CPU Ray Renderer to (" + to_string(width) + ", " + to_string(height) + ")");
         return true;
     }
@@ -151,87 +251,282 @@ namespace MyEngine {
     void CPURayRenderer::Start()
     {
         ProfileLog;
+        this->joinSequencePreparer();
+        ProductionRenderer::Start();
+        this->sequence = false;
+        this->prepareFrame();
+        this->addFrameTasks();
+
+        Engine::Log(LogType::ELog, "CPURayRenderer", this->Progressive ? "Start Progressive Rendering" : "Start Rendering");
+    }
+
+    void CPURayRenderer::Resume()
+    {
+        ProfileLog;
+        this->joinSequencePreparer();
         ProductionRenderer::Start();
-        // TODO: progressive rendering
+        this->sequence = false;
+        this->prepareFrame();
+        // the progressive rendering has no checkpoints
+        bool resume = !this->Progressive && this->loadCheckpoint();
+        this->resuming = resume;
+        this->addFrameTasks();
+
+        Engine::Log(LogType::ELog, "CPURayRenderer", resume ? "Resume Rendering" : this->Progressive ? "Start Progressive Rendering" : "Start Rendering");
+    }
+
+    void CPURayRenderer::StartSequence(float fps, float endTime, const string& filePath)
+    {
+        ProfileLog;
+        if (fps <= 0.0f)
+            throw "ArgumentException: fps must be positive";
+
+        this->joinSequencePreparer();
+        ProductionRenderer::Start();
+        this->sequence = true;
+        this->sequenceFps = fps;
+        this->sequenceEndTime = endTime;
+        this->sequencePath = filePath;
+        // the files of the previous sequences are kept
+        this->sequenceFrame = 0;
+        while (ifstream(this->sequencePath + to_string(this->sequenceFrame) + ".png"))
+            this->sequenceFrame++;
+        this->prepareFrame();
+        this->addFrameTasks();
+
+        Engine::Log(LogType::ELog, "CPURayRenderer", "Start Sequence Rendering");
+    }
+
+    void CPURayRenderer::prepareFrame()
+    {
+        Profile;
         // TODO: may be implement ggx microfaset BSDF (important sampling)
+        this->resuming = false;
 
         // clear previous scene
         if (this->rtcScene != NULL)
         {
-            this->lights.clear();
             this->contentElements.clear();
             // TODO: irradiance map doesn't work well with animation, twice done for equal part of the scene, put it in the if
             this->irrMapSamples.clear();
             this->irrMapTriangles.clear();
+            this->irrMapAdjacency.clear();
+            this->irrMapKdTree.clear();
             if (this->rtcIrrMapScene)
             {
                 embree::rtcDeleteScene(this->rtcIrrMapScene);
                 this->rtcIrrMapScene = NULL;
             }
             if (!this->Animation || this->AnimationResetCaches)
-            {
-                this->lightCacheSamples.clear();
-                this->lightCacheKdTree.clear();
-            }
-
-            this->rtcInstances.clear();
-            for (const auto& rtcGeom : this->rtcGeometries)
-                embree::rtcDeleteScene(rtcGeom.second);
-            this->rtcGeometries.clear();
-            embree::rtcDeleteScene(this->rtcScene);
-            this->rtcScene = NULL;
-            embree::rtcDeleteDevice(this->rtcDevice);
-            this->rtcDevice = NULL;
+                this->lightCache.clear();
         }
 
-        this->rtcDevice = embree::rtcNewDevice();
+        this->packetSize = cpuSupportsAVX() ? 8 : 4;
         this->beginFrame();
         this->createRTCScene();
+        this->buildLightTree();
+        if (this->GI && this->LightCache && this->lightCache.empty())
+            this->lightCache.init(LIGHT_CACHE_CELLS, this->LightCacheSampleSize);
+        // a render node shades with its coordinator's GI caches, so the regions of all the nodes have the same GI
+        this->lightCacheShared = this->nodeSocket.isOpen();
+        if (this->GI && this->nodeSocket.isOpen())
+        {
+            this->lightCache.clear();
+            if (!this->nodeGICache.empty())
+                this->readGICache((const byte*)this->nodeGICache.data(), this->nodeGICache.size(), "render node frame " + to_string(this->nodesFrame), false);
+        }
+        else if (this->GI && this->GICache)
+            this->loadGICache();
+    }
+
+    void CPURayRenderer::addFrameTasks()
+    {
+        if (!this->resuming)
+            this->pixelStats.assign(this->Width * this->Height, RunningStats());
+        this->refinePass = false;
+        this->progressiveIteration = 0;
+        this->progressiveFinish = false;
+        this->giPaths = 0;
+        this->giRays = 0;
+        this->initPostProcessing();
+        // the tile pass of the regions restored from the checkpoint
+        if (this->resuming)
+        {
+            for (const auto& region : this->Regions)
+                this->postProcessing.processTile(region);
+        }
+        this->startRenderNodes();
 
         this->phasePofiler->start();
-        // preview phase
-        if (this->Preview)
+        // fog lighting phase, everything after it shades the fog from the froxels
+        if (this->VolumetricFog && this->Owner->SceneManager->FogDensity > 0.0f)
+            this->addFroxelTasks();
+        else
+            this->froxels.clear();
+        // preview phase, a resumed image has the checkpoint's regions instead
+        if (this->Preview && !this->resuming)
         {
-            this->thread->addNTasks([&](int) { return this->render(true); }, (int)this->Regions.size());
-            this->thread->addWaitTask();
-            this->thread->addTask([&](int) { return this->sortRegions(); });
+            this->scheduleRegions(false);
+            this->thread->addNTasks([&](int id) { return this->renderRegions(id, true); });
             this->thread->addWaitTask();
             this->thread->addTask([&](int) { Engine::Log(LogType::ELog, "CPURayRenderer", duration_to_string(this->phasePofiler->stop()) + " Preview phase time"); return true; });
             this->thread->addWaitTask();
         }
-        // irradiance map phase
-        if (this->GI && this->IrradianceMap)
+        // irradiance map phase, its passes queue the next ones and at the end the render phase
+        if (this->GI && this->IrradianceMap && !this->irrMapSamples.empty()) // loaded from the GI cache
         {
+            this->createIrradianceMapScene();
+            this->addRenderTasks();
+        }
+        else if (this->GI && this->IrradianceMap && !this->nodeSocket.isOpen())
             this->thread->addTask([&](int) { return this->generateIrradianceMap(); });
+        else
+            this->addRenderTasks();
+    }
+
+    void CPURayRenderer::Stop()
+    {
+        ProductionRenderer::Stop();
+
+        Engine::Log(LogType::ELog, "CPURayRenderer", "Stop Rendering");
+    }
+
+    void CPURayRenderer::FinishProgressive()
+    {
+        this->progressiveFinish = true;
+    }
+
+    void CPURayRenderer::addRenderTasks()
+    {
+        // a render node renders the regions its coordinator sends once the frame is prepared
+        if (this->nodeSocket.isOpen())
+        {
             this->thread->addWaitTask();
-            this->thread->addNTasks([&](int) { while (this->computeIrradianceMap()); return true; });
-            this->thread->addWaitTask();
-            this->thread->addTask([&](int) { Engine::Log(LogType::ELog, "CPURayRenderer", duration_to_string(this->phasePofiler->stop()) + " Irradiance Map phase time"); return true; });
-            this->thread->addWaitTask();
+            this->thread->addTask([&](int)
+            {
+                ostringstream message;
+                Write(message, (int)ENodeReady);
+                Write(message, this->nodesFrame);
+                lock lck(this->thread->mutex("node"));
+                return this->nodeSocket.send(message.str());
+            });
+            return;
+        }
+        // render phase, the progressive iterations queue the next one and at the end the post-processing
+        if (this->Progressive)
+        {
+            this->thread->addTask([&](int) { return this->nextProgressiveIteration(); });
+            return;
         }
-        // render phase
-        this->thread->addNTasks([&](int) { return this->render(false); }, (int)(this->Regions.size() + this->thread->workersCount() * 3 * 2));
+        this->thread->addTask([&](int) { return this->scheduleRenderPass(); });
         this->thread->addWaitTask();
-        this->thread->addTask([&](int) { Engine::Log(LogType::ELog, "CPURayRenderer", duration_to_string(this->phasePofiler->stop()) + " Render phase time"); return true; });
+        this->thread->addNTasks([&](int id) { return this->renderRegions(id, false); });
         this->thread->addWaitTask();
-        // post-processing phase
-        this->thread->addTask([&](int) { return this->postProcessing(); });
+        this->thread->addTask([&](int) { this->finishRenderPass(); Engine::Log(LogType::ELog, "CPURayRenderer", duration_to_string(this->phasePofiler->stop()) + " Render phase time"); return true; });
         this->thread->addWaitTask();
-        this->thread->addTask([&](int) { Engine::Log(LogType::ELog, "CPURayRenderer", duration_to_string(this->phasePofiler->stop()) + " Post-processing phase time"); return true; });
-        if (this->GI && this->LightCache)
-            this->thread->addTask([&](int) { Engine::Log(LogType::ELog, "CPURayRenderer", to_string(this->lightCacheSamples.size()) + " light cache samples generated"); return true; });
-        this->thread->addTask([&](int) { this->Stop(); return true; });
+        // refine phase, more samples for the regions with pixels above the error threshold
+        this->thread->addTask([&](int) { return this->scheduleRefinePass(); });
+        this->thread->addWaitTask();
+        this->thread->addNTasks([&](int id) { return this->renderRegions(id, false); });
+        this->thread->addWaitTask();
+        this->thread->addTask([&](int) { Engine::Log(LogType::ELog, "CPURayRenderer", duration_to_string(this->phasePofiler->stop()) + " Refine phase time"); return true; });
+        this->thread->addWaitTask();
+        this->addFinishTasks();
+    }
 
-        Engine::Log(LogType::ELog, "CPURayRenderer", "Start Rendering");
+    void CPURayRenderer::addFinishTasks()
+    {
+        if (this->CheckpointTime > 0.0f)
+        {
+            this->thread->addTask([&](int) { return this->finishCheckpoints(); });
+            this->thread->addWaitTask();
+        }
+        if (this->GI && this->LightCache)
+            this->thread->addTask([&](int) { Engine::Log(LogType::ELog, "CPURayRenderer", to_string(this->lightCache.size()) + " light cache samples generated"); return true; });
+        if (this->GI)
+        {
+            this->thread->addTask([&](int)
+            {
+                unsigned long long paths = this->giPaths;
+                float length = paths > 0 ? (float)this->giRays / paths : 0.0f;
+                Engine::Log(LogType::ELog, "CPURayRenderer", to_string(paths) + " GI paths traced, average length " + to_string(length));
+                return true;
+            });
+        }
+        if (this->GI && this->GICache)
+        {
+            // a stopped render's caches are partial
+            this->thread->addTask([&](int) { return !this->IsStarted || this->saveGICache(); });
+            this->thread->addWaitTask();
+        }
+        // the next frame of a sequence doesn't need the buffers, its scene is updated while this one is post-processed
+        if (this->sequence)
+        {
+            this->thread->addTask([&](int)
+            {
+                lock lck(this->thread->mutex("sequence"));
+                this->sequencePreparer = std::thread([&]() { this->prepareSequenceFrame(); });
+                return true;
+            });
+        }
+        // post-processing phase
+        this->postProcessing.addTasks(this->thread.get(), this->Regions);
+        this->thread->addTask([&](int) { Engine::Log(LogType::ELog, "CPURayRenderer", duration_to_string(this->phasePofiler->stop()) + " Post-processing phase time"); return true; });
+        if (this->sequence)
+            this->thread->addTask([&](int) { return this->nextSequenceFrame(); });
+        else
+            this->thread->addTask([&](int) { this->Stop(); return true; });
     }
 
-    void CPURayRenderer::Stop()
+    void CPURayRenderer::prepareSequenceFrame()
     {
-        ProductionRenderer::Stop();
+        this->sequenceNext = false;
+        if (!this->IsStarted)
+            return;
 
-        Engine::Log(LogType::ELog, "CPURayRenderer", "Stop Rendering");
+        this->Owner->AnimationManager->MoveTime(1.0f / this->sequenceFps);
+        if (this->sequenceEndTime != 0.0f && this->Owner->AnimationManager->GetTime() > this->sequenceEndTime)
+            return;
+        // stopped while the animation moved
+        if (!this->IsStarted)
+            return;
+
+        this->prepareFrame();
+        this->sequenceNext = true;
+    }
+
+    void CPURayRenderer::joinSequencePreparer()
+    {
+        // the last sequence task and a restart can both join it
+        lock lck(this->thread->mutex("sequence"));
+        if (this->sequencePreparer.joinable())
+            this->sequencePreparer.join();
     }
 
+    bool CPURayRenderer::nextSequenceFrame()
+    {
+        this->joinSequencePreparer();
+
+        // a stopped frame isn't complete
+        bool stopped = !this->IsStarted;
+        if (!stopped)
+        {
+            this->imageWriter.add(this->sequencePath + to_string(this->sequenceFrame) + ".png", this->Display);
+            this->sequenceFrame++;
+        }
+        if (!stopped && this->sequenceNext)
+        {
+            this->addFrameTasks();
+            return true;
+        }
+
+        this->imageWriter.finish();
+        this->sequence = false;
+        if (!stopped)
+            this->Stop();
+        Engine::Log(LogType::ELog, "CPURayRenderer", "Stop Sequence Rendering");
+        return true;
+    }
 
     void CPURayRenderer::generateRegions()
     {
@@ -258,101 +553,36 @@ namespace MyEngine {
                 }
             }
         }
-        this->nextRagion = 0;
+        this->progressPixels = 0;
+    }
+
+    void CPURayRenderer::scheduleRegions(bool split)
+    {
+        vector<int> regions(this->Regions.size());
+        for (int i = 0; i < (int)regions.size(); i++)
+            regions[i] = i;
+        this->scheduleRegions(regions, split);
     }
 
-    bool CPURayRenderer::sortRegions()
+    void CPURayRenderer::scheduleRegions(const vector<int>& regions, bool split)
     {
         Profile;
         lock lck(this->thread->mutex("regions"));
 
-        if (!this->IsStarted)
-            return false;
-
-        // add 50% time to region from its neighbors
-        vector<float> times;
-        const int sw = (this->Width - 1) / this->RegionSize + 1;
-        for (int i = 0; i < (int)this->Regions.size(); i++)
-        {
-            float time = 0.0f;
-            int count = 0;
-            const int d = 3;
-            for (int j = 0; j < d * d; j++)
-            {
-                int ii = i + (j % d - 1) + (j / d - 1) * sw; // i + xx + yy * sw
-                if (ii > 0 && ii < (int)this->Regions.size() && ii != i)
-                {
-                    time += this->Regions[ii].time;
-                    count++;
-                }
-            }
-            time /= count;
-            time *= 0.5f;
-
-            time += this->Regions[i].time;
-            times.push_back(time);
-        }
-        for (int i = 0; i < (int)this->Regions.size(); i++)
-            this->Regions[i].time = times[i];
-
-        // sort regions by complexity
-        sort(this->Regions.begin(), this->Regions.end(), [&](const Region& a, const Region& b) -> bool
-        {
-            float aComplexity = (float)(a.time * a.time) / (a.w * a.h);
-            float bComplexity = (float)(b.time * b.time) / (b.w * b.h);
-            return aComplexity < bComplexity;
-        });
-
-        // start from region with smallest complexity then find closest to it, etc.
-        vector<Region> temp = this->Regions;
-        this->Regions.clear();
-        while (!temp.empty())
-        {
-            Region region = temp[0];
-            this->Regions.push_back(region);
-            temp.erase(temp.begin());
-
-            sort(temp.begin(), temp.end(), [&](const Region& a, const Region& b) -> bool
-            {
-                float aDist = (float)(a.x - region.x) * (a.x - region.x) + (a.y - region.y) * (a.y - region.y);
-                float bDist = (float)(b.x - region.x) * (b.x - region.x) + (b.y - region.y) * (b.y - region.y);
-                if (aDist != bDist)
-                    return aDist < bDist;
-                else
-                {
-                    float aComplexity = (float)(a.time * a.time) / (a.w * a.h);
-                    float bComplexity = (float)(b.time * b.time) / (b.w * b.h);
-                    return aComplexity < bComplexity;
-                }
-            });
-        }
-
-        // split last 5 regions
-        int numThreads = (int)this->thread->workersCount();
-        temp.clear();
-        for (int i = 0; i < numThreads * 2; i++)
-        {
-            temp.push_back(this->Regions.back());
-            this->Regions.pop_back();
-        }
-        reverse(temp.begin(), temp.end());
-        for (const auto& region : temp)
+        // the preview's render times are the cost estimates
+        vector<TileScheduler::Tile> tiles;
+        for (int i : regions)
         {
-            this->Regions.push_back(Region(region.x, region.y, region.w / 2, region.h / 2));
-            this->Regions.back().time = region.time * 0.25f;
-            this->Regions.push_back(Region(region.x + region.w / 2, region.y, region.w / 2, region.h / 2));
-            this->Regions.back().time = region.time * 0.25f;
-            this->Regions.push_back(Region(region.x, region.y + region.h / 2, region.w / 2, region.h / 2));
-            this->Regions.back().time = region.time * 0.25f;
-            this->Regions.push_back(Region(region.x + region.w / 2, region.y + region.h / 2, region.w / 2, region.h / 2));
-            this->Regions.back().time = region.time * 0.25f;
+            const Region& region = this->Regions[i];
+            TileScheduler::Tile tile = { region.x, region.y, region.w, region.h, i, region.time };
+            tiles.push_back(tile);
         }
-
-        for (auto& region : this->Regions)
-            region.time = 0.0f;
-
-        this->nextRagion = 0;
-        return true;
+        // the render nodes' workers have the ids after the local ones
+        int workers = (int)this->thread->workersCount() + this->nodesWorkers;
+        if ((int)this->regionBuffers.size() < workers)
+            this->regionBuffers.resize(workers);
+        this->tileScheduler.init(workers, tiles, this->RegionSize, split);
+        this->progressPixels = 0;
     }
 
     void CPURayRenderer::beginFrame()
@@ -395,6 +625,9 @@ namespace MyEngine {
 
         dx = (upRight - upLeft) * (1.0f / this->Width);
         dy = (downLeft - upLeft) * (1.0f / this->Height);
+
+        // angle of a pixel at the middle of the screen, the ray cones grow by it with the distance
+        pixelSpread = dx.length() / (upLeft + dx * (this->Width * 0.5f) + dy * (this->Height * 0.5f)).length();
     }
 
     embree::RTCRay CPURayRenderer::getRTCScreenRay(float x, float y) const
@@ -409,9 +642,8 @@ namespace MyEngine {
             float M = this->focalPlaneDist / cosTheta;
             Vector3 T = start + dir * M;
 
-            Random& rand = Random::getRandomGen();
             float dx, dy;
-            rand.unitDiscSample(dx, dy);
+            Sampler::getSampler().unitDiscSample(dx, dy);
 
             dx *= 10.0f / this->fNumber;
             dy *= 10.0f / this->fNumber;
@@ -429,71 +661,133 @@ namespace MyEngine {
     {
         Profile;
 
-        // Create Scene
-        embree::RTCSceneFlags sflags = embree::RTCSceneFlags::RTC_SCENE_STATIC | embree::RTCSceneFlags::RTC_SCENE_COHERENT;
-        embree::RTCAlgorithmFlags aflags = embree::RTCAlgorithmFlags::RTC_INTERSECT1 | embree::RTCAlgorithmFlags::RTC_INTERSECT4;
-        this->rtcScene = embree::rtcDeviceNewScene(this->rtcDevice, sflags, aflags);
+        // Create Scenes, they are dynamic and kept between the Starts so a frame only updates the changed instances
+        if (this->rtcScene == NULL)
+        {
+            embree::RTCSceneFlags sflags = embree::RTCSceneFlags::RTC_SCENE_DYNAMIC | embree::RTCSceneFlags::RTC_SCENE_COHERENT;
+            embree::RTCAlgorithmFlags aflags = embree::RTCAlgorithmFlags::RTC_INTERSECT1 | embree::RTCAlgorithmFlags::RTC_INTERSECT4;
+            if (this->packetSize == 8)
+                aflags = aflags | embree::RTCAlgorithmFlags::RTC_INTERSECT8;
+            this->rtcScene = embree::rtcDeviceNewScene(this->rtcDevice, sflags, aflags);
+            this->rtcSystemScene = embree::rtcDeviceNewScene(this->rtcDevice, sflags, aflags);
+        }
+        auto geometryMaps = { &this->rtcGeometries, &this->rtcLightGeometries, &this->rtcDynamicGeometries };
+        for (auto rtcGeometries : geometryMaps)
+        {
+            for (auto& rtcGeom : *rtcGeometries)
+                rtcGeom.second.used = false;
+        }
 
-        // Create SceneElements
-        vector<SceneElementPtr> sceneElements = this->Owner->SceneManager->GetElements();
-        for (const auto& sceneElement : sceneElements)
+        // Update SceneElements
+        vector<SceneElementPtr> sceneElements;
+        for (const auto& sceneElement : this->Owner->SceneManager->GetElements())
         {
             if (sceneElement->ContentID == INVALID_ID || !sceneElement->Visible ||
                 sceneElement->Type == SceneElementType::ECamera || sceneElement->Type == SceneElementType::ERenderObject)
                 continue;
+            sceneElements.push_back(sceneElement);
+        }
+        this->updateRTCScene(this->rtcScene, this->rtcSceneInstances, this->rtcInstances, sceneElements);
 
-            embree::RTCScene rtcGeometry = this->createRTCGeometry(sceneElement);
-            if (rtcGeometry != NULL)
-            {
-                uint rtcInstance = embree::rtcNewInstance(this->rtcScene, rtcGeometry);
-                vector<float> matrix = getMatrix(sceneElement->Position, sceneElement->Rotation, sceneElement->Scale);
-                embree::rtcSetTransform(this->rtcScene, rtcInstance, embree::RTCMatrixType::RTC_MATRIX_COLUMN_MAJOR_ALIGNED16, &matrix[0]);
-                embree::rtcUpdate(this->rtcScene, rtcInstance);
+        // Update System Scene
+        sceneElements.clear();
+        for (const auto& sceneElement : this->Owner->SceneManager->GetElements(SceneElementType::ERenderObject))
+        {
+            if (sceneElement->ContentID == INVALID_ID || !sceneElement->Visible)
+                continue;
+            sceneElements.push_back(sceneElement);
+        }
+        this->updateRTCScene(this->rtcSystemScene, this->rtcSystemSceneInstances, this->rtcSystemInstances, sceneElements);
 
-                this->rtcInstances[rtcInstance] = sceneElement;
+        // the committed scenes don't refer to the unused geometries anymore
+        for (auto rtcGeometries : geometryMaps)
+        {
+            for (auto it = rtcGeometries->begin(); it != rtcGeometries->end();)
+            {
+                if (!it->second.used)
+                {
+                    embree::rtcDeleteScene(it->second.rtcGeometry);
+                    it = rtcGeometries->erase(it);
+                }
+                else
+                    it++;
             }
-
-            this->cacheContentElements(sceneElement);
         }
-        embree::rtcCommit(this->rtcScene);
-
+        for (const auto& rtcGeometry : this->rtcReleasedGeometries)
+            embree::rtcDeleteScene(rtcGeometry);
+        this->rtcReleasedGeometries.clear();
+    }
 
-        // Create System Scene
-        this->rtcSystemScene = embree::rtcDeviceNewScene(this->rtcDevice, sflags, aflags);
+    void CPURayRenderer::updateRTCScene(embree::__RTCScene* rtcScene, map<uint, InstanceState>& states, vector<InstanceInfo>& instances, const vector<SceneElementPtr>& sceneElements)
+    {
+        for (auto& state : states)
+            state.second.used = false;
 
-        // Create SceneElements
-        sceneElements = this->Owner->SceneManager->GetElements(SceneElementType::ERenderObject);
         for (const auto& sceneElement : sceneElements)
         {
-            if (sceneElement->ContentID == INVALID_ID || !sceneElement->Visible)
+            embree::RTCScene rtcGeometry = this->createRTCGeometry(sceneElement);
+            this->cacheContentElements(sceneElement);
+            if (rtcGeometry == NULL)
                 continue;
 
-            embree::RTCScene rtcGeometry = this->createRTCGeometry(sceneElement);
-            if (rtcGeometry != NULL)
+            // a new mesh needs a new instance
+            auto it = states.find(sceneElement->ID);
+            if (it != states.end() && it->second.rtcGeometry != rtcGeometry)
+            {
+                embree::rtcDeleteGeometry(rtcScene, it->second.rtcInstance);
+                instances[it->second.rtcInstance] = InstanceInfo();
+                states.erase(it);
+                it = states.end();
+            }
+            if (it == states.end())
             {
-                uint rtcInstance = embree::rtcNewInstance(this->rtcSystemScene, rtcGeometry);
-                vector<float> matrix = getMatrix(sceneElement->Position, sceneElement->Rotation, sceneElement->Scale);
-                embree::rtcSetTransform(this->rtcSystemScene, rtcInstance, embree::RTCMatrixType::RTC_MATRIX_COLUMN_MAJOR_ALIGNED16, &matrix[0]);
-                embree::rtcUpdate(this->rtcSystemScene, rtcInstance);
+                InstanceState state;
+                state.rtcInstance = embree::rtcNewInstance(rtcScene, rtcGeometry);
+                state.rtcGeometry = rtcGeometry;
+                it = states.insert(make_pair(sceneElement->ID, state)).first;
+            }
 
-                this->rtcInstances[-(int)rtcInstance - 2] = sceneElement;
+            // the moved ones and the refitted dynamic objects, their bounds changed
+            InstanceState& state = it->second;
+            vector<float> matrix = getMatrix(sceneElement->Position, sceneElement->Rotation, sceneElement->Scale);
+            if (state.matrix != matrix || sceneElement->Type == SceneElementType::EDynamicObject)
+            {
+                state.matrix = matrix;
+                embree::rtcSetTransform(rtcScene, state.rtcInstance, embree::RTCMatrixType::RTC_MATRIX_COLUMN_MAJOR_ALIGNED16, &state.matrix[0]);
+                embree::rtcUpdate(rtcScene, state.rtcInstance);
             }
+            state.used = true;
 
-            this->cacheContentElements(sceneElement);
+            this->setInstanceInfo(instances, state.rtcInstance, sceneElement);
+        }
+
+        // removed or hidden scene elements
+        for (auto it = states.begin(); it != states.end();)
+        {
+            if (!it->second.used)
+            {
+                embree::rtcDeleteGeometry(rtcScene, it->second.rtcInstance);
+                instances[it->second.rtcInstance] = InstanceInfo();
+                it = states.erase(it);
+            }
+            else
+                it++;
         }
-        embree::rtcCommit(this->rtcSystemScene);
+        embree::rtcCommit(rtcScene);
     }
 
     embree::RTCScene CPURayRenderer::createRTCGeometry(const SceneElementPtr sceneElement)
     {
-        if (this->rtcGeometries.find(sceneElement->ContentID) != this->rtcGeometries.end())
-            return this->rtcGeometries[sceneElement->ContentID];
+        // the lights have their own geometries so the shadow rays could mask them out
+        bool light = sceneElement->Type == SceneElementType::ELight;
+        // a dynamic object has its own mesh instance, so its geometry is refitted instead of shared
+        bool dynamic = sceneElement->Type == SceneElementType::EDynamicObject;
 
         // get mesh
         ContentElementPtr contentElement = NULL;
         if (this->Owner->ContentManager->ContainsElement(sceneElement->ContentID))
         {
-            if (sceneElement->Type != SceneElementType::EDynamicObject)
+            if (!dynamic)
                 contentElement = this->Owner->ContentManager->GetElement(sceneElement->ContentID, true, true);
             else
                 contentElement = this->Owner->ContentManager->GetInstance(sceneElement->ID, sceneElement->ContentID);
@@ -507,35 +801,73 @@ namespace MyEngine {
         this->contentElements[sceneElement->ContentID] = contentElement;
         Mesh* mesh = (Mesh*)contentElement.get();
 
+        // cached geometry of the same mesh and topology
+        auto& rtcGeometries = dynamic ? this->rtcDynamicGeometries : (light ? this->rtcLightGeometries : this->rtcGeometries);
+        uint geometryID = dynamic ? sceneElement->ID : sceneElement->ContentID;
+        auto it = rtcGeometries.find(geometryID);
+        if (it != rtcGeometries.end())
+        {
+            GeometryInfo& geometry = it->second;
+            if (geometry.mesh == contentElement && geometry.vertices == mesh->Vertices.data() && geometry.triangles == mesh->Triangles.data() &&
+                geometry.verticesCount == mesh->Vertices.size() && geometry.trianglesCount == mesh->Triangles.size())
+            {
+                // the vertices are shared, so a refit only needs to know they changed
+                if (dynamic && !geometry.used)
+                {
+                    embree::rtcUpdateBuffer(geometry.rtcGeometry, 0, embree::RTCBufferType::RTC_VERTEX_BUFFER);
+                    embree::rtcCommit(geometry.rtcGeometry);
+                }
+                geometry.used = true;
+                return geometry.rtcGeometry;
+            }
+            // an instance may still refer to it, it's deleted after the scenes are updated
+            this->rtcReleasedGeometries.push_back(geometry.rtcGeometry);
+            rtcGeometries.erase(it);
+        }
+
         // create rtcScene
         embree::RTCSceneFlags sflags = embree::RTCSceneFlags::RTC_SCENE_STATIC | embree::RTCSceneFlags::RTC_SCENE_COHERENT;
+        if (dynamic)
+            sflags = embree::RTCSceneFlags::RTC_SCENE_DYNAMIC | embree::RTCSceneFlags::RTC_SCENE_COHERENT;
         embree::RTCAlgorithmFlags aflags = embree::RTCAlgorithmFlags::RTC_INTERSECT1 | embree::RTCAlgorithmFlags::RTC_INTERSECT4;
+        if (this->packetSize == 8)
+            aflags = aflags | embree::RTCAlgorithmFlags::RTC_INTERSECT8;
         embree::RTCScene rtcGeometry = embree::rtcDeviceNewScene(this->rtcDevice, sflags, aflags);
 
         // create rtcMesh
-        uint meshID = embree::rtcNewTriangleMesh(rtcGeometry, embree::RTCGeometryFlags::RTC_GEOMETRY_STATIC, mesh->Triangles.size(), mesh->Vertices.size());
-        float* vertices = (float*)embree::rtcMapBuffer(rtcGeometry, meshID, embree::RTCBufferType::RTC_VERTEX_BUFFER);
-        int* triangles = (int*)embree::rtcMapBuffer(rtcGeometry, meshID, embree::RTCBufferType::RTC_INDEX_BUFFER);
-        for (int i = 0; i < (int)mesh->Vertices.size(); i++)
-        {
-            vertices[i * 4 + 0] = mesh->Vertices[i].x;
-            vertices[i * 4 + 1] = mesh->Vertices[i].y;
-            vertices[i * 4 + 2] = mesh->Vertices[i].z;
-        }
-        for (int i = 0; i < (int)mesh->Triangles.size(); i++)
-        {
-            triangles[i * 3 + 0] = mesh->Triangles[i].vertices[0];
-            triangles[i * 3 + 1] = mesh->Triangles[i].vertices[1];
-            triangles[i * 3 + 2] = mesh->Triangles[i].vertices[2];
-        }
-        embree::rtcUnmapBuffer(rtcGeometry, meshID, embree::RTCBufferType::RTC_VERTEX_BUFFER);
-        embree::rtcUnmapBuffer(rtcGeometry, meshID, embree::RTCBufferType::RTC_INDEX_BUFFER);
+        embree::RTCGeometryFlags gflags = dynamic ? embree::RTCGeometryFlags::RTC_GEOMETRY_DEFORMABLE : embree::RTCGeometryFlags::RTC_GEOMETRY_STATIC;
+        uint meshID = embree::rtcNewTriangleMesh(rtcGeometry, gflags, mesh->Triangles.size(), mesh->Vertices.size());
+        this->setRTCBuffers(rtcGeometry, meshID, mesh);
+
+        // shadow rays: lights are masked out, transparent occluders are handled by the occlusion filter
+        embree::rtcSetMask(rtcGeometry, meshID, light ? RayMasks::RAY_MASK_LIGHT : RayMasks::RAY_MASK_GEOMETRY);
+        embree::rtcSetUserData(rtcGeometry, meshID, this);
+        embree::rtcSetOcclusionFilterFunction(rtcGeometry, meshID, (embree::RTCFilterFunc)&occlusionFilter);
+        embree::rtcSetOcclusionFilterFunction4(rtcGeometry, meshID, (embree::RTCFilterFunc4)&occlusionFilterN<embree::RTCRay4, 4>);
+        if (this->packetSize == 8)
+            embree::rtcSetOcclusionFilterFunction8(rtcGeometry, meshID, (embree::RTCFilterFunc8)&occlusionFilterN<embree::RTCRay8, 8>);
 
         embree::rtcCommit(rtcGeometry);
-        this->rtcGeometries[sceneElement->ContentID] = rtcGeometry;
+        GeometryInfo& geometry = rtcGeometries[geometryID];
+        geometry.rtcGeometry = rtcGeometry;
+        geometry.mesh = contentElement;
+        geometry.vertices = mesh->Vertices.data();
+        geometry.triangles = mesh->Triangles.data();
+        geometry.verticesCount = mesh->Vertices.size();
+        geometry.trianglesCount = mesh->Triangles.size();
+        geometry.used = true;
         return rtcGeometry;
     }
 
+    void CPURayRenderer::setRTCBuffers(embree::RTCScene rtcGeometry, uint meshID, const Mesh* mesh)
+    {
+        // Embree reads the mesh's own arrays instead of a copy: Vector3 is x, y, z and a readable w pad, and the
+        // position indices are the first ones of a Triangle, so the triangles are passed with their full stride
+        static_assert(sizeof(Vector3) == 4 * sizeof(float), "Vector3 doesn't have Embree's vertex layout");
+        embree::rtcSetBuffer(rtcGeometry, meshID, embree::RTCBufferType::RTC_VERTEX_BUFFER, mesh->Vertices.data(), 0, sizeof(Vector3));
+        embree::rtcSetBuffer(rtcGeometry, meshID, embree::RTCBufferType::RTC_INDEX_BUFFER, mesh->Triangles.data(), offsetof(Triangle, vertices), sizeof(Triangle));
+    }
+
     void CPURayRenderer::cacheContentElements(const SceneElementPtr sceneElement)
     {
         // scene element's material
@@ -627,22 +959,57 @@ namespace MyEngine {
         }
     }
 
+    void CPURayRenderer::setInstanceInfo(vector<InstanceInfo>& instances, uint rtcInstance, const SceneElementPtr sceneElement)
+    {
+        if (instances.size() <= rtcInstance)
+            instances.resize(rtcInstance + 1);
+
+        InstanceInfo& info = instances[rtcInstance];
+        info.element = sceneElement;
+        info.mesh = (Mesh*)this->getContentElement(sceneElement->ContentID);
+        info.material = (Material*)this->getContentElement(sceneElement->MaterialID);
+        info.light = sceneElement->Type == SceneElementType::ELight;
+
+        // the scene element's maps override the material's ones
+        info.diffuseMap = (Texture*)this->getContentElement(sceneElement->Textures.DiffuseMapID);
+        info.normalMap = (Texture*)this->getContentElement(sceneElement->Textures.NormalMapID);
+        if (info.material && sceneElement->Textures.DiffuseMapID == INVALID_ID)
+            info.diffuseMap = (Texture*)this->getContentElement(info.material->Textures.DiffuseMapID);
+        if (info.material && sceneElement->Textures.NormalMapID == INVALID_ID)
+            info.normalMap = (Texture*)this->getContentElement(info.material->Textures.NormalMapID);
+
+        info.scale = sceneElement->Scale;
+        info.normalMatrix[0] = sceneElement->Rotation * Vector3(1.0f, 0.0f, 0.0f);
+        info.normalMatrix[1] = sceneElement->Rotation * Vector3(0.0f, 1.0f, 0.0f);
+        info.normalMatrix[2] = sceneElement->Rotation * Vector3(0.0f, 0.0f, 1.0f);
+    }
+
+    ContentElement* CPURayRenderer::getContentElement(uint id)
+    {
+        auto it = this->contentElements.find(id);
+        return it != this->contentElements.end() ? it->second.get() : NULL;
+    }
+
     InterInfo CPURayRenderer::getInterInfo(const embree::RTCRay& rtcRay, bool onlyColor /* = false */, bool noNormalMap /* = false */)
     {
         Profile;
         Vector3 rayDir(rtcRay.dir[0], rtcRay.dir[1], rtcRay.dir[2]);
 
         InterInfo result;
-        result.sceneElement = this->rtcInstances[rtcRay.instID];
         result.interPos = Vector3(rtcRay.org[0], rtcRay.org[1], rtcRay.org[2]) + rayDir * rtcRay.tfar;
         result.color = Color4::White();
         result.diffuse = 1.0f;
         result.refraction = 0.0f;
         result.reflection = 0.0f;
 
-        if (result.sceneElement)
+        const InstanceInfo* instance = this->getInstanceInfo(rtcRay.instID);
+        if (instance)
         {
-            Mesh* mesh = (Mesh*)this->contentElements[result.sceneElement->ContentID].get();
+            float textureLod = -INFINITY; // log2 of the ray cone footprint in texture coordinates
+            result.sceneElement = instance->element.get();
+            result.material = instance->material;
+
+            const Mesh* mesh = instance->mesh;
             if (mesh)
             {
                 const Triangle& triangle = mesh->Triangles[rtcRay.primID];
@@ -651,85 +1018,47 @@ namespace MyEngine {
                 const Vector3& tC = mesh->TexCoords[triangle.texCoords[2]];
                 result.UV = barycentric(tA, tB, tC, rtcRay.u, rtcRay.v);
 
+                if (instance->diffuseMap || instance->normalMap)
+                    textureLod = this->getTextureLod(rtcRay, *instance, triangle);
+
                 if (!onlyColor)
                 {
                     const Vector3& nA = mesh->Normals[triangle.normals[0]];
                     const Vector3& nB = mesh->Normals[triangle.normals[1]];
                     const Vector3& nC = mesh->Normals[triangle.normals[2]];
-                    result.normal = barycentric(nA, nB, nC, rtcRay.u, rtcRay.v);
-                    result.normal = result.sceneElement->Rotation * result.normal;
+                    result.normal = instance->rotateNormal(barycentric(nA, nB, nC, rtcRay.u, rtcRay.v));
                 }
             }
 
-            Material* material = (Material*)this->contentElements[result.sceneElement->MaterialID].get();
+            const Material* material = instance->material;
             if (material)
             {
                 result.color = material->DiffuseColor;
                 result.refraction = 1.0f - material->DiffuseColor.a;
                 result.reflection = 1.0f - material->SpecularColor.a;
+            }
 
-                // diffuse map
-                Texture* diffuseMap = NULL;
-                if (result.sceneElement->Textures.DiffuseMapID != INVALID_ID)
-                    diffuseMap = (Texture*)this->contentElements[result.sceneElement->Textures.DiffuseMapID].get();
-                else
-                    diffuseMap = (Texture*)this->contentElements[material->Textures.DiffuseMapID].get();
-
-                if (diffuseMap)
-                {
-                    result.color *= diffuseMap->GetColor(result.UV.x, result.UV.y);
-                    result.refraction = 1.0f - result.color.a;
-                }
-
-                // normal map
-                if (!onlyColor)
-                {
-                    Texture* normalMap = NULL;
-                    if (result.sceneElement->Textures.NormalMapID != INVALID_ID)
-                        normalMap = (Texture*)this->contentElements[result.sceneElement->Textures.NormalMapID].get();
-                    else
-                        normalMap = (Texture*)this->contentElements[material->Textures.NormalMapID].get();
-
-                    if (normalMap)
-                    {
-                        Color4 n = normalMap->GetColor(result.UV.x, result.UV.y);
-                        if (!noNormalMap)
-                        {
-                            Vector3 bumpN = Vector3((n.r - 0.5f) * 2.0f, (n.g - 0.5f) * 2.0f, (n.b - 0.5f) * 2.0f);
-                            Vector3 pn1, pn2;
-                            orthonormedSystem(result.normal, pn1, pn2);
-                            result.normal += pn1 * bumpN.x + pn2 * bumpN.y;
-                        }
-
-                        result.reflection = 1.0f - (material->SpecularColor.a * n.a);
-                    }
-                }
+            // diffuse map
+            if (instance->diffuseMap)
+            {
+                Color4 c = instance->diffuseMap->GetColor(result.UV.x, result.UV.y, textureLod + instance->diffuseMap->GetLodBias());
+                result.color = material ? result.color * c : c;
+                result.refraction = 1.0f - result.color.a;
             }
-            else // scene element's maps
+
+            // normal map
+            if (!onlyColor && instance->normalMap)
             {
-                // diffuse map
-                Texture* diffuseMap = (Texture*)this->contentElements[result.sceneElement->Textures.DiffuseMapID].get();
-                if (diffuseMap)
+                Color4 n = instance->normalMap->GetColor(result.UV.x, result.UV.y, textureLod + instance->normalMap->GetLodBias());
+                if (!noNormalMap || !material)
                 {
-                    result.color = diffuseMap->GetColor(result.UV.x, result.UV.y);
-                    result.refraction = 1.0f - result.color.a;
+                    Vector3 bumpN = Vector3((n.r - 0.5f) * 2.0f, (n.g - 0.5f) * 2.0f, (n.b - 0.5f) * 2.0f);
+                    Vector3 pn1, pn2;
+                    orthonormedSystem(result.normal, pn1, pn2);
+                    result.normal += pn1 * bumpN.x + pn2 * bumpN.y;
                 }
 
-                // normal map
-                if (!onlyColor)
-                {
-                    Texture* normalMap = (Texture*)this->contentElements[result.sceneElement->Textures.NormalMapID].get();
-                    if (normalMap)
-                    {
-                        Color4 n = normalMap->GetColor(result.UV.x, result.UV.y);
-                        Vector3 bumpN = Vector3((n.r - 0.5f) * 2.0f, (n.g - 0.5f) * 2.0f, (n.b - 0.5f) * 2.0f);
-                        Vector3 pn1, pn2;
-                        orthonormedSystem(result.normal, pn1, pn2);
-                        result.normal += pn1 * bumpN.x + pn2 * bumpN.y;
-
-                        result.reflection = 1.0f - n.a;
-                    }
-                }
+                result.reflection = 1.0f - ((material ? material->SpecularColor.a : 1.0f) * n.a);
             }
             result.normal.normalize();
             result.normal = faceforward(rayDir, result.normal);
@@ -766,6 +1095,32 @@ namespace MyEngine {
         return result;
     }
 
+    float CPURayRenderer::getRayConeWidth(const embree::RTCRay& rtcRay) const
+    {
+        return rtcRay.align2 + this->pixelSpread * rtcRay.tfar;
+    }
+
+    float CPURayRenderer::getTextureLod(const embree::RTCRay& rtcRay, const InstanceInfo& instance, const Triangle& triangle) const
+    {
+        // ray cone footprint on the triangle (Akenine-Moller et al. 2019), the texel density comes from the ratio of the
+        // triangle's area in texture coordinates and in the world
+        const Mesh* mesh = instance.mesh;
+        const Vector3& tA = mesh->TexCoords[triangle.texCoords[0]];
+        Vector3 tAB = mesh->TexCoords[triangle.texCoords[1]] - tA;
+        Vector3 tAC = mesh->TexCoords[triangle.texCoords[2]] - tA;
+        float uvArea = fabs(tAB.x * tAC.y - tAC.x * tAB.y);
+
+        const Vector3& pA = mesh->Vertices[triangle.vertices[0]];
+        Vector3 n = cross((mesh->Vertices[triangle.vertices[1]] - pA) * instance.scale, (mesh->Vertices[triangle.vertices[2]] - pA) * instance.scale);
+        float area = n.length();
+        if (uvArea <= 0.0f || area <= 0.0f)
+            return -INFINITY;
+
+        n = instance.rotateNormal(n) * (1.0f / area);
+        float cosine = fabs(dot(n, Vector3(rtcRay.dir[0], rtcRay.dir[1], rtcRay.dir[2])));
+        return 0.5f * log2(uvArea / area) + log2(this->getRayConeWidth(rtcRay) / max(cosine, 0.01f));
+    }
+
     void CPURayRenderer::processRenderElements(embree::RTCRay& rtcRay, InterInfo& interInfo)
     {
         embree::RTCRay rtcSysRay = rtcRay;
@@ -780,7 +1135,7 @@ namespace MyEngine {
         if (!interInfoSys.sceneElement || interInfoSys.sceneElement->Type != SceneElementType::ERenderObject)
             return;
 
-        RenderElement* re = (RenderElement*)interInfoSys.sceneElement.get();
+        RenderElement* re = (RenderElement*)interInfoSys.sceneElement;
         if (re->RType == RenderElementType::ESlicer && rtcRay.tfar < rtcSysRay.tfar)
         {
             int count = 1;
@@ -827,175 +1182,236 @@ namespace MyEngine {
     {
         Profile;
 
-        const int delta = this->RegionSize / 8;
-        const float minDist = 1.0f;
         if (!this->IsStarted)
             return false;
 
-        // generate initial samples
-        Random& rand = Random::getRandomGen();
+        // the initial samples are on a jittered grid, a task traces a row of them
+        const int delta = this->RegionSize / 8;
         const int w = (this->Width / delta) + 1;
-        KdTree<Vector3> irrKdTree(2);
-        for (uint j = 0; j <= this->Height; j += delta)
-        {
-            for (uint i = 0; i <= this->Width; i += delta)
-            {
-                if (!this->IsStarted)
-                    return false;
+        const int h = (this->Height / delta) + 1;
+        this->irrMapSamples.assign(w * h, IrradianceMapSample());
+        this->irrMapTriangles.clear();
+        this->irrMapAdjacency.clear();
+        this->irrMapPending.clear();
+        this->irrMapSplits.clear();
+        this->irrMapKdTree.clear();
 
-                int x = min(i, this->Width - 1);
-                if (x > 0 && x < (int)this->Width - 1) x += rand.randInt(0, delta / 2);
-                int y = min(j, this->Height - 1);
-                if (y > 0 && y < (int)this->Height - 1) y += rand.randInt(0, delta / 2);
-                if (!this->addIrradianceMapSample(x + rand.randFloat(), y + rand.randFloat(), irrKdTree, minDist))
-                    continue;
+        nextSample = 0;
+        this->thread->addNTasks([&](int) { while (this->traceIrradianceMapRow()); return true; });
+        this->thread->addWaitTask();
+        this->thread->addTask([&](int) { return this->triangulateIrradianceMap(); });
+        return true;
+    }
 
-                if (j > 0 && i > 0) // create triangles
-                {
-                    int curr = (int)this->irrMapSamples.size() - 1;
-                    bool d1 = (this->irrMapSamples[curr].id == this->irrMapSamples[curr - 1 - w].id); // the samples on diagonal 1 are on the same scene element
-                    bool d2 = (this->irrMapSamples[curr - 1].id == this->irrMapSamples[curr - w].id); // the samples on diagonal 2 are on the same scene element
-                    if ((d1 && !d2) || (d1 == d2 && (i / delta + j / delta) % 2 == 0))
-                    {
-                        this->addIrradianceMapTriangle(curr, curr - 1 - w, curr - 1);
-                        this->addIrradianceMapTriangle(curr, curr - w, curr - 1 - w);
-                    }
-                    else
-                    {
-                        this->addIrradianceMapTriangle(curr, curr - w, curr - 1);
-                        this->addIrradianceMapTriangle(curr - 1, curr - w, curr - 1 - w);
-                    }
-                }
+    bool CPURayRenderer::traceIrradianceMapRow()
+    {
+        Profile;
+
+        const int delta = this->RegionSize / 8;
+        const int w = (this->Width / delta) + 1;
+        int row = nextSample++;
+        if (!this->IsStarted || row * w >= (int)this->irrMapSamples.size())
+            return false;
+
+        Random& rand = Random::getRandomGen();
+        uint j = row * delta;
+        for (int col = 0; col < w; col++)
+        {
+            uint i = col * delta;
+            int x = min(i, this->Width - 1);
+            if (x > 0 && x < (int)this->Width - 1) x += rand.randInt(0, delta / 2);
+            int y = min(j, this->Height - 1);
+            if (y > 0 && y < (int)this->Height - 1) y += rand.randInt(0, delta / 2);
+
+            IrradianceMapSample& sample = this->irrMapSamples[row * w + col];
+            sample.x = x + rand.randFloat();
+            sample.y = y + rand.randFloat();
+            this->traceIrradianceMapSample(sample);
+        }
+        return true;
+    }
+
+    bool CPURayRenderer::triangulateIrradianceMap()
+    {
+        Profile;
+
+        if (!this->IsStarted)
+            return false;
+
+        const int delta = this->RegionSize / 8;
+        const int w = (this->Width / delta) + 1;
+        const int h = (this->Height / delta) + 1;
+        for (int row = 1; row < h; row++)
+        {
+            for (int col = 1; col < w; col++)
+            {
+                int curr = row * w + col;
+                bool d1 = (this->irrMapSamples[curr].id == this->irrMapSamples[curr - 1 - w].id); // the samples on diagonal 1 are on the same scene element
+                bool d2 = (this->irrMapSamples[curr - 1].id == this->irrMapSamples[curr - w].id); // the samples on diagonal 2 are on the same scene element
+                if ((d1 && !d2) || (d1 == d2 && (col + row) % 2 == 0))
+                {
+                    this->addIrradianceMapTriangle(curr, curr - 1 - w, curr - 1);
+                    this->addIrradianceMapTriangle(curr, curr - w, curr - 1 - w);
+                }
+                else
+                {
+                    this->addIrradianceMapTriangle(curr, curr - w, curr - 1);
+                    this->addIrradianceMapTriangle(curr - 1, curr - w, curr - 1 - w);
+                }
             }
         }
 
-        // generate more samples if it's needed
-        for (int i = 0; i < (int)this->irrMapTriangles.size(); i += 3)
+        // link the grid's half-edges, the edge from v1 to v2 is the twin of the one from v2 to v1
+        map<pair<int, int>, int> edges;
+        for (int e = 0; e < (int)this->irrMapTriangles.size(); e++)
         {
-            if (!this->IsStarted)
-                return false;
+            int v1 = this->irrMapTriangles[e];
+            int v2 = this->irrMapTriangles[e - e % 3 + (e + 1) % 3];
+            auto it = edges.find(make_pair(v2, v1));
+            if (it != edges.end())
+                this->linkIrradianceMapEdges(e, it->second);
+            else
+                edges[make_pair(v1, v2)] = e;
+        }
+
+        for (int i = 0; i < (int)this->irrMapSamples.size(); i++)
+        {
+            const IrradianceMapSample& sample = this->irrMapSamples[i];
+            this->Buffers["Samples"].setElement((uint)sample.x, (uint)sample.y, this->Buffers["Samples"].getElement((uint)sample.x, (uint)sample.y) + Color4(0.0f, 1.0f, 0.0f));
+        }
+        this->irrMapKdTree.build((int)this->irrMapSamples.size(), [&](int idx) { return Vector3(this->irrMapSamples[idx].x, this->irrMapSamples[idx].y, 0.0); });
+
+        for (int i = 0; i < (int)this->irrMapTriangles.size() / 3; i++)
+            this->irrMapPending.push_back(i);
+        return this->refineIrradianceMap();
+    }
 
-            // spit between v1 and v2
-            int v0 = -1, v1 = -1, v2 = -1, v3 = -1;
+    bool CPURayRenderer::refineIrradianceMap()
+    {
+        Profile;
 
-            // find edge to spilt - first by different scene elements, second on everthing else
-            float dist = 0.0f;
-            for (int j = 0; j < 3; j++)
+        while (this->IsStarted)
+        {
+            // add the samples traced for the splits of the previous pass
+            for (const auto& split : this->irrMapSplits)
             {
-                const IrradianceMapSample& sample1 = this->irrMapSamples[this->irrMapTriangles[i + (j + 0) % 3]];
-                const IrradianceMapSample& sample2 = this->irrMapSamples[this->irrMapTriangles[i + (j + 1) % 3]];
-                if ((abs(sample1.x - sample2.x) < minDist * 2 && abs(sample1.y - sample2.y) < minDist * 2))
-                    continue;
-                if (sample1.color.intensity() < 0.0f && sample2.color.intensity() < 0.0f) // dont't split if there aren't static objects
-                    continue;
+                const IrradianceMapSample& sample0 = this->irrMapSamples[split.v0];
+                const IrradianceMapSample& sample1 = this->irrMapSamples[split.v1];
+                const IrradianceMapSample& sample2 = this->irrMapSamples[split.v2];
+                const IrradianceMapSample& sample3 = this->irrMapSamples[split.v3];
+                bool flip = abs(sample1.x - sample2.x) + abs(sample1.y - sample2.y) > abs(sample0.x - sample3.x) + abs(sample0.y - sample3.y);
 
-                // if samples didn't good enought
-                float d = abs(sample1.x - sample2.x) + abs(sample1.y - sample2.y);
-                if ((sample1.id != sample2.id ||
-                    (sample1.position - sample2.position).length() > this->IrradianceMapDistanceThreshold ||
-                    (sample1.normal - sample2.normal).length() > this->IrradianceMapNormalThreshold ||
-                    (sample1.color - sample2.color).intensity() > this->IrradianceMapColorThreshold) &&
-                    d > dist)
+                if (this->addIrradianceMapSample(split.sample))
                 {
-                    v1 = this->irrMapTriangles[i + (j + 0) % 3];
-                    v2 = this->irrMapTriangles[i + (j + 1) % 3];
-                    v0 = this->irrMapTriangles[i + (j + 2) % 3];
-                    dist = d;
+                    this->splitIrradianceMapTriangles(split, (int)this->irrMapSamples.size() - 1);
+                    this->irrMapPending.push_back((int)this->irrMapTriangles.size() / 3 - 2);
+                    this->irrMapPending.push_back((int)this->irrMapTriangles.size() / 3 - 1);
                 }
+                else if (flip)
+                    this->flipIrradianceMapTriangles(split);
+                else
+                    continue;
+
+                this->irrMapPending.push_back(split.triangle1);
+                this->irrMapPending.push_back(split.triangle2);
             }
+            this->irrMapSplits.clear();
 
-            if (v0 != -1 && v1 != -1 && v2 != -1)
+            // choose the edges to split, a triangle takes part in a split once a pass, the others wait for the next one
+            vector<int> pending;
+            pending.swap(this->irrMapPending);
+            vector<byte> checked(this->irrMapTriangles.size() / 3, 0);
+            for (int triangle : pending)
             {
-                // find opposite triangle
-                int trgl2 = -1;
-                for (int k = 0; k < (int)this->irrMapTriangles.size(); k += 3)
+                if (checked[triangle])
+                    continue;
+                checked[triangle] = 1;
+
+                IrradianceMapSplit split;
+                if (!this->getIrradianceMapSplitEdge(triangle, split.v0, split.v1, split.v2))
+                    continue;
+
+                int twin = this->irrMapAdjacency[this->findIrradianceMapEdge(triangle, split.v1, split.v2)];
+                if (twin == -1)
+                    continue;
+                if (checked[twin / 3])
                 {
-                    int i1 = -1, i2 = -1, i3 = -1;
-                    for (int j = 0; j < 3; j++)
-                    {
-                        if (this->irrMapTriangles[k + j] == v1)
-                            i1 = k + j;
-                        else if (this->irrMapTriangles[k + j] == v2)
-                            i2 = k + j;
-                        else if (this->irrMapTriangles[k + j] != v0)
-                            i3 = k + j;
-                    }
-                    if (i1 != -1 && i2 != -1 && i3 != -1)
-                    {
-                        v3 = this->irrMapTriangles[i3];
-                        trgl2 = k;
-                        break;
-                    }
+                    this->irrMapPending.push_back(triangle);
+                    continue;
                 }
+                checked[twin / 3] = 1;
 
-                // split
-                if (v3 != -1)
-                {
-                    const IrradianceMapSample& sample1 = this->irrMapSamples[v1];
-                    const IrradianceMapSample& sample2 = this->irrMapSamples[v2];
-                    float x = (sample1.x + sample2.x) / 2.0f;
-                    float y = (sample1.y + sample2.y) / 2.0f;
-                    // if we split because of different scene elements find best split point
-                    if (sample1.id != sample2.id)
-                    {
-                        for (float f = 0.1f; f < 1.0f; f += 0.1f)
-                        {
-                            x = sample1.x * (1.0f - f) + sample2.x * f;
-                            y = sample1.y * (1.0f - f) + sample2.y * f;
-                            if (abs(x - sample1.x) < minDist && abs(y - sample1.y) < minDist)
-                                continue;
-                            if (abs(x - sample2.x) < minDist && abs(y - sample2.y) < minDist)
-                            {
-                                f -= 0.1f;
-                                x = sample1.x * (1.0f - f) + sample2.x * f;
-                                y = sample1.y * (1.0f - f) + sample2.y * f;
-                                break;
-                            }
-                            embree::RTCRay rtcRay = this->getRTCScreenRay(x, y);
-                            embree::rtcIntersect(this->rtcScene, rtcRay);
-                            if (this->rtcInstances[rtcRay.instID] && this->rtcInstances[rtcRay.instID]->ID == sample2.id)
-                                break;
-                        }
-                    }
+                split.triangle1 = triangle;
+                split.triangle2 = twin / 3;
+                split.v3 = this->irrMapTriangles[twin - twin % 3 + (twin + 2) % 3];
+                this->irrMapSplits.push_back(split);
+            }
 
-                    bool split = this->addIrradianceMapSample(x, y, irrKdTree, minDist);
-                    if (split)
-                    {
-                        int curr = (int)this->irrMapSamples.size() - 1;
-                        // split current triangle and opposite one also to 2 new triangles
-                        this->addIrradianceMapTriangle(v0, v1, curr);
-                        this->addIrradianceMapTriangle(v0, curr, v2);
-                        this->addIrradianceMapTriangle(v3, curr, v1);
-                        this->addIrradianceMapTriangle(v3, v2, curr);
-
-                        // remove current and opposite triangle
-                        if (trgl2 > i)
-                        {
-                            this->irrMapTriangles.erase(this->irrMapTriangles.begin() + trgl2, this->irrMapTriangles.begin() + trgl2 + 3);
-                            this->irrMapTriangles.erase(this->irrMapTriangles.begin() + i, this->irrMapTriangles.begin() + i + 3);
-                            i -= 3;
-                        }
-                        else
-                        {
-                            this->irrMapTriangles.erase(this->irrMapTriangles.begin() + i, this->irrMapTriangles.begin() + i + 3);
-                            this->irrMapTriangles.erase(this->irrMapTriangles.begin() + trgl2, this->irrMapTriangles.begin() + trgl2 + 3);
-                            i -= 6;
-                        }
-                    }
-                    else if (abs(sample1.x - sample2.x) + abs(sample1.y - sample2.y) > abs(this->irrMapSamples[v0].x - this->irrMapSamples[v3].x) + abs(this->irrMapSamples[v0].y - this->irrMapSamples[v3].y))
-                    {
-                        // change the triangulation from (v0, v1, v2), (v3, v2, v1) to (v0, v1, v3), (v0, v3, v2)
-                        this->irrMapTriangles[i + 0] = v0;
-                        this->irrMapTriangles[i + 1] = v1;
-                        this->irrMapTriangles[i + 2] = v3;
-                        this->irrMapTriangles[trgl2 + 0] = v0;
-                        this->irrMapTriangles[trgl2 + 1] = v3;
-                        this->irrMapTriangles[trgl2 + 2] = v2;
-                    }
+            if (this->irrMapSplits.empty())
+                return this->finishIrradianceMap();
+
+            nextSample = 0;
+            if (this->irrMapSplits.size() >= this->thread->workersCount() * 16)
+            {
+                this->thread->addNTasks([&](int) { while (this->traceIrradianceMapSplit()); return true; });
+                this->thread->addWaitTask();
+                this->thread->addTask([&](int) { return this->refineIrradianceMap(); });
+                return true;
+            }
+
+            // too few for a pass of the thread pool
+            while (this->traceIrradianceMapSplit());
+        }
+        return false;
+    }
+
+    bool CPURayRenderer::traceIrradianceMapSplit()
+    {
+        Profile;
+
+        int splitIdx = nextSample++;
+        if (!this->IsStarted || splitIdx >= (int)this->irrMapSplits.size())
+            return false;
+
+        IrradianceMapSplit& split = this->irrMapSplits[splitIdx];
+        const IrradianceMapSample& sample1 = this->irrMapSamples[split.v1];
+        const IrradianceMapSample& sample2 = this->irrMapSamples[split.v2];
+        float x = (sample1.x + sample2.x) / 2.0f;
+        float y = (sample1.y + sample2.y) / 2.0f;
+        // if we split because of different scene elements find best split point
+        if (sample1.id != sample2.id)
+        {
+            for (float f = 0.1f; f < 1.0f; f += 0.1f)
+            {
+                x = sample1.x * (1.0f - f) + sample2.x * f;
+                y = sample1.y * (1.0f - f) + sample2.y * f;
+                if (abs(x - sample1.x) < IRRADIANCE_MAP_MIN_DIST && abs(y - sample1.y) < IRRADIANCE_MAP_MIN_DIST)
+                    continue;
+                if (abs(x - sample2.x) < IRRADIANCE_MAP_MIN_DIST && abs(y - sample2.y) < IRRADIANCE_MAP_MIN_DIST)
+                {
+                    f -= 0.1f;
+                    x = sample1.x * (1.0f - f) + sample2.x * f;
+                    y = sample1.y * (1.0f - f) + sample2.y * f;
+                    break;
                 }
+                embree::RTCRay rtcRay = this->getRTCScreenRay(x, y);
+                embree::rtcIntersect(this->rtcScene, rtcRay);
+                const InstanceInfo* instance = this->getInstanceInfo(rtcRay.instID);
+                if (instance && instance->element->ID == sample2.id)
+                    break;
             }
         }
 
+        split.sample.x = x;
+        split.sample.y = y;
+        this->traceIrradianceMapSample(split.sample);
+        return true;
+    }
+
+    bool CPURayRenderer::finishIrradianceMap()
+    {
+        Profile;
+
         /* Save to OBJ file
         ofstream ofile("1.obj");
         //for (int i = 0; i < this->irrMapSamples.size(); i++)
@@ -1007,80 +1423,183 @@ namespace MyEngine {
         ofile << "# " << i << endl << "f " << (this->irrMapTriangles[i + 0] + 1) << " " << (this->irrMapTriangles[i + 1] + 1) << " " << (this->irrMapTriangles[i + 2] + 1) << endl;
         ofile.close();//*/
 
+        this->createIrradianceMapScene();
+
+        // the samples' indirect lighting
+        nextSample = 0;
+        this->thread->addNTasks([&](int) { while (this->computeIrradianceMap()); return true; });
+        this->thread->addWaitTask();
+        this->thread->addTask([&](int) { Engine::Log(LogType::ELog, "CPURayRenderer", duration_to_string(this->phasePofiler->stop()) + " Irradiance Map phase time"); return true; });
+        this->thread->addWaitTask();
+        this->addRenderTasks();
+        return true;
+    }
+
+    void CPURayRenderer::createIrradianceMapScene()
+    {
         // create rtcScene
         embree::RTCSceneFlags sflags = embree::RTCSceneFlags::RTC_SCENE_STATIC | embree::RTCSceneFlags::RTC_SCENE_COHERENT;
         embree::RTCAlgorithmFlags aflags = embree::RTCAlgorithmFlags::RTC_INTERSECT1;
         this->rtcIrrMapScene = embree::rtcDeviceNewScene(this->rtcDevice, sflags, aflags);
 
         // create rtcMesh
+        // shares the samples' positions and the triangles, they don't change until the scene is deleted in the next Start
         uint meshID = embree::rtcNewTriangleMesh(this->rtcIrrMapScene, embree::RTCGeometryFlags::RTC_GEOMETRY_STATIC, this->irrMapTriangles.size() / 3, this->irrMapSamples.size());
-        float* vertices = (float*)embree::rtcMapBuffer(this->rtcIrrMapScene, meshID, embree::RTCBufferType::RTC_VERTEX_BUFFER);
-        int* triangles = (int*)embree::rtcMapBuffer(this->rtcIrrMapScene, meshID, embree::RTCBufferType::RTC_INDEX_BUFFER);
-        for (int i = 0; i < (int)this->irrMapSamples.size(); i++)
-        {
-            vertices[i * 4 + 0] = this->irrMapSamples[i].position.x;
-            vertices[i * 4 + 1] = this->irrMapSamples[i].position.y;
-            vertices[i * 4 + 2] = this->irrMapSamples[i].position.z;
-        }
-        for (int i = 0; i < (int)this->irrMapTriangles.size(); i += 3)
-        {
-            triangles[i + 0] = this->irrMapTriangles[i + 0];
-            triangles[i + 1] = this->irrMapTriangles[i + 1];
-            triangles[i + 2] = this->irrMapTriangles[i + 2];
-        }
-        embree::rtcUnmapBuffer(this->rtcIrrMapScene, meshID, embree::RTCBufferType::RTC_VERTEX_BUFFER);
-        embree::rtcUnmapBuffer(this->rtcIrrMapScene, meshID, embree::RTCBufferType::RTC_INDEX_BUFFER);
+        embree::rtcSetBuffer(this->rtcIrrMapScene, meshID, embree::RTCBufferType::RTC_VERTEX_BUFFER, this->irrMapSamples.data(),
+            offsetof(IrradianceMapSample, position), sizeof(IrradianceMapSample));
+        embree::rtcSetBuffer(this->rtcIrrMapScene, meshID, embree::RTCBufferType::RTC_INDEX_BUFFER, this->irrMapTriangles.data(), 0, 3 * sizeof(int));
 
         embree::rtcCommit(this->rtcIrrMapScene);
-
-        nextSample = 0;
-        return true;
     }
 
-    bool CPURayRenderer::addIrradianceMapSample(float x, float y, KdTree<Vector3>& irrKdTree, float minDist)
+    void CPURayRenderer::traceIrradianceMapSample(IrradianceMapSample& sample)
     {
-        IrradianceMapSample newSample;
-        newSample.x = x;
-        newSample.y = y;
-
-        // check if there is near sample already
-        vector<int> indices;
-        irrKdTree.find_nearest(Vector3(newSample.x, newSample.y, 0.0), [&](int idx) { return Vector3(this->irrMapSamples[idx].x, this->irrMapSamples[idx].y, 0.0); }, 1, indices);
-        if (indices.size() > 0)
-        {
-            const IrradianceMapSample& sample = this->irrMapSamples[indices[0]];
-            if (abs(newSample.x - sample.x) < minDist && abs(newSample.y - sample.y) < minDist)
-                return false;
-        }
-
-        embree::RTCRay rtcRay = this->getRTCScreenRay(newSample.x, newSample.y);
+        embree::RTCRay rtcRay = this->getRTCScreenRay(sample.x, sample.y);
         embree::rtcIntersect(this->rtcScene, rtcRay);
-        newSample.color = Color4(-1.0f, -1.0f, -1.0f);
+        sample.color = Color4(-1.0f, -1.0f, -1.0f);
         if (rtcRay.instID != RTC_INVALID_GEOMETRY_ID)
         {
             InterInfo interInfo = this->getInterInfo(rtcRay, false, true);
             this->processRenderElements(rtcRay, interInfo);
             if (rtcRay.instID != RTC_INVALID_GEOMETRY_ID)
             {
-                newSample.id = interInfo.sceneElement->ID;
-                newSample.position = interInfo.interPos;
-                newSample.normal = interInfo.normal;
+                sample.id = interInfo.sceneElement->ID;
+                sample.position = interInfo.interPos;
+                sample.normal = interInfo.normal;
                 if (interInfo.sceneElement->Type == SceneElementType::EStaticObject)
-                    newSample.color = this->getLighting(rtcRay, interInfo)["DirectLight"];
+                    sample.color = this->getLighting(rtcRay, interInfo)[EDirectLight];
             }
         }
+    }
+
+    bool CPURayRenderer::addIrradianceMapSample(const IrradianceMapSample& newSample)
+    {
+        // check if there is near sample already
+        vector<int> indices;
+        this->irrMapKdTree.find_nearest(Vector3(newSample.x, newSample.y, 0.0), [&](int idx) { return Vector3(this->irrMapSamples[idx].x, this->irrMapSamples[idx].y, 0.0); }, 1, indices);
+        if (indices.size() > 0)
+        {
+            const IrradianceMapSample& sample = this->irrMapSamples[indices[0]];
+            if (abs(newSample.x - sample.x) < IRRADIANCE_MAP_MIN_DIST && abs(newSample.y - sample.y) < IRRADIANCE_MAP_MIN_DIST)
+                return false;
+        }
+
         this->irrMapSamples.push_back(newSample);
 
-        irrKdTree.insert((int)this->irrMapSamples.size() - 1, [&](int idx) { return Vector3(this->irrMapSamples[idx].x, this->irrMapSamples[idx].y, 0.0); });
+        this->irrMapKdTree.insert((int)this->irrMapSamples.size() - 1, [&](int idx) { return Vector3(this->irrMapSamples[idx].x, this->irrMapSamples[idx].y, 0.0); });
         this->Buffers["Samples"].setElement((uint)newSample.x, (uint)newSample.y, this->Buffers["Samples"].getElement((uint)newSample.x, (uint)newSample.y) + Color4(0.0f, 1.0f, 0.0f));
         return true;
     }
 
-    void CPURayRenderer::addIrradianceMapTriangle(int v1, int v2, int v3)
+    bool CPURayRenderer::getIrradianceMapSplitEdge(int triangle, int& v0, int& v1, int& v2) const
+    {
+        // find edge to spilt - first by different scene elements, second on everthing else
+        const int* vertices = &this->irrMapTriangles[triangle * 3];
+        v0 = v1 = v2 = -1;
+        float dist = 0.0f;
+        for (int j = 0; j < 3; j++)
+        {
+            const IrradianceMapSample& sample1 = this->irrMapSamples[vertices[(j + 0) % 3]];
+            const IrradianceMapSample& sample2 = this->irrMapSamples[vertices[(j + 1) % 3]];
+            if ((abs(sample1.x - sample2.x) < IRRADIANCE_MAP_MIN_DIST * 2 && abs(sample1.y - sample2.y) < IRRADIANCE_MAP_MIN_DIST * 2))
+                continue;
+            if (sample1.color.intensity() < 0.0f && sample2.color.intensity() < 0.0f) // dont't split if there aren't static objects
+                continue;
+
+            // if samples didn't good enought
+            float d = abs(sample1.x - sample2.x) + abs(sample1.y - sample2.y);
+            if ((sample1.id != sample2.id ||
+                (sample1.position - sample2.position).length() > this->IrradianceMapDistanceThreshold ||
+                (sample1.normal - sample2.normal).length() > this->IrradianceMapNormalThreshold ||
+                (sample1.color - sample2.color).intensity() > this->IrradianceMapColorThreshold) &&
+                d > dist)
+            {
+                v1 = vertices[(j + 0) % 3];
+                v2 = vertices[(j + 1) % 3];
+                v0 = vertices[(j + 2) % 3];
+                dist = d;
+            }
+        }
+        return v0 != -1;
+    }
+
+    int CPURayRenderer::addIrradianceMapTriangle(int v1, int v2, int v3)
     {
         this->irrMapTriangles.push_back(v1);
         this->irrMapTriangles.push_back(v2);
         this->irrMapTriangles.push_back(v3);
+        this->irrMapAdjacency.resize(this->irrMapTriangles.size(), -1);
+        return (int)this->irrMapTriangles.size() / 3 - 1;
+    }
+
+    void CPURayRenderer::setIrradianceMapTriangle(int triangle, int v1, int v2, int v3)
+    {
+        this->irrMapTriangles[triangle * 3 + 0] = v1;
+        this->irrMapTriangles[triangle * 3 + 1] = v2;
+        this->irrMapTriangles[triangle * 3 + 2] = v3;
+    }
+
+    int CPURayRenderer::findIrradianceMapEdge(int triangle, int v1, int v2) const
+    {
+        for (int j = 0; j < 3; j++)
+        {
+            if (this->irrMapTriangles[triangle * 3 + j] == v1 && this->irrMapTriangles[triangle * 3 + (j + 1) % 3] == v2)
+                return triangle * 3 + j;
+        }
+        return -1;
+    }
+
+    void CPURayRenderer::linkIrradianceMapEdges(int edge1, int edge2)
+    {
+        if (edge1 != -1)
+            this->irrMapAdjacency[edge1] = edge2;
+        if (edge2 != -1)
+            this->irrMapAdjacency[edge2] = edge1;
+    }
+
+    void CPURayRenderer::splitIrradianceMapTriangles(const IrradianceMapSplit& split, int sample)
+    {
+        int v0 = split.v0, v1 = split.v1, v2 = split.v2, v3 = split.v3;
+        int e01 = this->irrMapAdjacency[this->findIrradianceMapEdge(split.triangle1, v0, v1)];
+        int e20 = this->irrMapAdjacency[this->findIrradianceMapEdge(split.triangle1, v2, v0)];
+        int e13 = this->irrMapAdjacency[this->findIrradianceMapEdge(split.triangle2, v1, v3)];
+        int e32 = this->irrMapAdjacency[this->findIrradianceMapEdge(split.triangle2, v3, v2)];
+
+        // (v0, v1, v2), (v3, v2, v1) to (v0, v1, s), (v0, s, v2), (v3, s, v1), (v3, v2, s), the first two in place
+        int t1 = split.triangle1, t2 = split.triangle2;
+        this->setIrradianceMapTriangle(t1, v0, v1, sample);
+        this->setIrradianceMapTriangle(t2, v0, sample, v2);
+        int t3 = this->addIrradianceMapTriangle(v3, sample, v1);
+        int t4 = this->addIrradianceMapTriangle(v3, v2, sample);
+
+        this->linkIrradianceMapEdges(t1 * 3 + 0, e01);
+        this->linkIrradianceMapEdges(t1 * 3 + 1, t3 * 3 + 1);
+        this->linkIrradianceMapEdges(t1 * 3 + 2, t2 * 3 + 0);
+        this->linkIrradianceMapEdges(t2 * 3 + 1, t4 * 3 + 1);
+        this->linkIrradianceMapEdges(t2 * 3 + 2, e20);
+        this->linkIrradianceMapEdges(t3 * 3 + 0, t4 * 3 + 2);
+        this->linkIrradianceMapEdges(t3 * 3 + 2, e13);
+        this->linkIrradianceMapEdges(t4 * 3 + 0, e32);
+    }
+
+    void CPURayRenderer::flipIrradianceMapTriangles(const IrradianceMapSplit& split)
+    {
+        int v0 = split.v0, v1 = split.v1, v2 = split.v2, v3 = split.v3;
+        int e01 = this->irrMapAdjacency[this->findIrradianceMapEdge(split.triangle1, v0, v1)];
+        int e20 = this->irrMapAdjacency[this->findIrradianceMapEdge(split.triangle1, v2, v0)];
+        int e13 = this->irrMapAdjacency[this->findIrradianceMapEdge(split.triangle2, v1, v3)];
+        int e32 = this->irrMapAdjacency[this->findIrradianceMapEdge(split.triangle2, v3, v2)];
+
+        // change the triangulation from (v0, v1, v2), (v3, v2, v1) to (v0, v1, v3), (v0, v3, v2)
+        int t1 = split.triangle1, t2 = split.triangle2;
+        this->setIrradianceMapTriangle(t1, v0, v1, v3);
+        this->setIrradianceMapTriangle(t2, v0, v3, v2);
+
+        this->linkIrradianceMapEdges(t1 * 3 + 0, e01);
+        this->linkIrradianceMapEdges(t1 * 3 + 1, e13);
+        this->linkIrradianceMapEdges(t1 * 3 + 2, t2 * 3 + 0);
+        this->linkIrradianceMapEdges(t2 * 3 + 1, e32);
+        this->linkIrradianceMapEdges(t2 * 3 + 2, e20);
     }
 
     bool CPURayRenderer::computeIrradianceMap()
@@ -1094,10 +1613,10 @@ namespace MyEngine {
         nextSample++;
         if (sampleIdx >= (int)this->irrMapSamples.size())
         {
-            this->nextRagion = 0;
+            this->progressPixels = 0;
             return false;
         }
-        this->nextRagion = (int)(((float)nextSample / this->irrMapSamples.size()) * this->Regions.size());
+        this->progressPixels = (int)(((float)nextSample / this->irrMapSamples.size()) * this->Width * this->Height);
 
         IrradianceMapSample& sample = this->irrMapSamples[sampleIdx];
         if (sample.color.intensity() < 0.0f) // if sample is nowhere or not static object
@@ -1130,59 +1649,219 @@ namespace MyEngine {
     }
 
 
-    bool CPURayRenderer::render(bool preview)
+    bool CPURayRenderer::getNextRegion(int id, Region& region)
     {
-        const int delta = preview ? this->RegionSize / 8 : 1;
+        TileScheduler::Tile tile;
+        if (!this->tileScheduler.pop(id, tile))
+            return false;
 
-        // get region
-        this->thread->mutex("regions").lock();
-        if (this->nextRagion >= (int)this->Regions.size())
+        region = Region(tile.x, tile.y, tile.w, tile.h);
+        region.time = tile.cost;
+        this->progressPixels += tile.w * tile.h;
+        return true;
+    }
+
+    void CPURayRenderer::finishRegion(int id, float time)
+    {
+        // the time of a whole region is the cost estimate of the next pass
+        TileScheduler::Tile tile = this->tileScheduler.finish(id);
+        Region& region = this->Regions[tile.index];
+        if (region.x == tile.x && region.y == tile.y && region.w == tile.w && region.h == tile.h)
+            region.time = time;
+
+        // a single update of the shared counters per region
+        const RegionBuffer& regionBuffer = this->regionBuffers[id];
+        this->giPaths += regionBuffer.giPaths;
+        this->giRays += regionBuffer.giRays;
+
+        // the first worker past the interval copies the render state for the checkpoint
+        if (this->checkpoints && !this->checkpointing &&
+            chrono::system_clock::now() - this->checkpointTime >= chrono::duration<float>(this->CheckpointTime))
+        {
+            bool expected = false;
+            if (this->checkpointing.compare_exchange_strong(expected, true))
+                this->takeCheckpoint();
+        }
+    }
+
+    bool CPURayRenderer::nextProgressiveIteration()
+    {
+        if (!this->IsStarted)
+            return false;
+
+        if (this->progressiveIteration > 0)
         {
-            this->thread->mutex("regions").unlock();
+            float noise = this->getImageError();
+            Engine::Log(LogType::ELog, "CPURayRenderer", duration_to_string(this->phasePofiler->stop()) + " Progressive iteration " + to_string(this->progressiveIteration) +
+                " time, noise " + to_string(noise));
+
+            if (this->progressiveFinish ||
+                (this->ProgressiveTime > 0.0f && this->GetRenderTime() >= this->ProgressiveTime) ||
+                (this->ProgressiveNoise > 0.0f && noise >= 0.0f && noise <= this->ProgressiveNoise))
+            {
+                this->addFinishTasks();
+                return true;
+            }
+
+            // preview of the image passes, e.g. the denoised image between the iterations
+            if (this->Denoise || this->Bloom > 0.0f)
+                this->postProcessing.addTasks(this->thread.get(), this->Regions, false);
+        }
+
+        // the render tasks are done, the scheduler can be filled here
+        this->progressiveIteration++;
+        this->scheduleRegions(true);
+        this->thread->addNTasks([&](int id) { return this->renderRegions(id, false); });
+        this->thread->addWaitTask();
+        this->thread->addTask([&](int) { return this->nextProgressiveIteration(); });
+        return true;
+    }
+
+    bool CPURayRenderer::scheduleRefinePass()
+    {
+        if (!this->IsStarted)
             return false;
+
+        // only the regions with unconverged pixels below MaxSamples
+        vector<int> regions;
+        for (int k = 0; k < (int)this->Regions.size(); k++)
+        {
+            const Region& region = this->Regions[k];
+            bool converged = true;
+            for (int j = region.y; j < region.y + region.h && converged; j++)
+            {
+                for (int i = region.x; i < region.x + region.w && converged; i++)
+                {
+                    const RunningStats& stats = this->pixelStats[j * this->Width + i];
+                    converged = stats.count >= this->MaxSamples || sampleConverged(stats, this->MinSamples, this->SampleThreshold);
+                }
+            }
+            if (!converged)
+                regions.push_back(k);
         }
-        Region& region = this->Regions[this->nextRagion];
-        this->nextRagion++;
-        this->thread->mutex("regions").unlock();
+        this->refinePass = true;
+        this->scheduleRegions(regions, true);
 
-        Profiler prof;
-        prof.start();
-        region.active = preview ? false : true;
+        Engine::Log(LogType::ELog, "CPURayRenderer", to_string(regions.size()) + " of " + to_string(this->Regions.size()) + " regions to refine, error " +
+            to_string(this->getImageError()));
+        return true;
+    }
 
-        // render
-        for (int j = 0; j < region.h; j += delta)
+    float CPURayRenderer::getImageError()
+    {
+        // average of the pixels' relative error, -1 until the pixels have 2 samples
+        double error = 0.0;
+        int count = 0;
+        for (const auto& stats : this->pixelStats)
         {
-            for (int i = 0; i < region.w; i += delta)
+            if (stats.count < 2)
+                continue;
+
+            error += stats.relativeError(ERROR_MIN_MEAN);
+            count++;
+        }
+        return count > 0 ? (float)(error / count) : -1.0f;
+    }
+
+    void CPURayRenderer::getSampleSettings(bool preview, uint& minSamples, uint& maxSamples, float& sampleThreshold)
+    {
+        minSamples = preview ? min(1u, this->MinSamples) : this->MinSamples;
+        maxSamples = preview ? min(4u, this->MaxSamples) : this->MaxSamples;
+        sampleThreshold = preview ? min(0.01f, this->SampleThreshold) : this->SampleThreshold;
+
+        // the render pass gives every pixel a part of the samples, the refine pass the rest to the ones still above the threshold
+        if (!preview && !this->refinePass)
+        {
+            maxSamples = max(this->MaxSamples / RENDER_PASS_SAMPLES_DIV, max(this->MinSamples, 1u));
+            maxSamples = min(maxSamples, this->MaxSamples);
+        }
+
+        // a progressive iteration adds the same samples to every pixel, the noise is checked on the whole image
+        if (!preview && this->progressiveIteration > 0)
+            minSamples = maxSamples = max(this->MinSamples, 1u);
+    }
+
+    void CPURayRenderer::initPixel(PixelSamples& pixel, int x, int y, int delta, uint minSamples, uint maxSamples, float sampleThreshold)
+    {
+        pixel.x = x;
+        pixel.y = y;
+        pixel.samples = 0;
+        pixel.firstSample = 0;
+        pixel.maxSamples = maxSamples;
+        pixel.done = false;
+        pixel.stats.clear();
+        pixel.colors.clear();
+
+        // continue the samples of the previous passes, the preview blocks start again
+        if (delta == 1)
+        {
+            pixel.stats = this->pixelStats[y * this->Width + x];
+            pixel.firstSample = pixel.stats.count;
+            if (this->refinePass)
             {
-                if (!this->IsStarted)
-                    return false;
+                pixel.maxSamples = maxSamples > pixel.firstSample ? maxSamples - pixel.firstSample : 0;
+                pixel.done = pixel.maxSamples == 0 || sampleConverged(pixel.stats, minSamples, sampleThreshold);
+            }
+        }
+    }
+
+    bool CPURayRenderer::renderRegions(int id, bool preview)
+    {
+        // until the worker can't take or steal a region
+        while (this->render(id, preview));
+        return true;
+    }
+
+    bool CPURayRenderer::render(int id, bool preview)
+    {
+        // get region
+        Region region(0, 0, 0, 0);
+        if (!this->getNextRegion(id, region))
+            return false;
 
-                int x = region.x + i;
-                int y = region.y + j;
+        Profiler prof;
+        prof.start();
+        if (!this->renderRegion(id, region, preview))
+            return false;
 
-                for (auto& buffer : this->Buffers)
-                    buffer.second.setElement(x, y, Color4());
+        this->finishRegion(id, (float)chrono::duration_cast<chrono::microseconds>(prof.stop()).count() / 1000.0f);
+        return true;
+    }
 
-                uint minSamples = preview ? min(1u, this->MinSamples) : this->MinSamples;
-                uint maxSamples = preview ? min(4u, this->MaxSamples) : this->MaxSamples;
-                float sampleThreshold = preview ? min(0.01f, this->SampleThreshold) : this->SampleThreshold;
-                uint samples = adaptiveSampling(minSamples, maxSamples, sampleThreshold, [&](int) { return this->renderPixel(x, y); });
+    bool CPURayRenderer::renderRegion(int id, const Region& region, bool preview)
+    {
+        const int delta = preview ? this->RegionSize / 8 : 1;
 
-                float div = 1.0f / samples;
-                for (auto& buffer : this->Buffers)
-                    buffer.second.setElement(x, y, this->Buffers[buffer.first].getElement(x, y) * div);
+        RegionBuffer& regionBuffer = this->regionBuffers[id];
+        regionBuffer.width = region.w;
+        regionBuffer.height = region.h;
+        for (int k = 0; k < AOVS_COUNT; k++)
+            regionBuffer.colors[k].resize(region.w * region.h);
+        regionBuffer.stats.resize(preview ? 0 : region.w * region.h);
 
-                this->Buffers["Samples"].setElement(x, y, this->Buffers["Samples"].getElement(x, y) + Color4((float)(samples - 2) / (maxSamples - 2), 0, 0));
+        uint minSamples, maxSamples;
+        float sampleThreshold;
+        this->getSampleSettings(preview, minSamples, maxSamples, sampleThreshold);
 
-                // do preview
-                for (int p = 1; p < delta * delta; p++)
-                {
-                    uint xx = region.x + i + p % delta;
-                    uint yy = region.y + j + p / delta;
-                    for (auto& buffer : this->Buffers)
-                        buffer.second.setElement(xx, yy, this->Buffers[buffer.first].getElement(x, y));
-                }
+        // render, a row at a time so the primary rays of all its pixels are traced together
+        vector<PixelSamples> pixels;
+        pixels.reserve(region.w);
+        for (int j = 0; j < region.h; j += delta)
+        {
+            if (!this->IsStarted)
+                return false;
+
+            pixels.clear();
+            for (int i = 0; i < region.w; i += delta)
+            {
+                PixelSamples pixel;
+                this->initPixel(pixel, region.x + i, region.y + j, delta, minSamples, maxSamples, sampleThreshold);
+                pixels.push_back(pixel);
             }
+            this->renderPixels(region.y + j, pixels, minSamples, maxSamples, sampleThreshold);
+
+            for (auto& pixel : pixels)
+                this->storePixel(regionBuffer, region, delta, pixel, maxSamples);
 
             if (!preview)
                 this_thread::sleep_for(chrono::milliseconds(10));
@@ -1191,100 +1870,214 @@ namespace MyEngine {
         if (preview)
             this_thread::sleep_for(chrono::milliseconds(1));
 
-        region.active = false;
-        region.time = (float)chrono::duration_cast<chrono::milliseconds>(prof.stop()).count();
+        this->takeGIPathCounts(regionBuffer);
+        this->flushRegionBuffer(regionBuffer, region);
 
         return true;
     }
 
-    Color4 CPURayRenderer::renderPixel(int x, int y)
+    void CPURayRenderer::storePixel(RegionBuffer& regionBuffer, const Region& region, int delta, PixelSamples& pixel, uint maxSamples)
     {
-        Profile;
-        Random& rand = Random::getRandomGen();
+        uint samples = max(pixel.samples, 1u);
+        AOVColors& colors = pixel.colors;
+        Color4 samplesColor = colors[ESamples] * (1.0f / samples); // shows only the last pass
 
-        if (!this->IsStarted)
-            return Color4::Black();
+        // add to the average of the previous passes in the buffers
+        if (delta == 1)
+        {
+            if (pixel.firstSample > 0)
+            {
+                for (int k = 0; k < AOVS_COUNT; k++)
+                    colors[k] += this->aovBuffers[k]->getElement(pixel.x, pixel.y) * (float)pixel.firstSample;
+            }
+            regionBuffer.stats[(pixel.y - region.y) * region.w + pixel.x - region.x] = pixel.stats;
+            samples = max(pixel.firstSample + pixel.samples, 1u);
+            maxSamples = max(this->MaxSamples, samples);
+        }
 
-        // intersect
-        embree::RTCRay4 rtcRay4;
-        for (int k = 0; k < RAYS; k++)
-            setRTCRay4(rtcRay4, k, this->getRTCScreenRay(x + rand.randSample(RAYS / 2, k % 2), y + rand.randSample(RAYS / 2, k / 2)));
-        embree::rtcIntersect4(VALID, this->rtcScene, rtcRay4);
+        colors *= 1.0f / samples;
+        if (pixel.samples > 0)
+        {
+            colors[ESamples] = samplesColor + Color4((float)(samples - 2) / (maxSamples - 2), 0, 0);
+            float error = min(pixel.stats.relativeError(ERROR_MIN_MEAN), 1.0f);
+            colors[ENoise] = Color4(error, error, error, 1.0f);
+        }
 
-        // compute color
-        ColorsMapType colors;
-        for (int k = 0; k < RAYS; k++)
+        // write to the region buffer, in preview fill the whole delta x delta block
+        int i = pixel.x - region.x;
+        int j = pixel.y - region.y;
+        for (int p = 0; p < delta * delta; p++)
         {
-            if (rtcRay4.instID[k] == RTC_INVALID_GEOMETRY_ID)
+            int ii = i + p % delta;
+            int jj = j + p / delta;
+            if (ii >= region.w || jj >= region.h)
                 continue;
 
-            embree::RTCRay rtcRay = getRTCRay(rtcRay4, k);
-            InterInfo interInfo = this->getInterInfo(rtcRay);
-            this->processRenderElements(rtcRay, interInfo);
-            const ColorsMapType& temp = this->computeColor(rtcRay, interInfo, 1.0f);
-            for (const auto& color : temp)
-                colors[color.first] += color.second;
+            int idx = jj * region.w + ii;
+            for (int k = 0; k < AOVS_COUNT; k++)
+                regionBuffer.colors[k][idx] = colors[k];
         }
+    }
 
-        float div = 1.0f / RAYS;
-        for (auto& color : colors)
-            this->Buffers[color.first].setElement(x, y, this->Buffers[color.first].getElement(x, y) + color.second * div);
-
-        return colors["Final"] * div;
+    void CPURayRenderer::flushRegionBuffer(const RegionBuffer& regionBuffer, const Region& region)
+    {
+        // one row copy per buffer, the regions don't overlap so they don't wait for each other, only for a checkpoint's copy
+        this->thread->rw_mutex("checkpoint").read_lock();
+        for (int k = 0; k < AOVS_COUNT; k++)
+        {
+            Buffer<Color4>* buffer = this->aovBuffers[k];
+            for (int j = 0; j < region.h; j++)
+                memcpy(&buffer->data[(region.y + j) * buffer->width + region.x], &regionBuffer.colors[k][j * region.w], region.w * sizeof(Color4));
+        }
+        if (!regionBuffer.stats.empty())
+        {
+            for (int j = 0; j < region.h; j++)
+                memcpy(&this->pixelStats[(region.y + j) * this->Width + region.x], &regionBuffer.stats[j * region.w], region.w * sizeof(RunningStats));
+        }
+        this->thread->rw_mutex("checkpoint").read_unlock();
+        this->postProcessing.processTile(region);
     }
 
-    CPURayRenderer::ColorsMapType CPURayRenderer::computeColor(const embree::RTCRay& rtcRay, const InterInfo& interInfo, float contribution)
+    void CPURayRenderer::renderPixels(int y, vector<PixelSamples>& pixels, uint minSamples, uint maxSamples, float sampleThreshold)
     {
         Profile;
-        ColorsMapType result;
 
-        if (!this->IsStarted)
-            return result;
+        // every iteration adds a sample to the pixels which are not converged yet, same rule as adaptiveSampling
+        for (uint sample = 1; sample <= maxSamples; sample++)
+        {
+            if (this->packetSize == 8)
+                this->renderPixelsSample<embree::RTCRay8, 8>(y, pixels);
+            else
+                this->renderPixelsSample<embree::RTCRay4, 4>(y, pixels);
 
-        if (!interInfo.sceneElement)
-            return result;
+            bool done = true;
+            for (auto& pixel : pixels)
+            {
+                if (pixel.done)
+                    continue;
+
+                pixel.samples = sample;
+                pixel.stats.add(pixel.lastFinal.intensity());
+                if (sample >= pixel.maxSamples || sampleConverged(pixel.stats, minSamples, sampleThreshold))
+                    pixel.done = true;
+                else
+                    done = false;
+            }
+
+            if (done || !this->IsStarted)
+                break;
+        }
+    }
+
+    template <typename RTCRayN, int N>
+    void CPURayRenderer::renderPixelsSample(int y, vector<PixelSamples>& pixels)
+    {
+        Profile;
+        Sampler& sampler = Sampler::getSampler();
+
+        for (auto& pixel : pixels)
+            pixel.lastFinal = Color4();
+
+        // the stage holds RAYS jittered rays of every active pixel, N rays per packet
+        const uint stageSize = PACKETS_PER_STAGE * N;
+        RTCRayN packets[PACKETS_PER_STAGE];
+        RTCORE_ALIGN(32) int valid[PACKETS_PER_STAGE][N];
+        int lanePixels[stageSize];
+        uint laneSamples[stageSize]; // sampler's sample index
+        const float div = 1.0f / RAYS;
+
+        uint p = 0;
+        while (p < pixels.size() && this->IsStarted)
+        {
+            // generate
+            uint lanes = 0;
+            for (; p < pixels.size() && lanes + RAYS <= stageSize; p++)
+            {
+                if (pixels[p].done)
+                    continue;
+
+                float x = (float)pixels[p].x;
+                for (int k = 0; k < RAYS; k++)
+                {
+                    laneSamples[lanes] = (pixels[p].firstSample + pixels[p].samples) * RAYS + k;
+                    sampler.start(this->Sampling, pixels[p].x, y, laneSamples[lanes]);
+                    float u, v;
+                    sampler.next2D(u, v);
+                    setRTCRay(packets[lanes / N], lanes % N, this->getRTCScreenRay(x + u, y + v));
+                    lanePixels[lanes] = p;
+                    lanes++;
+                }
+            }
+            if (lanes == 0)
+                break;
+
+            // intersect
+            uint packetsCount = (lanes - 1) / N + 1;
+            for (uint i = 0; i < packetsCount; i++)
+            {
+                for (int k = 0; k < N; k++)
+                {
+                    bool active = i * N + k < lanes;
+                    valid[i][k] = active ? -1 : 0;
+                    if (!active)
+                        packets[i].instID[k] = RTC_INVALID_GEOMETRY_ID;
+                }
+                rtcIntersectN(valid[i], this->rtcScene, packets[i]);
+            }
+
+            // compute color
+            for (uint l = 0; l < lanes; l++)
+            {
+                const RTCRayN& packet = packets[l / N];
+                if (packet.instID[l % N] == RTC_INVALID_GEOMETRY_ID)
+                    continue;
+
+                PixelSamples& pixel = pixels[lanePixels[l]];
+                sampler.start(this->Sampling, pixel.x, y, laneSamples[l], PRIMARY_DIMENSIONS);
+                embree::RTCRay rtcRay = getRTCRay(packet, l % N);
+                InterInfo interInfo = this->getInterInfo(rtcRay);
+                this->processRenderElements(rtcRay, interInfo);
+                const AOVColors& colors = this->computeColor(rtcRay, interInfo, 1.0f);
+                pixel.colors.add(colors, div);
+                pixel.lastFinal += colors[EFinal] * div;
+            }
+        }
+    }
+
+    AOVColors CPURayRenderer::computeColor(const embree::RTCRay& rtcRay, const InterInfo& interInfo, float contribution)
+    {
+        Profile;
+        AOVColors result;
+
+        if (!this->IsStarted)
+            return result;
+
+        if (!interInfo.sceneElement)
+            return result;
 
         if (contribution < 0.02f)
             return result;
 
-        result["Diffuse"] = interInfo.color * interInfo.diffuse;
-        result["Diffuse"].a = 1.0f;
+        result[EDiffuse] = interInfo.color * interInfo.diffuse;
+        result[EDiffuse].a = 1.0f;
 
         // calculate lighting
         if ((interInfo.sceneElement->Type == SceneElementType::EStaticObject ||
              interInfo.sceneElement->Type == SceneElementType::EDynamicObject) &&
             interInfo.diffuse > 0.01f)
         {
-            const auto& lighting = this->getLighting(rtcRay, interInfo);
-            for (const auto& color : lighting)
-                result[color.first] = color.second;
+            const AOVColors& lighting = this->getLighting(rtcRay, interInfo);
+            result[EDirectLight] = lighting[EDirectLight];
+            result[ESpecular] = lighting[ESpecular];
+            result[ESamples] = lighting[ESamples];
 
             // calculate GI
             bool bruteForce = true;
             if (this->GI && this->IrradianceMap && this->irrMapSamples.size() > 0 && rtcRay.align0 == 0 && 
                 interInfo.sceneElement->Type != SceneElementType::EDynamicObject) // if irradiance map is enabled
             {
-                result["IndirectLight"] = Color4::Black();
-
-                embree::RTCRay rtcIrrRay = rtcRay;
-                rtcIrrRay.tfar = 10000.0f;
-                rtcIrrRay.geomID = RTC_INVALID_GEOMETRY_ID;
-                rtcIrrRay.primID = RTC_INVALID_GEOMETRY_ID;
-                rtcIrrRay.instID = RTC_INVALID_GEOMETRY_ID;
-                embree::rtcIntersect(this->rtcIrrMapScene, rtcIrrRay);
-                int triangle = rtcIrrRay.primID * 3;
-
-                if (triangle >= 0)
-                {
-                    const IrradianceMapSample& sample1 = this->irrMapSamples[this->irrMapTriangles[triangle + 0]];
-                    const IrradianceMapSample& sample2 = this->irrMapSamples[this->irrMapTriangles[triangle + 1]];
-                    const IrradianceMapSample& sample3 = this->irrMapSamples[this->irrMapTriangles[triangle + 2]];
-                    if (sample1.color.intensity() >= 0.0f && sample2.color.intensity() >= 0.0f && sample3.color.intensity() >= 0.0f)
-                    {
-                        result["IndirectLight"] = linearFilter(sample1.color, sample2.color, sample3.color, rtcIrrRay.u, rtcIrrRay.v);
-                        bruteForce = false;
-                    }
-                }
+                result[EIndirectLight] = Color4::Black();
+                bruteForce = !this->getIrradianceMapLighting(rtcRay, result[EIndirectLight]);
             }
             if (bruteForce)
             {
@@ -1298,36 +2091,37 @@ namespace MyEngine {
                         const Vector3& dir = hemisphereSample(interInfo.normal);
                         embree::RTCRay rtcGIRay = RTCRay(interInfo.interPos + interInfo.normal * 0.01f, dir, (uint)rtcRay.align0 + 1);
                         rtcGIRay.align1 = rtcRay.align1; // flags
+                        rtcGIRay.align2 = this->getRayConeWidth(rtcRay);
                         setFlag(rtcGIRay.align1, RayFlags::RAY_INDIRECT, true);
                         embree::rtcIntersect(this->rtcScene, rtcGIRay);
 
                         const InterInfo& interInfoGI = this->getInterInfo(rtcGIRay);
                         const Color4& lighting = this->getGILighting(rtcGIRay, interInfoGI, Color4::White());
-                        result["IndirectLight"] += lighting;
+                        result[EIndirectLight] += lighting;
                         return lighting;
                     });
-                    result["IndirectLight"] *= (1.0f / samples);
-                    result["Samples"] += Color4(0, (float)(samples - 2) / (this->GISamples * 4 - 2), 0);
-                    result["Samples"].a = 1.0f;
+                    result[EIndirectLight] *= (1.0f / samples);
+                    result[ESamples] += Color4(0, (float)(samples - 2) / (this->GISamples * 4 - 2), 0);
+                    result[ESamples].a = 1.0f;
                 }
                 else
-                    result["IndirectLight"] = this->Owner->SceneManager->AmbientLight;
+                    result[EIndirectLight] = this->Owner->SceneManager->AmbientLight;
             }
         }
         else if (interInfo.sceneElement->Type != SceneElementType::EStaticObject &&
                  interInfo.sceneElement->Type != SceneElementType::EDynamicObject) // non static or dynamic objects
-            result["DirectLight"] = Color4::White();
+            result[EDirectLight] = Color4::White();
 
-        result["TotalLight"] = (result["DirectLight"] + result["IndirectLight"]);
-        result["TotalLight"].a = 1.0f;
-        result["Lighted"] = result["Diffuse"] * result["TotalLight"] + result["Specular"];
-        result["Lighted"].a = 1.0f;
+        result[ETotalLight] = (result[EDirectLight] + result[EIndirectLight]);
+        result[ETotalLight].a = 1.0f;
+        result[ELighted] = result[EDiffuse] * result[ETotalLight] + result[ESpecular];
+        result[ELighted].a = 1.0f;
 
 
         // calculate refraction
         if (interInfo.refraction > 0.01f && (uint)rtcRay.align0 < this->MaxDepth)
         {
-            Material* material = (Material*)this->contentElements[interInfo.sceneElement->MaterialID].get();
+            const Material* material = interInfo.material;
             float glossiness = material ? material->Glossiness : 1.0f;
 
             Vector3 n = interInfo.normal;
@@ -1343,23 +2137,24 @@ namespace MyEngine {
             {
                 embree::RTCRay rtcRefrRay = RTCRay(interInfo.interPos, dir, (uint)rtcRay.align0 + 1);
                 rtcRefrRay.align1 = rtcRay.align1; // flags
+                rtcRefrRay.align2 = this->getRayConeWidth(rtcRay);
                 setFlag(rtcRefrRay.align1, RayFlags::RAY_INSIDE, !getFlag(rtcRay.align1, RayFlags::RAY_INSIDE));
 
                 embree::rtcIntersect(this->rtcScene, rtcRefrRay);
                 const InterInfo& interInfoRefr = this->getInterInfo(rtcRefrRay);
 
-                result["Refraction"] = this->computeColor(rtcRefrRay, interInfoRefr, contribution * interInfo.refraction)["Final"];
+                result[ERefraction] = this->computeColor(rtcRefrRay, interInfoRefr, contribution * interInfo.refraction)[EFinal];
             }
-            result["Refraction"] *= interInfo.refraction;
-            result["Refraction"].a = 1.0f;
+            result[ERefraction] *= interInfo.refraction;
+            result[ERefraction].a = 1.0f;
         }
         else
-            result["Refraction"] = Color4::Black();
+            result[ERefraction] = Color4::Black();
 
         // calculate reflection
         if (interInfo.reflection > 0.01f && (uint)rtcRay.align0 < this->MaxDepth)
         {
-            Material* material = (Material*)this->contentElements[interInfo.sceneElement->MaterialID].get();
+            const Material* material = interInfo.material;
             float glossiness = material ? material->Glossiness : 1.0f;
 
             Vector3 n = interInfo.normal;
@@ -1369,23 +2164,24 @@ namespace MyEngine {
             Vector3 dir = reflect(Vector3(rtcRay.dir[0], rtcRay.dir[1], rtcRay.dir[2]), n);
             embree::RTCRay rtcReflRay = RTCRay(interInfo.interPos, dir, (uint)rtcRay.align0 + 1);
             rtcReflRay.align1 = rtcRay.align1; // flags
+            rtcReflRay.align2 = this->getRayConeWidth(rtcRay);
 
             embree::rtcIntersect(this->rtcScene, rtcReflRay);
             const InterInfo& interInfoRefl = this->getInterInfo(rtcReflRay);
 
-            result["Reflection"] = this->computeColor(rtcReflRay, interInfoRefl, contribution * interInfo.reflection)["Final"];
-            result["Reflection"] *= interInfo.reflection;
-            result["Reflection"].a = 1.0f;
+            result[EReflection] = this->computeColor(rtcReflRay, interInfoRefl, contribution * interInfo.reflection)[EFinal];
+            result[EReflection] *= interInfo.reflection;
+            result[EReflection].a = 1.0f;
         }
         else
-            result["Reflection"] = Color4::Black();
+            result[EReflection] = Color4::Black();
 
-        result["Final"] = result["Lighted"] + result["Refraction"] + result["Reflection"];
-        result["Final"].a = 1.0f;
+        result[EFinal] = result[ELighted] + result[ERefraction] + result[EReflection];
+        result[EFinal].a = 1.0f;
 
         float depth = rtcRay.tfar;
-        result["Depth"] = Color4(depth, depth, depth);
-        result["Normals"] = (Color4(interInfo.normal.x, interInfo.normal.y, interInfo.normal.z) + Color4(1.0f, 1.0f, 1.0f)) * 0.5f; // from range [-1:1] to [0:1]
+        result[EDepth] = Color4(depth, depth, depth);
+        result[ENormals] = (Color4(interInfo.normal.x, interInfo.normal.y, interInfo.normal.z) + Color4(1.0f, 1.0f, 1.0f)) * 0.5f; // from range [-1:1] to [0:1]
 
 
         // fog
@@ -1399,13 +2195,13 @@ namespace MyEngine {
             if (this->VolumetricFog && !getFlag(rtcRay.align1, RayFlags::RAY_INDIRECT)) // volumetric fog only for primary rays
                 lighting += this->getFogLighting(rtcRay);
 
-            result["Final"] = this->Owner->SceneManager->FogColor * lighting * (1.0f - fogFactor) + result["Final"] * fogFactor;
+            result[EFinal] = this->Owner->SceneManager->FogColor * lighting * (1.0f - fogFactor) + result[EFinal] * fogFactor;
         }
 
         // inside of the object (in computeColor, getLighting.shadow, getGILighting too)
         if (getFlag(rtcRay.align1, RayFlags::RAY_INSIDE))
         {
-            Material* material = (Material*)this->contentElements[interInfo.sceneElement->MaterialID].get();
+            const Material* material = interInfo.material;
             if (material && material->InnerColor.intensity() > 0.01f)
             {
                 float absFactor = exp(-rtcRay.tfar * material->Absorption);
@@ -1414,487 +2210,1592 @@ namespace MyEngine {
                 Color4 lighting(1.0f, 1.0f, 1.0f, 1.0f);
                 if (!getFlag(rtcRay.align1, RayFlags::RAY_INDIRECT)) // volumetric fog only for primary rays
                     lighting += this->getFogLighting(rtcRay);
-                result["Final"] = material->InnerColor * lighting * (1.0f - absFactor) + result["Final"] * absFactor;
+                result[EFinal] = material->InnerColor * lighting * (1.0f - absFactor) + result[EFinal] * absFactor;
+            }
+        }
+
+        return result;
+    }
+
+    bool CPURayRenderer::getIrradianceMapLighting(const embree::RTCRay& rtcRay, Color4& indirectLight)
+    {
+        embree::RTCRay rtcIrrRay = rtcRay;
+        rtcIrrRay.tfar = 10000.0f;
+        rtcIrrRay.geomID = RTC_INVALID_GEOMETRY_ID;
+        rtcIrrRay.primID = RTC_INVALID_GEOMETRY_ID;
+        rtcIrrRay.instID = RTC_INVALID_GEOMETRY_ID;
+        embree::rtcIntersect(this->rtcIrrMapScene, rtcIrrRay);
+        int triangle = rtcIrrRay.primID * 3;
+
+        if (triangle >= 0)
+        {
+            const IrradianceMapSample& sample1 = this->irrMapSamples[this->irrMapTriangles[triangle + 0]];
+            const IrradianceMapSample& sample2 = this->irrMapSamples[this->irrMapTriangles[triangle + 1]];
+            const IrradianceMapSample& sample3 = this->irrMapSamples[this->irrMapTriangles[triangle + 2]];
+            if (sample1.color.intensity() >= 0.0f && sample2.color.intensity() >= 0.0f && sample3.color.intensity() >= 0.0f)
+            {
+                indirectLight = linearFilter(sample1.color, sample2.color, sample3.color, rtcIrrRay.u, rtcIrrRay.v);
+                return true;
+            }
+        }
+        return false;
+    }
+
+    AOVColors CPURayRenderer::getLighting(const embree::RTCRay& rtcRay, const InterInfo& interInfo)
+    {
+        Profile;
+        AOVColors lighting;
+
+        const auto& lights = this->getLights(rtcRay, interInfo);
+        for (const auto& light : lights)
+        {
+            Color4 directLight, specular;
+            uint samples = adaptiveSampling(this->MinSamples, this->MaxSamples, this->SampleThreshold, [&](int) -> Color4
+            {
+                Color4 tempDirectLight, tempSpecular;
+                this->getLighting(rtcRay, light.light, interInfo, tempDirectLight, tempSpecular);
+                directLight += tempDirectLight;
+                specular += tempSpecular;
+                return tempDirectLight;
+            });
+
+            float div = light.weight / samples;
+            lighting[EDirectLight] += directLight * div;
+            lighting[ESpecular] += specular * div;
+            lighting[ESamples] += Color4(0, 0, (float)(samples - 2) / (this->MaxSamples - 2));
+        }
+
+        lighting[EDirectLight].a = 1.0f;
+        lighting[ESpecular].a = 1.0f;
+        if (!lights.empty())
+            lighting[ESamples].b /= lights.size();
+        lighting[ESamples].a = 1.0f;
+        return lighting;
+    }
+
+    const vector<CPURayRenderer::LightSample>& CPURayRenderer::getLights(const embree::RTCRay& rtcRay, const InterInfo& interInfo)
+    {
+        Profile;
+        // the thread's vector is reused, so sampling the lights doesn't allocate
+        vector<LightSample>& result = lightSamples.get();
+        result.clear();
+
+        // indirect rays take a single light
+        uint count = getFlag(rtcRay.align1, RayFlags::RAY_INDIRECT) ? 1 : this->MaxLights;
+        if (count == 0 || count >= this->lights.size())
+        {
+            for (const auto& light : this->lights)
+                result.push_back(LightSample((Light*)light.get(), 1.0f));
+            return result;
+        }
+
+        // more lights than the limit, sample them by importance and weight by the probability
+        Sampler& sampler = Sampler::getSampler();
+        for (uint i = 0; i < count; i++)
+        {
+            float pdf;
+            int idx = this->lightTree.sample(interInfo.interPos, sampler.next(), pdf);
+            if (idx < 0) // no light reaches the point
+                break;
+            result.push_back(LightSample((Light*)this->lights[idx].get(), 1.0f / (pdf * count)));
+        }
+        return result;
+    }
+
+    void CPURayRenderer::buildLightTree()
+    {
+        Profile;
+
+        this->lights.clear();
+        for (const auto& light : this->Owner->SceneManager->GetElements(SceneElementType::ELight))
+        {
+            if (light->Visible)
+                this->lights.push_back(light);
+        }
+
+        this->lightTree.build((int)this->lights.size(), [&](int i) -> LightTree::LightInfo
+        {
+            Light* light = (Light*)this->lights[i].get();
+            LightTree::LightInfo info;
+            info.position = light->Position;
+            info.range = light->Radius * 1.10f + 10.0f * light->Scale.length(); // the light samples are on the light's mesh
+            info.power = light->Color.intensity() * light->Intensity;
+            info.direction = light->Rotation * Vector3(0.0f, -1.0f, 0.0f);
+            info.direction.normalize();
+            info.cutoff = min(light->SpotCutoff, 180.0f) * PI / 180.0f;
+            return info;
+        });
+    }
+
+    void CPURayRenderer::getLighting(const embree::RTCRay& rtcRay, const Light* light, const InterInfo& interInfo, Color4& directLight, Color4& specular)
+    {
+        directLight = Color4::Black();
+        specular = Color4::Black();
+
+        // calculate base lighting
+        embree::RTCRay4 rtcRay4;
+        RTCORE_ALIGN(16) int valid[RAYS];
+        Color4 baseLightings[RAYS];
+        Vector3 shadowDirs[RAYS];
+        ShadowContext context;
+        bool any = false;
+        for (int i = 0; i < RAYS; i++)
+        {
+            float lightDist;
+            valid[i] = 0;
+            if (!this->getLightContribution(light, interInfo, RAYS, i, baseLightings[i], shadowDirs[i], lightDist))
+            {
+                baseLightings[i] = Color4();
+                continue;
+            }
+
+            embree::RTCRay rtcShadowRay = RTCRay(interInfo.interPos, shadowDirs[i], 0, 0.1f, lightDist);
+            rtcShadowRay.mask = RayMasks::RAY_MASK_GEOMETRY;
+            setRTCRay(rtcRay4, i, rtcShadowRay);
+            context.transmittance[i] = Color4::White();
+            valid[i] = -1;
+            any = true;
+        }
+
+        // shadow, the occlusion filter lets the rays through the transparent objects
+        if (any)
+        {
+            shadowContext = &context;
+            embree::rtcOccluded4(valid, this->rtcScene, rtcRay4);
+            shadowContext = NULL;
+
+            for (int i = 0; i < RAYS; i++)
+            {
+                if (!valid[i])
+                    continue;
+
+                if (rtcRay4.geomID[i] != RTC_INVALID_GEOMETRY_ID) // occluded
+                    baseLightings[i] = Color4::Black();
+                else
+                    baseLightings[i] *= context.transmittance[i];
+            }
+        }
+
+        // calculate lighting
+        for (int i = 0; i < RAYS; i++)
+        {
+            // calculate diffuse
+            float cosTheta = dot(shadowDirs[i], interInfo.normal);
+            if (cosTheta > 0.0f)
+                directLight += baseLightings[i] * cosTheta;
+
+            // calculate specular
+            Vector3 r = reflect(-shadowDirs[i], interInfo.normal);
+            float cosGamma = dot(r, -Vector3(rtcRay.dir[0], rtcRay.dir[1], rtcRay.dir[2]));
+            if (cosGamma > 0.0f)
+            {
+                const Material* mat = interInfo.material;
+                if (mat)
+                    specular += baseLightings[i] * mat->SpecularColor * pow(cosGamma, 0.3f * mat->Shininess);
             }
         }
 
+        float div = 1.0f / RAYS;
+        directLight *= div;
+        directLight.a = 1.0f;
+        specular *= div;
+        specular.a = 1.0f;
+    }
+
+    bool CPURayRenderer::getLightContribution(const Light* light, const InterInfo& interInfo, int numSamples, int sample, Color4& lighting, Vector3& dir, float& dist)
+    {
+        // light direction
+        Vector3 lightDir = light->Rotation * Vector3(0.0f, -1.0f, 0.0f);
+        lightDir.normalize();
+
+        Vector3 lightSample = this->getLightSample(light, numSamples, sample);
+        dir = lightSample - interInfo.interPos;
+        if (dir.length() > light->Radius * 1.10f)
+            return false;
+        float lensq = max(dir.lengthSqr(), 1.0f);
+        dir.normalize();
+
+        // fog
+        float fogFactor = 1.0f;
+        if (this->Owner->SceneManager->FogDensity > 0.0f)
+        {
+            fogFactor = pow(2.0f, -this->Owner->SceneManager->FogDensity * this->Owner->SceneManager->FogDensity * lensq * LOG2);
+            fogFactor = min(max(fogFactor, 0.0f), 1.0f);
+            if (fogFactor == 0.0f)
+                return false;
+        }
+
+        // spot effect
+        float spotEffect = dot(-dir, lightDir);
+        if (spotEffect < cos(light->SpotCutoff * PI / 180.0f))
+            return false; // if spotEffect is 0 then no need for further calculations
+        else if (spotEffect > 0.0f)
+            spotEffect = pow(spotEffect, light->SpotExponent);
+        else
+            spotEffect = 1.0f;
+
+        // calculate lighting
+        lighting = light->Color * (light->Intensity / lensq);// *abs(dot(lightDir, -shadowDir)); // (cosine between the light's direction and the normed ray toward the hitpos)
+        lighting = lighting * spotEffect * fogFactor;
+        if (sqrt(lensq) > light->Radius)
+            lighting *= (light->Radius * 1.10f - sqrt(lensq)) / (light->Radius * 0.10f);
+
+        dist = sqrt(lensq) - 0.1f;
+        return true;
+    }
+
+    Vector3 CPURayRenderer::getLightSample(const Light* light, int numSamples, int sample)
+    {
+        Sampler& sampler = Sampler::getSampler();
+        Vector3 result;
+
+        Mesh* mesh = (Mesh*)this->contentElements[light->ContentID].get();
+        if (mesh && mesh->Name != "Cube")
+        {
+            int trglSample = (int)(sampler.nextSample(numSamples, sample) * (mesh->Triangles.size() - 1));
+            Triangle& trgl = mesh->Triangles[trglSample];
+            float u, v;
+            sampler.next2D(u, v);
+            result = barycentric(mesh->Vertices[trgl.vertices[0]], mesh->Vertices[trgl.vertices[1]], mesh->Vertices[trgl.vertices[2]], u, v);
+        }
+        else
+        {
+            int sqrtNumSamples = max((int)sqrt(numSamples), 1);
+            result = Vector3((sampler.nextSample(sqrtNumSamples, sample % sqrtNumSamples) - 0.5f),
+                (sampler.next() - 0.5f),
+                (sampler.nextSample(sqrtNumSamples, sample / sqrtNumSamples) - 0.5f));
+            result *= 20.0f;
+        }
+
+        result *= light->Scale;
+        result = light->Rotation * result;
+        result += light->Position;
         return result;
     }
 
-    CPURayRenderer::ColorsMapType CPURayRenderer::getLighting(const embree::RTCRay& rtcRay, const InterInfo& interInfo)
+    Color4 CPURayRenderer::getFogLighting(const embree::RTCRay& rtcRay)
     {
         Profile;
-        ColorsMapType lighting;
+        Color4 result;
+
+        embree::RTCRay newRay = rtcRay;
+        InterInfo interInfo;
+        const InstanceInfo* instance = this->getInstanceInfo(rtcRay.instID);
+        if (instance)
+        {
+            interInfo.sceneElement = instance->element.get();
+            interInfo.material = instance->material;
+        }
+        interInfo.normal = Vector3(rtcRay.dir[0], rtcRay.dir[1], rtcRay.dir[2]);
+
+        // the lighting is averaged over jittered steps weighted by the light the fog scatters in them, so the steps end
+        // where the fog gets opaque. The points in the camera frustum take the lighting from the froxels.
+        float fogDensity = this->Owner->SceneManager->FogDensity;
+        float dist = fogDensity > 0.0f ? min(rtcRay.tfar, FOG_RANGE / fogDensity) : rtcRay.tfar;
+        float delta = dist / FOG_STEPS;
+        float offset = Sampler::getSampler().next();
+        float prevTransmittance = 1.0f;
+        float weights = 0.0f;
+        for (uint i = 0; i < FOG_STEPS; i++)
+        {
+            float weight = delta;
+            if (fogDensity > 0.0f)
+            {
+                float end = (i + 1) * delta;
+                float transmittance = pow(2.0f, -fogDensity * fogDensity * end * end * LOG2);
+                weight = prevTransmittance - transmittance;
+                prevTransmittance = transmittance;
+            }
+
+            newRay.tfar = (i + offset) * delta;
+            interInfo.interPos = Vector3(newRay.org[0], newRay.org[1], newRay.org[2]) + Vector3(newRay.dir[0], newRay.dir[1], newRay.dir[2]) * newRay.tfar;
+            Color4 lighting;
+            if (!this->getFroxelLighting(interInfo.interPos, lighting))
+                lighting = this->getLighting(newRay, interInfo)[EDirectLight];
+
+            result += lighting * weight;
+            weights += weight;
+        }
+
+        if (weights > 0.0f)
+            result *= 1.0f / weights;
+        result.a = 1.0f;
+        return result;
+    }
+
+    void CPURayRenderer::addFroxelTasks()
+    {
+        this->froxelsX = (this->Width + FROXEL_TILE - 1) / FROXEL_TILE;
+        this->froxelsY = (this->Height + FROXEL_TILE - 1) / FROXEL_TILE;
+        this->froxelsFar = FOG_RANGE / this->Owner->SceneManager->FogDensity;
+        this->froxels.assign(this->froxelsX * this->froxelsY * FROXEL_SLICES, Color4());
+
+        nextSample = 0;
+        this->thread->addNTasks([&](int) { while (this->computeFroxelRow()); return true; });
+        this->thread->addWaitTask();
+    }
+
+    bool CPURayRenderer::computeFroxelRow()
+    {
+        Profile;
+
+        int row = nextSample++;
+        if (!this->IsStarted || row >= this->froxelsY * (int)FROXEL_SLICES)
+            return false;
+
+        // the light scattered toward the camera at the froxels' centers
+        Sampler& sampler = Sampler::getSampler();
+        int y = row % this->froxelsY;
+        float depth = this->getFroxelDepth(row / this->froxelsY + 0.5f);
+        InterInfo interInfo;
+        for (int x = 0; x < this->froxelsX; x++)
+        {
+            Vector3 dir = upLeft + dx * ((x + 0.5f) * FROXEL_TILE) + dy * ((y + 0.5f) * FROXEL_TILE); // a unit step in depth
+            interInfo.interPos = pos + dir * depth;
+            dir.normalize();
+            interInfo.normal = dir;
+
+            embree::RTCRay rtcRay = RTCRay(pos, dir, 0);
+            sampler.start(this->Sampling, x, row, 0);
+            this->froxels[row * this->froxelsX + x] = this->getLighting(rtcRay, interInfo)[EDirectLight];
+        }
+        return true;
+    }
+
+    bool CPURayRenderer::getFroxelLighting(const Vector3& position, Color4& lighting) const
+    {
+        if (this->froxels.empty())
+            return false;
+
+        // froxel coordinates of the position
+        Vector3 v = position - pos;
+        float depth = dot(v, front);
+        if (depth <= 0.0f || depth > this->froxelsFar)
+            return false;
+        Vector3 screen = v * (1.0f / depth) - upLeft;
+        float coords[3];
+        coords[0] = dot(screen, dx) / (dx.lengthSqr() * FROXEL_TILE) - 0.5f;
+        coords[1] = dot(screen, dy) / (dy.lengthSqr() * FROXEL_TILE) - 0.5f;
+        coords[2] = sqrt(depth / this->froxelsFar) * FROXEL_SLICES - 0.5f;
+        if (coords[0] < -0.5f || coords[0] > this->froxelsX - 0.5f || coords[1] < -0.5f || coords[1] > this->froxelsY - 0.5f)
+            return false;
+
+        // trilinear between the froxels' centers, clamped at the borders
+        const int sizes[3] = { this->froxelsX, this->froxelsY, (int)FROXEL_SLICES };
+        int i0[3], i1[3];
+        float w[3];
+        for (int j = 0; j < 3; j++)
+        {
+            float c = min(max(coords[j], 0.0f), (float)(sizes[j] - 1));
+            i0[j] = (int)c;
+            i1[j] = min(i0[j] + 1, sizes[j] - 1);
+            w[j] = c - i0[j];
+        }
+
+        lighting = Color4::Black();
+        for (int k = 0; k < 8; k++)
+        {
+            int x = k & 1 ? i1[0] : i0[0];
+            int y = k & 2 ? i1[1] : i0[1];
+            int z = k & 4 ? i1[2] : i0[2];
+            float weight = (k & 1 ? w[0] : 1.0f - w[0]) * (k & 2 ? w[1] : 1.0f - w[1]) * (k & 4 ? w[2] : 1.0f - w[2]);
+            lighting += this->froxels[(z * this->froxelsY + y) * this->froxelsX + x] * weight;
+        }
+        return true;
+    }
+
+    Color4 CPURayRenderer::getGILighting(const embree::RTCRay& rtcRay, const InterInfo& interInfo, const Color4& pathMultiplier)
+    {
+        Profile;
+
+        bool shaded = false;
+        Color4 result = this->traceGIPath(rtcRay, interInfo, pathMultiplier, shaded);
+        if (!shaded) // the path ended at its first vertex
+            return result;
+
+        // a firefly is traced again with a shorter path
+        const int tries = 3;
+        for (int i = 0; i < tries - 1; i++)
+        {
+            if (result.intensity() < 20.0f)
+                break;
+            embree::RTCRay rtcNextRay = rtcRay;
+            rtcNextRay.align0++;
+            result = this->traceGIPath(rtcNextRay, interInfo, pathMultiplier, shaded);
+        }
+
+        // set to light cache, the only split of the path: at most GISamples more paths from the first vertex
+        if (this->LightCache && interInfo.sceneElement->Type != SceneElementType::EDynamicObject)
+        {
+            uint samples = adaptiveSampling(this->MinSamples, this->GISamples, this->SampleThreshold, [&](int)->Color4
+            {
+                embree::RTCRay rtcNextRay = rtcRay;
+                rtcNextRay.align0++;
+                bool temp;
+                const Color4& lighting = this->traceGIPath(rtcNextRay, interInfo, pathMultiplier, temp);
+                result += lighting;
+                return lighting;
+            });
+            result *= 1.0f / (samples + 1);
+
+            this->addLightCacheLighting(interInfo.interPos, result);
+        }
+
+        return result;
+    }
+
+    Color4 CPURayRenderer::traceGIPath(const embree::RTCRay& rtcFirstRay, const InterInfo& firstInterInfo, Color4 pathMultiplier, bool& shaded)
+    {
+        PathVertex vertices[MAX_PATH_LENGTH];
+        uint length = 0;
+        uint rays = 0;
+        embree::RTCRay rtcRay = rtcFirstRay;
+        InterInfo interInfo = firstInterInfo;
+        Color4 lighting; // of the last vertex
+        Color4 throughput = Color4::White(); // product of the vertices' multipliers
+
+        // forward, the vertices keep how their lighting depends on the next one's
+        while (true)
+        {
+            if ((uint)rtcRay.align0 >= this->MaxDepth || length >= MAX_PATH_LENGTH ||
+                (this->RouletteDepth == 0 && pathMultiplier.intensity() < 0.02f))
+            {
+                lighting = interInfo.color * this->Owner->SceneManager->AmbientLight;
+                lighting.a = 1.0f;
+                break;
+            }
+
+            if (!this->IsStarted || !interInfo.sceneElement)
+            {
+                lighting = Color4::Black();
+                break;
+            }
+
+            // get from light cache
+            if (this->getLightCacheLighting(interInfo.interPos, lighting))
+                break;
+
+
+            embree::RTCRay rtcNextRay;
+            Color4 base;
+            Color4 color;
+            float pdf = 1.0f;
+
+            float sample = Sampler::getSampler().next();
+
+            // diffuse
+            if ((interInfo.sceneElement->Type == SceneElementType::EStaticObject ||
+                 interInfo.sceneElement->Type == SceneElementType::EDynamicObject) &&
+                sample <= interInfo.diffuse)
+            {
+                base = this->getLighting(rtcRay, interInfo)[EDirectLight] * pathMultiplier;
+                base.a = 1.0f;
+
+                // GI
+                const Vector3& dir = hemisphereSample(interInfo.normal);
+                rtcNextRay = RTCRay(interInfo.interPos + interInfo.normal * 0.01f, dir, (uint)rtcRay.align0 + 1);
+                color = interInfo.color * (1.0f / PI) * max(0.0f, dot(interInfo.normal, dir));
+                pdf = (1.0f / (2.0f * PI)) * interInfo.diffuse;
+            }
+            else if (sample <= interInfo.diffuse) // non static objects
+            {
+                lighting = interInfo.color;
+                lighting.a = 1.0f;
+                break;
+            }
+
+            // refraction
+            if (interInfo.diffuse < sample && sample <= interInfo.diffuse + interInfo.refraction)
+            {
+                const Material* material = interInfo.material;
+                float glossiness = material ? material->Glossiness : 1.0f;
+
+                Vector3 n = interInfo.normal;
+                if (glossiness > 0.0f && glossiness < 0.999f) // glossy
+                    n = glossy(n, glossiness);
+
+                float ior = 1.0f / (material ? material->IOR : 1.5f);
+                if (getFlag(rtcRay.align1, RayFlags::RAY_INSIDE))
+                    ior = 1.0f / ior;
+                Vector3 dir = refract(Vector3(rtcRay.dir[0], rtcRay.dir[1], rtcRay.dir[2]), n, ior);
+
+                if (dir.length() < 0.001f) // total inner reflection
+                {
+                    lighting = Color4::Black();
+                    break;
+                }
+
+                rtcNextRay = RTCRay(interInfo.interPos, dir, (uint)rtcRay.align0 + 1);
+                setFlag(rtcNextRay.align1, RayFlags::RAY_INSIDE, !getFlag(rtcRay.align1, RayFlags::RAY_INSIDE));
+                color = Color4::White();
+                pdf = interInfo.refraction;
+            }
+
+            // reflection
+            if (interInfo.diffuse + interInfo.refraction < sample)
+            {
+                const Material* material = interInfo.material;
+                float glossiness = material ? material->Glossiness : 1.0f;
+
+                Vector3 n = interInfo.normal;
+                if (glossiness > 0.0f && glossiness < 0.999f) // glossy
+                    n = glossy(n, glossiness);
+
+                Vector3 dir = reflect(Vector3(rtcRay.dir[0], rtcRay.dir[1], rtcRay.dir[2]), n);
+                rtcNextRay = RTCRay(interInfo.interPos, dir, (uint)rtcRay.align0 + 1);
+                color = Color4::White();
+                pdf = interInfo.reflection;
+            }
+
+
+            // the vertex's lighting is color * inside(fog(base + next lighting)) with the alpha averaged
+            PathVertex& vertex = vertices[length++];
+            vertex.position = interInfo.interPos;
+            vertex.cache = this->LightCache && interInfo.sceneElement->Type != SceneElementType::EDynamicObject;
+            vertex.offset = base;
+            vertex.offset.a /= 2.0f;
+            vertex.multiplier = Color4(1.0f, 1.0f, 1.0f, 0.5f);
+
+            // fog
+            float fogDensity = this->Owner->SceneManager->FogDensity;
+            if (fogDensity > 0.0f)
+            {
+                float fogFactor = pow(2.0f, -fogDensity * fogDensity * rtcRay.tfar * rtcRay.tfar * LOG2);
+                fogFactor = min(max(fogFactor, 0.0f), 1.0f);
+                vertex.offset = this->Owner->SceneManager->FogColor * (1.0f - fogFactor) + vertex.offset * fogFactor;
+                vertex.multiplier = vertex.multiplier * fogFactor;
+            }
+
+            // inside of the object (in computeColor, getLighting.shadow, getGILighting too)
+            if (getFlag(rtcRay.align1, RayFlags::RAY_INSIDE))
+            {
+                const Material* material = interInfo.material;
+                if (material && material->InnerColor.intensity() > 0.01f)
+                {
+                    float absFactor = exp(-rtcRay.tfar * material->Absorption);
+                    absFactor = min(max(absFactor, 0.0f), 1.0f);
+                    vertex.offset = material->InnerColor * (1.0f - absFactor) + vertex.offset * absFactor;
+                    vertex.multiplier = vertex.multiplier * absFactor;
+                }
+            }
+
+            vertex.offset = interInfo.color * vertex.offset;
+            vertex.multiplier = interInfo.color * vertex.multiplier;
+            pathMultiplier = pathMultiplier * color * (1.0f / pdf);
+            throughput = throughput * vertex.multiplier;
+
+            // Russian roulette, a surviving path carries the lighting of the ended ones
+            float survival = this->getSurvival((uint)rtcNextRay.align0, throughput * pathMultiplier);
+            if (survival < 1.0f)
+            {
+                if (Sampler::getSampler().next() >= survival)
+                {
+                    lighting = Color4::Black();
+                    break;
+                }
+                Color4 weight(1.0f / survival, 1.0f / survival, 1.0f / survival, 1.0f);
+                vertex.multiplier = vertex.multiplier * weight;
+                throughput = throughput * weight;
+            }
+
+
+            // trace
+            rtcNextRay.align1 = rtcRay.align1;
+            rtcNextRay.align2 = this->getRayConeWidth(rtcRay);
+            embree::rtcIntersect(this->rtcScene, rtcNextRay);
+            rays++;
+            rtcRay = rtcNextRay;
+            interInfo = this->getInterInfo(rtcRay);
+        }
+
+        // backward, the lighting of the deeper vertices goes to the light cache, the first one's to the caller
+        for (int i = (int)length - 1; i >= 0; i--)
+        {
+            lighting = vertices[i].offset + vertices[i].multiplier * lighting;
+            if (i > 0 && vertices[i].cache)
+                this->addLightCacheLighting(vertices[i].position, lighting);
+        }
+        shaded = length > 0;
+        giPathCounts.paths++;
+        giPathCounts.rays += rays;
+        return lighting;
+    }
+
+    void CPURayRenderer::takeGIPathCounts(RegionBuffer& regionBuffer)
+    {
+        regionBuffer.giPaths = giPathCounts.paths;
+        regionBuffer.giRays = giPathCounts.rays;
+        giPathCounts.paths = 0;
+        giPathCounts.rays = 0;
+    }
+
+    float CPURayRenderer::getSurvival(uint depth, const Color4& throughput) const
+    {
+        if (this->RouletteDepth == 0 || depth < this->RouletteDepth)
+            return 1.0f;
+
+        return min(max(throughput.intensity(), 0.05f), 1.0f);
+    }
+
+    bool CPURayRenderer::getLightCacheLighting(const Vector3& pos, Color4& lighting)
+    {
+        if (!this->LightCache)
+            return false;
+
+        return this->lightCache.get(pos, lighting);
+    }
+
+    void CPURayRenderer::addLightCacheLighting(const Vector3& pos, const Color4& lighting)
+    {
+        // the light cache the render nodes got stays the same for the regions of all of them
+        if (this->lightCacheShared)
+            return;
+
+        this->lightCache.add(pos, lighting);
+    }
+
+    void CPURayRenderer::getGICacheKeys(unsigned long long& sceneKey, unsigned long long& irrMapKey) const
+    {
+        // the lights are left out, so a lighting tweak still reuses the caches
+        sceneKey = 14695981039346656037ULL;
+        set<uint> contentIDs; // a shared content is hashed once
+        for (const auto& instance : this->rtcInstances)
+        {
+            const SceneElement* sceneElement = instance.element.get();
+            if (!sceneElement || (sceneElement->Type != SceneElementType::EStaticObject && sceneElement->Type != SceneElementType::EDynamicObject))
+                continue;
+
+            hashCombine(sceneKey, sceneElement->ID);
+            hashCombine(sceneKey, sceneElement->ContentID);
+            hashCombine(sceneKey, sceneElement->MaterialID);
+            hashCombine(sceneKey, sceneElement->Textures);
+            for (int j = 0; j < 3; j++)
+            {
+                hashCombine(sceneKey, sceneElement->Position[j]);
+                hashCombine(sceneKey, sceneElement->Scale[j]);
+            }
+            hashCombine(sceneKey, sceneElement->Rotation);
+            contentIDs.insert(sceneElement->ContentID);
+            contentIDs.insert(sceneElement->MaterialID);
+            contentIDs.insert(sceneElement->Textures.DiffuseMapID);
+            contentIDs.insert(sceneElement->Textures.NormalMapID);
+        }
+        for (uint id : contentIDs)
+        {
+            auto it = this->contentElements.find(id);
+            if (it == this->contentElements.end())
+                continue;
+
+            hashCombine(sceneKey, id);
+            const ContentElement* contentElement = it->second.get();
+            if (contentElement->Type == ContentElementType::EMesh)
+            {
+                const Mesh* mesh = (const Mesh*)contentElement;
+                hashCombine(sceneKey, mesh->Vertices);
+                hashCombine(sceneKey, mesh->Normals);
+                hashCombine(sceneKey, mesh->TexCoords);
+                hashCombine(sceneKey, mesh->Triangles);
+            }
+            else if (contentElement->Type == ContentElementType::EMaterial)
+            {
+                // the material's textures are in the contentElements too
+                const Material* material = (const Material*)contentElement;
+                hashCombine(sceneKey, material->DiffuseColor);
+                hashCombine(sceneKey, material->SpecularColor);
+                hashCombine(sceneKey, material->InnerColor);
+                hashCombine(sceneKey, material->Shininess);
+                hashCombine(sceneKey, material->Glossiness);
+                hashCombine(sceneKey, material->IOR);
+                hashCombine(sceneKey, material->Absorption);
+                hashCombine(sceneKey, material->Textures);
+                for (uint textureID : { material->Textures.DiffuseMapID, material->Textures.NormalMapID })
+                {
+                    auto texture = this->contentElements.find(textureID);
+                    if (texture != this->contentElements.end() && contentIDs.find(textureID) == contentIDs.end())
+                        this->hashTexture(sceneKey, (const Texture*)texture->second.get());
+                }
+            }
+            else if (contentElement->Type == ContentElementType::ETexture)
+                this->hashTexture(sceneKey, (const Texture*)contentElement);
+        }
+        hashCombine(sceneKey, this->Owner->SceneManager->AmbientLight);
+        hashCombine(sceneKey, this->Owner->SceneManager->FogColor);
+        hashCombine(sceneKey, this->Owner->SceneManager->FogDensity);
+        hashCombine(sceneKey, this->GISamples);
+        hashCombine(sceneKey, this->MinSamples);
+        hashCombine(sceneKey, this->MaxSamples);
+        hashCombine(sceneKey, this->SampleThreshold);
+        hashCombine(sceneKey, this->Sampling);
+        hashCombine(sceneKey, this->MaxLights);
+        hashCombine(sceneKey, this->MaxDepth);
+        hashCombine(sceneKey, this->RouletteDepth);
+        hashCombine(sceneKey, this->LightCacheSampleSize);
+
+        // the irradiance map is in screen space
+        irrMapKey = sceneKey;
+        for (int j = 0; j < 3; j++)
+        {
+            hashCombine(irrMapKey, this->pos[j]);
+            hashCombine(irrMapKey, this->upLeft[j]);
+            hashCombine(irrMapKey, this->dx[j]);
+            hashCombine(irrMapKey, this->dy[j]);
+        }
+        hashCombine(irrMapKey, this->focalPlaneDist);
+        hashCombine(irrMapKey, this->fNumber);
+        hashCombine(irrMapKey, this->Width);
+        hashCombine(irrMapKey, this->Height);
+        hashCombine(irrMapKey, this->RegionSize);
+        hashCombine(irrMapKey, this->IrradianceMapSamples);
+        hashCombine(irrMapKey, this->IrradianceMapDistanceThreshold);
+        hashCombine(irrMapKey, this->IrradianceMapNormalThreshold);
+        hashCombine(irrMapKey, this->IrradianceMapColorThreshold);
+        hashCombine(irrMapKey, this->LightCache);
+    }
+
+    void CPURayRenderer::hashTexture(unsigned long long& key, const Texture* texture)
+    {
+        hashCombine(key, texture->ID);
+        hashCombine(key, texture->Width);
+        hashCombine(key, texture->Height);
+        if (texture->Pixels)
+            hashBytes(key, texture->Pixels, texture->Width * texture->Height * 4);
+    }
+
+    string CPURayRenderer::getGICachePath(unsigned long long sceneKey) const
+    {
+        stringstream path;
+        path << CACHE_FOLDER << "\\" << hex << setw(16) << setfill('0') << sceneKey << GI_CACHE_EXT;
+        return path.str();
+    }
+
+    bool CPURayRenderer::loadGICache()
+    {
+        Profile;
+
+        unsigned long long sceneKey, irrMapKey;
+        this->getGICacheKeys(sceneKey, irrMapKey);
+        string filePath = this->getGICachePath(sceneKey);
+
+        MappedFile file;
+        if (!file.open(filePath) || this->readGICache(file.data(), file.size(), filePath) == NULL)
+            return false;
+
+        Engine::Log(LogType::ELog, "CPURayRenderer", "GI cache loaded from: " + filePath);
+        return true;
+    }
+
+    bool CPURayRenderer::saveGICache()
+    {
+        Profile;
+
+        if (!(this->LightCache && !this->lightCache.empty()) && !(this->IrradianceMap && !this->irrMapSamples.empty()))
+            return true;
+
+        unsigned long long sceneKey, irrMapKey;
+        this->getGICacheKeys(sceneKey, irrMapKey);
+        _mkdir(CACHE_FOLDER);
+        string filePath = this->getGICachePath(sceneKey);
+        ofstream ofile(filePath, ios_base::out | ios_base::binary);
+        if (!ofile || !ofile.is_open())
+        {
+            Engine::Log(LogType::EWarning, "CPURayRenderer", "Cannot save GI cache file: " + filePath);
+            return false;
+        }
+
+        this->writeGICache(ofile);
+        ofile.close();
+
+        Engine::Log(LogType::ELog, "CPURayRenderer", "GI cache saved to: " + filePath);
+        return true;
+    }
+
+    void CPURayRenderer::writeGICache(ostream& file) const
+    {
+        bool lightCache = this->LightCache && !this->lightCache.empty();
+        bool irrMap = this->IrradianceMap && !this->irrMapSamples.empty();
+
+        GICacheHeader header;
+        memcpy(header.magic, "MGIC", 4);
+        header.version = GI_CACHE_VERSION;
+        this->getGICacheKeys(header.sceneKey, header.irrMapKey);
+        header.lightCacheSize = lightCache ? this->lightCache.dataSize() : 0;
+        header.lightCacheSamples = lightCache ? this->lightCache.size() : 0;
+        header.irrMapSamples = irrMap ? (uint)this->irrMapSamples.size() : 0;
+        header.irrMapTriangles = irrMap ? (uint)this->irrMapTriangles.size() : 0;
+
+        file.write((const char*)&header, sizeof(header));
+        if (lightCache)
+            file.write((const char*)this->lightCache.data(), header.lightCacheSize);
+        if (irrMap)
+        {
+            file.write((const char*)&this->irrMapSamples[0], this->irrMapSamples.size() * sizeof(IrradianceMapSample));
+            file.write((const char*)&this->irrMapTriangles[0], this->irrMapTriangles.size() * sizeof(int));
+        }
+    }
+
+    const byte* CPURayRenderer::readGICache(const byte* data, size_t size, const string& filePath, bool checkKeys /* = true */)
+    {
+        unsigned long long sceneKey, irrMapKey;
+        this->getGICacheKeys(sceneKey, irrMapKey);
+
+        if (size < sizeof(GICacheHeader))
+            return NULL;
+        const GICacheHeader& header = *(const GICacheHeader*)data;
+        if (memcmp(header.magic, "MGIC", 4) != 0 || header.version != GI_CACHE_VERSION || (checkKeys && header.sceneKey != sceneKey))
+            return NULL;
+        if (size < sizeof(GICacheHeader) + header.lightCacheSize + header.irrMapSamples * sizeof(IrradianceMapSample) + header.irrMapTriangles * sizeof(int))
+        {
+            Engine::Log(LogType::EWarning, "CPURayRenderer", "Invalid GI cache file: " + filePath);
+            return NULL;
+        }
+
+        // the animation frames keep the light cache they already have
+        data += sizeof(GICacheHeader);
+        if (this->LightCache && this->lightCache.empty() && header.lightCacheSize > 0)
+            this->lightCache.setData(data, (size_t)header.lightCacheSize, this->LightCacheSampleSize, header.lightCacheSamples);
+        data += header.lightCacheSize;
+
+        if (this->IrradianceMap && (!checkKeys || header.irrMapKey == irrMapKey))
+        {
+            const IrradianceMapSample* samples = (const IrradianceMapSample*)data;
+            this->irrMapSamples.assign(samples, samples + header.irrMapSamples);
+            const int* triangles = (const int*)(data + header.irrMapSamples * sizeof(IrradianceMapSample));
+            this->irrMapTriangles.assign(triangles, triangles + header.irrMapTriangles);
+        }
+        return data + header.irrMapSamples * sizeof(IrradianceMapSample) + header.irrMapTriangles * sizeof(int);
+    }
+
+    unsigned long long CPURayRenderer::getCheckpointKey() const
+    {
+        // a checkpoint continues the same image only, so unlike the GI caches' keys everything that changes it is in
+        unsigned long long sceneKey, key;
+        this->getGICacheKeys(sceneKey, key);
+        auto hashElement = [&](const SceneElement* sceneElement)
+        {
+            hashCombine(key, sceneElement->ID);
+            hashCombine(key, sceneElement->MaterialID);
+            for (int j = 0; j < 3; j++)
+            {
+                hashCombine(key, sceneElement->Position[j]);
+                hashCombine(key, sceneElement->Scale[j]);
+            }
+            hashCombine(key, sceneElement->Rotation);
+        };
+        for (auto instances : { &this->rtcInstances, &this->rtcSystemInstances })
+        {
+            for (const auto& instance : *instances)
+            {
+                if (instance.element)
+                    hashElement(instance.element.get());
+            }
+        }
+        for (const auto& lightElement : this->lights)
+        {
+            hashElement(lightElement.get());
+            const Light* light = (const Light*)lightElement.get();
+            hashCombine(key, light->LType);
+            hashCombine(key, light->Color);
+            hashCombine(key, light->Intensity);
+            hashCombine(key, light->Radius);
+            hashCombine(key, light->SpotExponent);
+            hashCombine(key, light->SpotCutoff);
+        }
+        hashCombine(key, this->MaxSamples);
+        hashCombine(key, (int)this->Sampling);
+        hashCombine(key, this->MaxLights);
+        hashCombine(key, this->GI);
+        hashCombine(key, this->IrradianceMap);
+        hashCombine(key, this->VolumetricFog);
+        return key;
+    }
+
+    string CPURayRenderer::getCheckpointPath(unsigned long long key) const
+    {
+        stringstream path;
+        path << CACHE_FOLDER << "\\" << hex << setw(16) << setfill('0') << key << CHECKPOINT_EXT;
+        return path.str();
+    }
+
+    void CPURayRenderer::takeCheckpoint()
+    {
+        Profile;
+        if (this->checkpointWriter.joinable())
+            this->checkpointWriter.join();
+
+        shared_ptr<Checkpoint> checkpoint = make_shared<Checkpoint>();
+        CheckpointHeader& header = checkpoint->header;
+        memcpy(header.magic, "MCHK", 4);
+        header.version = CHECKPOINT_VERSION;
+        header.key = this->checkpointKey;
+        header.width = this->Width;
+        header.height = this->Height;
+        header.regions = (uint)this->Regions.size();
+        header.aovs = AOVS_COUNT;
+        header.refinePass = this->refinePass ? 1 : 0;
+        this->checkpointTime = chrono::system_clock::now();
+
+        // the regions' flushes wait for the copy, so a region is in it either before or after its pass
+        size_t pixels = (size_t)this->Width * this->Height;
+        this->thread->rw_mutex("checkpoint").write_lock();
+        checkpoint->pixelStats = this->pixelStats;
+        for (int k = 0; k < AOVS_COUNT; k++)
+            checkpoint->aovs[k].assign(this->aovBuffers[k]->data, this->aovBuffers[k]->data + pixels);
+        this->thread->rw_mutex("checkpoint").write_unlock();
+
+        for (const auto& region : this->Regions)
+        {
+            bool done = true;
+            for (int j = region.y; j < region.y + region.h && done; j++)
+            {
+                for (int i = region.x; i < region.x + region.w && done; i++)
+                    done = checkpoint->pixelStats[j * this->Width + i].count > 0;
+            }
+            checkpoint->regionTimes.push_back(region.time);
+            checkpoint->regionsDone.push_back(done ? 1 : 0);
+        }
+
+        this->checkpointWriter = std::thread([this, checkpoint]()
+        {
+            this->writeCheckpoint(*checkpoint);
+            this->checkpointing = false;
+        });
+    }
+
+    bool CPURayRenderer::writeCheckpoint(const Checkpoint& checkpoint)
+    {
+        // the previous checkpoint is replaced only by a complete file
+        _mkdir(CACHE_FOLDER);
+        string filePath = this->getCheckpointPath(checkpoint.header.key);
+        string tempPath = filePath + ".tmp";
+        ofstream ofile(tempPath, ios_base::out | ios_base::binary);
+        if (!ofile || !ofile.is_open())
+        {
+            Engine::Log(LogType::EWarning, "CPURayRenderer", "Cannot save checkpoint file: " + tempPath);
+            return false;
+        }
+
+        ofile.write((const char*)&checkpoint.header, sizeof(checkpoint.header));
+        this->writeGICache(ofile);
+        ofile.write((const char*)&checkpoint.regionTimes[0], checkpoint.regionTimes.size() * sizeof(float));
+        ofile.write((const char*)&checkpoint.pixelStats[0], checkpoint.pixelStats.size() * sizeof(RunningStats));
+        for (int k = 0; k < AOVS_COUNT; k++)
+            ofile.write((const char*)&checkpoint.aovs[k][0], checkpoint.aovs[k].size() * sizeof(Color4));
+        ofile.write((const char*)&checkpoint.regionsDone[0], checkpoint.regionsDone.size());
+        ofile.close();
+
+        remove(filePath.c_str());
+        if (!ofile || rename(tempPath.c_str(), filePath.c_str()) != 0)
+        {
+            Engine::Log(LogType::EWarning, "CPURayRenderer", "Cannot save checkpoint file: " + filePath);
+            remove(tempPath.c_str());
+            return false;
+        }
+
+        Engine::Log(LogType::ELog, "CPURayRenderer", "Checkpoint saved to: " + filePath);
+        return true;
+    }
+
+    bool CPURayRenderer::loadCheckpoint()
+    {
+        Profile;
+
+        this->checkpointKey = this->getCheckpointKey();
+        string filePath = this->getCheckpointPath(this->checkpointKey);
+        MappedFile file;
+        if (!file.open(filePath))
+            return false;
+
+        if (file.size() < sizeof(CheckpointHeader))
+            return false;
+        const CheckpointHeader& header = *(const CheckpointHeader*)file.data();
+        if (memcmp(header.magic, "MCHK", 4) != 0 || header.version != CHECKPOINT_VERSION ||
+            header.key != this->checkpointKey || header.width != this->Width || header.height != this->Height ||
+            header.regions != this->Regions.size() || header.aovs != AOVS_COUNT)
+            return false;
+
+        // the checkpoint's light cache replaces the one of the GI cache file
+        this->lightCache.clear();
+        const byte* end = file.data() + file.size();
+        const byte* data = this->readGICache(file.data() + sizeof(CheckpointHeader), file.size() - sizeof(CheckpointHeader), filePath);
+        size_t pixels = (size_t)this->Width * this->Height;
+        if (data == NULL || (size_t)(end - data) < header.regions * (sizeof(float) + sizeof(byte)) + pixels * (sizeof(RunningStats) + AOVS_COUNT * sizeof(Color4)))
+        {
+            Engine::Log(LogType::EWarning, "CPURayRenderer", "Invalid checkpoint file: " + filePath);
+            return false;
+        }
+
+        const float* times = (const float*)data;
+        data += header.regions * sizeof(float);
+        const RunningStats* stats = (const RunningStats*)data;
+        this->pixelStats.assign(stats, stats + pixels);
+        data += pixels * sizeof(RunningStats);
+        for (int k = 0; k < AOVS_COUNT; k++)
+        {
+            memcpy(this->aovBuffers[k]->data, data, pixels * sizeof(Color4));
+            data += pixels * sizeof(Color4);
+        }
+
+        // the refine phase picks its regions from the pixels' stats
+        const byte* done = data;
+        this->resumeRegions.clear();
+        for (uint i = 0; i < header.regions; i++)
+        {
+            this->Regions[i].time = times[i];
+            if (!done[i] && !header.refinePass)
+                this->resumeRegions.push_back(i);
+        }
+
+        Engine::Log(LogType::ELog, "CPURayRenderer", "Checkpoint loaded from: " + filePath + ", " + to_string(this->resumeRegions.size()) + " of " +
+            to_string(this->Regions.size()) + " regions left in the render phase");
+        return true;
+    }
+
+    bool CPURayRenderer::finishCheckpoints()
+    {
+        if (!this->checkpoints)
+            return true;
+
+        this->checkpoints = false;
+        if (this->checkpointWriter.joinable())
+            this->checkpointWriter.join();
+
+        // a stopped render is saved to be resumed, a finished one doesn't need its checkpoint anymore
+        if (!this->IsStarted)
+        {
+            this->checkpointing = true;
+            this->takeCheckpoint();
+            this->checkpointWriter.join();
+        }
+        else
+            remove(this->getCheckpointPath(this->checkpointKey).c_str());
+        return true;
+    }
+
+    void CPURayRenderer::startRenderNodes()
+    {
+        if (this->RenderNodes == 0 || this->Progressive)
+            return;
 
-        this->thread->rw_mutex("lights").read_lock();
-        auto newLights = this->lights;
-        this->thread->rw_mutex("lights").read_unlock();
-        if (newLights.empty())
-            newLights = this->Owner->SceneManager->GetElements(SceneElementType::ELight);
-        uint count = this->MaxLights > 0 ? this->MaxLights : (uint)newLights.size();
-        if (newLights.size() > count)
+        // the nodes load the scene saved for them and the same content database, no backup of the previous scene
+        _mkdir(CACHE_FOLDER);
+        remove(RENDER_NODES_SCENE);
+        if (!this->Owner->SceneManager->Save(RENDER_NODES_SCENE))
+            return;
+
+        if (!this->nodesListening)
         {
-            sort(newLights.begin(), newLights.end(), [&](const SceneElementPtr a, const SceneElementPtr b) -> bool
+            if (!this->nodesListener.listen(RENDER_NODES_PORT))
             {
-                if (a->Visible != b->Visible)
-                    return a->Visible > b->Visible;
-                else
-                {
-                    Light* aLight = (Light*)a.get();
-                    Light* bLight = (Light*)b.get();
-                    if (aLight->LType != bLight->LType)
-                        return aLight->LType < bLight->LType;
-
-                    float aContribution = aLight->Color.intensity() * aLight->Intensity / (aLight->Position - interInfo.interPos).lengthSqr();
-                    float bContribution = bLight->Color.intensity() * bLight->Intensity / (bLight->Position - interInfo.interPos).lengthSqr();
-                    return aContribution > bContribution;
-                }
-            });
-        }
-        if (this->lights.empty())
-        {
-            this->thread->rw_mutex("lights").write_lock();
-            this->lights = newLights;
-            this->thread->rw_mutex("lights").write_unlock();
+                Engine::Log(LogType::EWarning, "CPURayRenderer", "Cannot listen for render nodes on port " + to_string(RENDER_NODES_PORT));
+                return;
+            }
+            this->nodesListening = true;
+            this->nodesAcceptor = std::thread([&]() { this->acceptRenderNodes(); });
         }
 
-
-        count = min((uint)newLights.size(), count);
-        for (uint i = 0; i < count; i++)
+        // the started processes connect in the background and join one of the next render phases
+        this->nodesProcesses.erase(remove_if(this->nodesProcesses.begin(), this->nodesProcesses.end(),
+            [](const unique_ptr<Process>& process) { return !process->isRunning(); }), this->nodesProcesses.end());
+        while (this->nodesProcesses.size() < this->RenderNodes)
         {
-            // for indirect rays
-            if (getFlag(rtcRay.align1, RayFlags::RAY_INDIRECT))
+            unique_ptr<Process> process(new Process());
+            if (!process->start(string(RENDER_NODE_ARG) + " localhost " + to_string(RENDER_NODES_PORT) + " " + to_string(this->Type)))
             {
-                if (i > 0)
-                    break;
-                i = Random::getRandomGen().randInt(0, count - 1);
+                Engine::Log(LogType::EWarning, "CPURayRenderer", "Cannot start a render node process");
+                break;
             }
+            this->nodesProcesses.push_back(move(process));
+        }
+    }
 
-            if (!newLights[i]->Visible)
+    void CPURayRenderer::acceptRenderNodes()
+    {
+        while (this->nodesListening)
+        {
+            unique_ptr<RenderNode> node(new RenderNode());
+            if (!this->nodesListener.accept(node->socket, 100))
                 continue;
 
-            ColorsMapType tempLighting;
-            uint samples = adaptiveSampling(this->MinSamples, this->MaxSamples, this->SampleThreshold, [&](int) -> Color4
+            int type = -1;
+            node->workers = 0;
+            node->firstSlot = 0;
+            string data;
+            if (node->socket.wait(1000) && node->socket.receive(data))
             {
-                const auto& temp = this->getLighting(rtcRay, (Light*)newLights[i].get(), interInfo);
-                for (const auto& color : temp)
-                    tempLighting[color.first] += color.second;
-                return temp.size() != 0 ? temp.at("DirectLight") : Color4();
-            });
+                istringstream message(data);
+                Read(message, type);
+                Read(message, node->workers);
+            }
+            if (type != ENodeHello || node->workers == 0)
+                continue;
 
-            float div = (1.0f / samples);
-            lighting["DirectLight"] += tempLighting["DirectLight"] * div;
-            lighting["Specular"] += tempLighting["Specular"] * div;
-            lighting["Samples"] += Color4(0, 0, (float)(samples - 2) / (this->MaxSamples - 2));
+            lock lck(this->thread->mutex("nodes"));
+            this->renderNodes.push_back(move(node));
+            Engine::Log(LogType::ELog, "CPURayRenderer", "Render node connected with " + to_string(this->renderNodes.back()->workers) + " workers");
         }
-
-        lighting["DirectLight"].a = 1.0f;
-        lighting["Specular"].a = 1.0f;
-        lighting["Samples"].b /= count;
-        lighting["Samples"].a = 1.0f;
-        return lighting;
+        this->nodesListener.close();
     }
 
-    CPURayRenderer::ColorsMapType CPURayRenderer::getLighting(const embree::RTCRay& rtcRay, const Light* light, const InterInfo& interInfo)
+    bool CPURayRenderer::scheduleRenderPass()
     {
-        ColorsMapType lighting;
-        lighting["DirectLight"] = Color4::Black();
-        lighting["Specular"] = Color4::Black();
+        if (!this->IsStarted)
+            return false;
 
-        // light direction
-        Vector3 lightDir = light->Rotation * Vector3(0.0f, -1.0f, 0.0f);
-        lightDir.normalize();
+        lock lck(this->thread->mutex("nodes"));
 
-        // calculate base lighting
-        embree::RTCRay4 rtcRay4;
-        Color4 baseLightings[RAYS];
-        Vector3 shadowDirs[RAYS];
-        float lightDists[RAYS];
-        for (int i = 0; i < RAYS; i++)
+        // forget the lost nodes, their drivers ended with the previous render phase
+        for (auto& node : this->renderNodes)
         {
-            lightDists[i] = 0.1f;
-            setRTCRay4(rtcRay4, i, RTCRay(interInfo.interPos, Vector3(), 0, 0.1f, lightDists[i]));
-
-            Vector3 lightSample = this->getLightSample(light, RAYS, i);
-            shadowDirs[i] = lightSample - interInfo.interPos;
-            if (shadowDirs[i].length() > light->Radius * 1.10f)
+            if (node->driver.joinable())
+                node->driver.join();
+        }
+        this->renderNodes.erase(remove_if(this->renderNodes.begin(), this->renderNodes.end(),
+            [](const unique_ptr<RenderNode>& node) { return !node->socket.isOpen(); }), this->renderNodes.end());
+
+        ostringstream frame;
+        this->nodesFrame++;
+        Write(frame, (int)ENodeFrame);
+        Write(frame, this->nodesFrame);
+        Write(frame, string(RENDER_NODES_SCENE));
+        Write(frame, this->Width);
+        Write(frame, this->Height);
+        this->writeRenderNodeSettings(frame);
+        // the light cache and the irradiance map are done, the nodes use them instead of their own
+        if (this->GI)
+            this->writeGICache(frame);
+
+        // every worker of a node has its own deque in the tile scheduler
+        vector<RenderNode*> nodes;
+        this->nodesWorkers = 0;
+        for (auto& node : this->renderNodes)
+        {
+            if (nodes.size() >= this->RenderNodes || !node->socket.send(frame.str()))
                 continue;
-            float lensq = max(shadowDirs[i].lengthSqr(), 1.0f);
-            shadowDirs[i].normalize();
 
-            // fog
-            float fogFactor = 1.0f;
-            if (this->Owner->SceneManager->FogDensity > 0.0f)
-            {
-                fogFactor = pow(2.0f, -this->Owner->SceneManager->FogDensity * this->Owner->SceneManager->FogDensity * lensq * LOG2);
-                fogFactor = min(max(fogFactor, 0.0f), 1.0f);
-                if (fogFactor == 0.0f)
-                    continue;
-            }
+            node->firstSlot = (int)this->thread->workersCount() + this->nodesWorkers;
+            this->nodesWorkers += node->workers;
+            nodes.push_back(node.get());
+        }
+        // the nodes' regions read the light cache of the message, so the local ones read the same until the frame ends
+        if (!nodes.empty())
+            this->lightCacheShared = true;
+        if (this->resuming)
+            this->scheduleRegions(this->resumeRegions, true);
+        else
+            this->scheduleRegions(true);
+        this->resuming = false;
 
-            // spot effect
-            float spotEffect = dot(-shadowDirs[i], lightDir);
-            if (spotEffect < cos(light->SpotCutoff * PI / 180.0f))
-            {
-                spotEffect = 0.0f;
-                continue; // if spotEffect is 0 then no need for further calculations
-            }
-            else if (spotEffect > 0.0f)
-                spotEffect = pow(spotEffect, light->SpotExponent);
-            else
-                spotEffect = 1.0f;
+        // the render and refine phases take the checkpoints
+        this->checkpointKey = this->getCheckpointKey();
+        this->checkpointTime = chrono::system_clock::now();
+        this->checkpoints = this->CheckpointTime > 0.0f;
 
-            // calculate lighting
-            baseLightings[i] = light->Color * (light->Intensity / lensq);// *abs(dot(lightDir, -shadowDir)); // (cosine between the light's direction and the normed ray toward the hitpos)
-            baseLightings[i] = baseLightings[i] * spotEffect * fogFactor;
-            if (sqrt(lensq) > light->Radius)
-                baseLightings[i] *= (light->Radius * 1.10f - sqrt(lensq)) / (light->Radius * 0.10f);
+        for (auto node : nodes)
+            node->driver = std::thread([this, node]() { this->driveRenderNode(node); });
+        return true;
+    }
 
-            lightDists[i] = sqrt(lensq) - 0.1f;
-            setRTCRay4(rtcRay4, i, RTCRay(interInfo.interPos, shadowDirs[i], 0, 0.1f, lightDists[i]));
-        }
+    bool CPURayRenderer::finishRenderPass()
+    {
+        lock lck(this->thread->mutex("nodes"));
 
-        // shadow
-        bool inside = getFlag(rtcRay.align1, RayFlags::RAY_INSIDE);
-        while (lightDists[0] > 0.01f || lightDists[1] > 0.01f || lightDists[2] > 0.01f || lightDists[3] > 0.01f)
+        for (auto& node : this->renderNodes)
         {
-            embree::rtcIntersect4(VALID, this->rtcScene, rtcRay4);
+            if (node->driver.joinable())
+                node->driver.join();
+        }
+        this->nodesWorkers = 0;
+        return true;
+    }
 
-            for (int i = 0; i < RAYS; i++)
+    void CPURayRenderer::driveRenderNode(RenderNode* node)
+    {
+        // the node prepares the frame first, the other workers steal its regions meanwhile
+        vector<bool> busy(node->workers, false);
+        bool ready = false;
+        while (this->IsStarted && node->socket.isOpen())
+        {
+            if (ready)
             {
-                const InterInfo& shadowInterInfo = this->getInterInfo(getRTCRay(rtcRay4, i), true);
-                if (rtcRay4.instID[i] != RTC_INVALID_GEOMETRY_ID && shadowInterInfo.sceneElement->Type != SceneElementType::ELight)
+                for (uint i = 0; i < node->workers; i++)
                 {
-                    baseLightings[i] *= shadowInterInfo.color * (1.0f - shadowInterInfo.color.a);
+                    Region region(0, 0, 0, 0);
+                    if (busy[i] || !this->getNextRegion(node->firstSlot + i, region))
+                        continue;
 
-                    // inside of the object (in computeColor, getLighting.shadow, getGILighting too)
-                    if (baseLightings[i].intensity() > 0.001f && inside)
-                    {
-                        Material* material = (Material*)this->contentElements[shadowInterInfo.sceneElement->MaterialID].get();
-                        if (material && material->InnerColor.intensity() > 0.01f)
-                        {
-                            float absFactor = exp(-rtcRay.tfar * material->Absorption);
-                            absFactor = min(max(absFactor, 0.0f), 1.0f);
-
-                            baseLightings[i] = material->InnerColor * (1.0f - absFactor) + baseLightings[i] * absFactor;
-                        }
-                    }
+                    busy[i] = true;
+                    ostringstream message;
+                    Write(message, (int)ENodeRegion);
+                    Write(message, this->nodesFrame);
+                    Write(message, i);
+                    Write(message, region.x);
+                    Write(message, region.y);
+                    Write(message, region.w);
+                    Write(message, region.h);
+                    node->socket.send(message.str());
                 }
-
-                // start = start + dir * dist
-                rtcRay4.orgx[i] += rtcRay4.dirx[i] * rtcRay4.tfar[i];
-                rtcRay4.orgy[i] += rtcRay4.diry[i] * rtcRay4.tfar[i];
-                rtcRay4.orgz[i] += rtcRay4.dirz[i] * rtcRay4.tfar[i];
-                if (baseLightings[i].intensity() < 0.001f)
-                    lightDists[i] = 0.0f;
-                else
-                    lightDists[i] -= rtcRay4.tfar[i];
-                rtcRay4.tfar[i] = lightDists[i];
+                if (find(busy.begin(), busy.end(), true) == busy.end())
+                    break; // all the regions are taken
             }
-            inside = !inside;
+            else if (!this->tileScheduler.hasTiles())
+                break;
+
+            string data;
+            if (!node->socket.wait(100))
+                continue;
+            if (!node->socket.receive(data))
+                break;
+
+            istringstream message(data);
+            int type = -1;
+            uint frame = 0;
+            Read(message, type);
+            Read(message, frame);
+            if (frame != this->nodesFrame)
+                continue; // of an abandoned frame
+            if (type == ENodeReady)
+                ready = true;
+            else if (type == ENodeRegionDone && !this->readRenderNodeRegion(node, message, busy))
+                node->socket.close();
         }
 
-        // calculate lighting
-        for (int i = 0; i < RAYS; i++)
+        // a lost node's regions go back to the scheduler and this thread renders them
+        if (!node->socket.isOpen())
         {
-            // calculate diffuse
-            float cosTheta = dot(shadowDirs[i], interInfo.normal);
-            if (cosTheta > 0.0f)
-                lighting["DirectLight"] += baseLightings[i] * cosTheta;
-
-            // calculate specular
-            Vector3 r = reflect(-shadowDirs[i], interInfo.normal);
-            float cosGamma = dot(r, -Vector3(rtcRay.dir[0], rtcRay.dir[1], rtcRay.dir[2]));
-            if (cosGamma > 0.0f)
+            Engine::Log(LogType::EWarning, "CPURayRenderer", "Render node disconnected");
+            for (uint i = 0; i < node->workers; i++)
             {
-                Material* mat = (Material*)this->contentElements[this->rtcInstances[rtcRay.instID]->MaterialID].get();
-                if (mat)
-                    lighting["Specular"] += baseLightings[i] * mat->SpecularColor * pow(cosGamma, 0.3f * mat->Shininess);
+                if (busy[i])
+                    this->tileScheduler.requeue(node->firstSlot + i);
             }
+            for (uint i = 0; i < node->workers; i++)
+                while (this->render(node->firstSlot + i, false));
         }
-
-        float div = 1.0f / RAYS;
-        lighting["DirectLight"] *= div;
-        lighting["DirectLight"].a = 1.0f;
-        lighting["Specular"] *= div;
-        lighting["Specular"].a = 1.0f;
-
-        return lighting;
     }
 
-    Vector3 CPURayRenderer::getLightSample(const Light* light, int numSamples, int sample)
+    bool CPURayRenderer::readRenderNodeRegion(RenderNode* node, istream& message, vector<bool>& busy)
     {
-        Random& rand = Random::getRandomGen();
-        Vector3 result;
+        uint slot = 0;
+        int x = 0, y = 0, w = 0, h = 0;
+        float time = 0.0f;
+        Read(message, slot);
+        Read(message, x);
+        Read(message, y);
+        Read(message, w);
+        Read(message, h);
+        Read(message, time);
+        if (!message || slot >= node->workers || !busy[slot] || w <= 0 || h <= 0 ||
+            x < 0 || y < 0 || x + w > (int)this->Width || y + h > (int)this->Height)
+            return false;
 
-        Mesh* mesh = (Mesh*)this->contentElements[light->ContentID].get();
-        if (mesh && mesh->Name != "Cube")
-        {
-            int trglSample = (int)(rand.randSample(numSamples, sample) * (mesh->Triangles.size() - 1));
-            Triangle& trgl = mesh->Triangles[trglSample];
-            result = barycentric(mesh->Vertices[trgl.vertices[0]], mesh->Vertices[trgl.vertices[1]], mesh->Vertices[trgl.vertices[2]], rand.randSample(numSamples), rand.randSample(numSamples));
-        }
-        else
+        // the colors are averaged by the node, the stats let the refine pass continue its samples
+        int id = node->firstSlot + slot;
+        RegionBuffer& regionBuffer = this->regionBuffers[id];
+        regionBuffer.width = w;
+        regionBuffer.height = h;
+        for (int k = 0; k < AOVS_COUNT; k++)
         {
-            int sqrtNumSamples = max((int)sqrt(numSamples), 1);
-            result = Vector3((rand.randSample(sqrtNumSamples, sample % sqrtNumSamples) - 0.5f),
-                (rand.randSample(numSamples) - 0.5f),
-                (rand.randSample(sqrtNumSamples, sample / sqrtNumSamples) - 0.5f));
-            result *= 20.0f;
+            regionBuffer.colors[k].resize(w * h);
+            message.read((char*)&regionBuffer.colors[k][0], w * h * sizeof(Color4));
         }
+        regionBuffer.stats.resize(w * h);
+        message.read((char*)&regionBuffer.stats[0], w * h * sizeof(RunningStats));
+        if (!message)
+            return false;
 
-        result *= light->Scale;
-        result = light->Rotation * result;
-        result += light->Position;
-        return result;
+        this->flushRegionBuffer(regionBuffer, Region(x, y, w, h));
+        this->finishRegion(id, time);
+        busy[slot] = false;
+        return true;
     }
 
-    Color4 CPURayRenderer::getFogLighting(const embree::RTCRay& rtcRay)
+    bool CPURayRenderer::RunRenderNode(const string& host, int port)
     {
-        Profile;
-        const float deltaFactor = 1.01f;
-        Color4 result;
+        if (!this->nodeSocket.connect(host, port))
+        {
+            Engine::Log(LogType::EError, "CPURayRenderer", "Cannot connect to the render coordinator " + host + ":" + to_string(port));
+            return false;
+        }
 
-        embree::RTCRay newRay = rtcRay;
-        InterInfo interInfo;
-        if (rtcRay.instID != RTC_INVALID_GEOMETRY_ID)
-            interInfo.sceneElement = this->rtcInstances[rtcRay.instID];
-        interInfo.normal = Vector3(rtcRay.dir[0], rtcRay.dir[1], rtcRay.dir[2]);
+        ostringstream hello;
+        Write(hello, (int)ENodeHello);
+        Write(hello, (uint)this->thread->workersCount());
+        this->nodeSocket.send(hello.str());
 
-        Color4 prevLighting;
-        float delta = min(100.0f, rtcRay.tfar > 1000 ? rtcRay.tfar / 10 : rtcRay.tfar / 100);
-        for (float dist = 0.0f; dist < rtcRay.tfar; dist += delta)
+        string data;
+        while (this->nodeSocket.receive(data))
         {
-            newRay.tfar = dist;
-            interInfo.interPos = Vector3(newRay.org[0], newRay.org[1], newRay.org[2]) + Vector3(newRay.dir[0], newRay.dir[1], newRay.dir[2]) * newRay.tfar;
-            Color4 lighting = this->getLighting(newRay, interInfo)["DirectLight"];
-
-            float ration = lighting.intensity() / (prevLighting.intensity() == 0.0f ? 1.0f : prevLighting.intensity());
-            if (dist > 0 && ration > 2.0f && delta > rtcRay.tfar / 1000)
+            istringstream message(data);
+            int type = -1;
+            uint frame = 0;
+            Read(message, type);
+            Read(message, frame);
+            if (type == ENodeFrame)
             {
-                dist -= delta;
-                delta = max(rtcRay.tfar / 1000, delta / deltaFactor);
+                // the tasks of the previous frame end before its scene is replaced
+                if (this->IsStarted)
+                    this->Stop();
+                this->thread->addWaitTask();
+                this->thread->addTask([](int) { return true; }).wait();
+
+                string scenePath;
+                uint width = 0, height = 0;
+                Read(message, scenePath);
+                Read(message, width);
+                Read(message, height);
+                this->readRenderNodeSettings(message);
+                this->nodesFrame = frame;
+                this->nodeGICache.clear();
+                if (this->GI && message)
+                    this->nodeGICache.assign(data, (size_t)message.tellg(), string::npos);
+                if (!message || !this->Owner->SceneManager->Load(scenePath))
+                {
+                    Engine::Log(LogType::EError, "CPURayRenderer", "Cannot prepare the render node's frame " + to_string(frame));
+                    continue;
+                }
+                this->Init(width, height);
+                this->Start();
             }
-            else
+            else if (type == ENodeRegion && frame == this->nodesFrame && this->IsStarted)
             {
-                result += lighting * (delta / rtcRay.tfar);
-                prevLighting = lighting;
+                uint slot = 0;
+                int x = 0, y = 0, w = 0, h = 0;
+                Read(message, slot);
+                Read(message, x);
+                Read(message, y);
+                Read(message, w);
+                Read(message, h);
+                Region region(x, y, w, h);
+                this->thread->addTask([=](int id) { return this->renderNodeRegion(id, frame, slot, region); });
             }
-
-            if (dist > 0 && ration < 0.5f)
-                delta = min(rtcRay.tfar / 10, delta * deltaFactor);
         }
 
-        result.a = 1.0f;
-        return result;
+        if (this->IsStarted)
+            this->Stop();
+        return true;
     }
 
-    Color4 CPURayRenderer::getGILighting(const embree::RTCRay& rtcRay, const InterInfo& interInfo, const Color4& pathMultiplier)
+    bool CPURayRenderer::renderNodeRegion(int id, uint frame, uint slot, const Region& region)
     {
-        Profile;
-        Color4 result = Color4::Black();
-
-        if ((uint)rtcRay.align0 >= this->MaxDepth || pathMultiplier.intensity() < 0.02f)
-        {
-            result = interInfo.color * this->Owner->SceneManager->AmbientLight;
-            result.a = 1.0f;
-            return result;
-        }
+        Profiler prof;
+        prof.start();
+        if (frame != this->nodesFrame || !this->renderRegion(id, region, false))
+            return false;
+        float time = (float)chrono::duration_cast<chrono::microseconds>(prof.stop()).count() / 1000.0f;
+
+        const RegionBuffer& regionBuffer = this->regionBuffers[id];
+        ostringstream message;
+        Write(message, (int)ENodeRegionDone);
+        Write(message, frame);
+        Write(message, slot);
+        Write(message, region.x);
+        Write(message, region.y);
+        Write(message, region.w);
+        Write(message, region.h);
+        Write(message, time);
+        for (int k = 0; k < AOVS_COUNT; k++)
+            message.write((const char*)&regionBuffer.colors[k][0], region.w * region.h * sizeof(Color4));
+        for (int j = region.y; j < region.y + region.h; j++)
+            message.write((const char*)&this->pixelStats[j * this->Width + region.x], region.w * sizeof(RunningStats));
+
+        lock lck(this->thread->mutex("node"));
+        return this->nodeSocket.send(message.str());
+    }
 
-        if (!this->IsStarted)
-            return result;
+    void CPURayRenderer::writeRenderNodeSettings(ostream& message) const
+    {
+        Write(message, this->RegionSize);
+        Write(message, this->VolumetricFog);
+        Write(message, this->MinSamples);
+        Write(message, this->MaxSamples);
+        Write(message, this->SampleThreshold);
+        Write(message, this->Sampling);
+        Write(message, this->MaxLights);
+        Write(message, this->MaxDepth);
+        Write(message, this->RouletteDepth);
+        Write(message, this->GI);
+        Write(message, this->GISamples);
+        Write(message, this->IrradianceMap);
+        Write(message, this->IrradianceMapSamples);
+        Write(message, this->IrradianceMapDistanceThreshold);
+        Write(message, this->IrradianceMapNormalThreshold);
+        Write(message, this->IrradianceMapColorThreshold);
+        Write(message, this->LightCache);
+        Write(message, this->LightCacheSampleSize);
+        Write(message, this->GICache);
+        Write(message, this->Animation);
+        Write(message, this->AnimationResetCaches);
+    }
 
-        if (!interInfo.sceneElement)
-            return result;
+    void CPURayRenderer::readRenderNodeSettings(istream& message)
+    {
+        Read(message, this->RegionSize);
+        Read(message, this->VolumetricFog);
+        Read(message, this->MinSamples);
+        Read(message, this->MaxSamples);
+        Read(message, this->SampleThreshold);
+        Read(message, this->Sampling);
+        Read(message, this->MaxLights);
+        Read(message, this->MaxDepth);
+        Read(message, this->RouletteDepth);
+        Read(message, this->GI);
+        Read(message, this->GISamples);
+        Read(message, this->IrradianceMap);
+        Read(message, this->IrradianceMapSamples);
+        Read(message, this->IrradianceMapDistanceThreshold);
+        Read(message, this->IrradianceMapNormalThreshold);
+        Read(message, this->IrradianceMapColorThreshold);
+        Read(message, this->LightCache);
+        Read(message, this->LightCacheSampleSize);
+        Read(message, this->GICache);
+        Read(message, this->Animation);
+        Read(message, this->AnimationResetCaches);
+
+        // a node renders only the regions it's sent, the coordinator does the rest
+        this->Preview = false;
+        this->Progressive = false;
+        this->RenderNodes = 0;
+        this->CheckpointTime = 0.0f;
+        this->Bloom = 0.0f;
+        this->Denoise = false;
+    }
 
-        // get from light cache
-        if (this->LightCache && this->lightCacheSamples.size() > 0)
-        {
-            vector<int> indices;
-            this->thread->rw_mutex("lightCache").read_lock();
-            this->lightCacheKdTree.find_range(interInfo.interPos, [&](int idx) { return this->lightCacheSamples[idx].position; }, this->LightCacheSampleSize, indices);
-            this->thread->rw_mutex("lightCache").read_unlock();
-            if (indices.size() > 0) // get value
+    void CPURayRenderer::initPostProcessing()
+    {
+        this->postProcessing.clear();
+
+        // denoise, the first iteration reads the Final buffer and they alternate so the last one writes the Denoised buffer
+        this->denoised = false;
+        Buffer<Color4>* denoisedBuffer = this->Denoise ? &this->Buffers["Denoised"] : NULL;
+        if (this->Denoise)
+        {
+            this->denoiseBuffer.init(this->Width, this->Height);
+            PostProcessing::DenoiseGuides guides;
+            guides.normals = this->aovBuffers[ENormals];
+            guides.depth = this->aovBuffers[EDepth];
+            guides.albedo = this->aovBuffers[EDiffuse];
+            guides.noise = this->aovBuffers[ENoise];
+            for (int i = 0; i < DENOISE_ITERATIONS; i++)
             {
-                result = Color4();
-                this->thread->rw_mutex("lightCache").read_lock();
-                for (int idx : indices)
-                    result += this->lightCacheSamples[idx].color;
-                this->thread->rw_mutex("lightCache").read_unlock();
-                result *= (1.0f / indices.size());
-                return result;
+                Buffer<Color4>* src = i == 0 ? this->aovBuffers[EFinal] : (DENOISE_ITERATIONS - i) % 2 == 0 ? denoisedBuffer : &this->denoiseBuffer;
+                Buffer<Color4>* dst = (DENOISE_ITERATIONS - i) % 2 == 1 ? denoisedBuffer : &this->denoiseBuffer;
+                bool last = i == DENOISE_ITERATIONS - 1;
+                this->postProcessing.addPass("Denoise" + to_string(i), [=](const Region& tile)
+                {
+                    PostProcessing::denoise(*src, *dst, guides, tile, i);
+                    if (last)
+                        this->denoised = true;
+                });
             }
         }
 
-
-        embree::RTCRay rtcNextRay;
-        Color4 color;
-        float pdf = 1.0f;
-
-        Random& rand = Random::getRandomGen();
-        float sample = rand.randFloat();
-
-        // diffuse
-        if ((interInfo.sceneElement->Type == SceneElementType::EStaticObject ||
-             interInfo.sceneElement->Type == SceneElementType::EDynamicObject) &&
-            sample <= interInfo.diffuse)
+        // depth normalized by its maximum
+        Buffer<Color4>* depth = this->aovBuffers[EDepth];
+        auto maxDepth = make_shared<atomic<float>>(0.0f);
+        this->postProcessing.addPass("DepthMax", [depth, maxDepth](const Region& tile)
         {
-            result = this->getLighting(rtcRay, interInfo)["DirectLight"] * pathMultiplier;
-            result.a = 1.0f;
-
-            // GI
-            const Vector3& dir = hemisphereSample(interInfo.normal);
-            rtcNextRay = RTCRay(interInfo.interPos + interInfo.normal * 0.01f, dir, (uint)rtcRay.align0 + 1);
-            color = interInfo.color * (1.0f / PI) * max(0.0f, dot(interInfo.normal, dir));
-            pdf = (1.0f / (2.0f * PI)) * interInfo.diffuse;
-        }
-        else if (sample <= interInfo.diffuse) // non static objects
+            float tileMax = PostProcessing::getMax(*depth, tile);
+            float old = maxDepth->load();
+            while (tileMax > old && !maxDepth->compare_exchange_weak(old, tileMax));
+        }, PostProcessing::EFinalPass);
+        this->postProcessing.addPass("DepthNormalize", [depth, maxDepth](const Region& tile)
         {
-            result = interInfo.color;
-            result.a = 1.0f;
-            return result;
-        }
-        else
-            result = Color4();
+            if (*maxDepth > 0.0f)
+                PostProcessing::scale(*depth, tile, 1.0f / *maxDepth);
+        }, PostProcessing::EFinalPass);
 
-        // refraction
-        if (interInfo.diffuse < sample && sample <= interInfo.diffuse + interInfo.refraction)
+        // bloom, the light above the threshold blurred in two separable passes
+        if (this->Bloom > 0.0f)
         {
-            Material* material = (Material*)this->contentElements[interInfo.sceneElement->MaterialID].get();
-            float glossiness = material ? material->Glossiness : 1.0f;
-
-            Vector3 n = interInfo.normal;
-            if (glossiness > 0.0f && glossiness < 0.999f) // glossy
-                n = glossy(n, glossiness);
-
-            float ior = 1.0f / (material ? material->IOR : 1.5f);
-            if (getFlag(rtcRay.align1, RayFlags::RAY_INSIDE))
-                ior = 1.0f / ior;
-            Vector3 dir = refract(Vector3(rtcRay.dir[0], rtcRay.dir[1], rtcRay.dir[2]), n, ior);
-
-            if (dir.length() < 0.001f) // total inner reflection
-                return Color4::Black();
-
-            rtcNextRay = RTCRay(interInfo.interPos, dir, (uint)rtcRay.align0 + 1);
-            setFlag(rtcNextRay.align1, RayFlags::RAY_INSIDE, !getFlag(rtcRay.align1, RayFlags::RAY_INSIDE));
-            color = Color4::White();
-            pdf = interInfo.refraction;
+            for (auto& bloomBuffer : this->bloomBuffers)
+                bloomBuffer.init(this->Width, this->Height);
+            this->postProcessing.addPass("BloomBrightPass", [&](const Region& tile)
+            {
+                PostProcessing::brightPass(*this->aovBuffers[EFinal], this->bloomBuffers[0], tile, BLOOM_THRESHOLD);
+            });
+            this->postProcessing.addPass("BloomBlurX", [&](const Region& tile)
+            {
+                PostProcessing::blur(this->bloomBuffers[0], this->bloomBuffers[1], tile, BLOOM_RADIUS, true);
+            });
+            this->postProcessing.addPass("BloomBlurY", [&](const Region& tile)
+            {
+                PostProcessing::blur(this->bloomBuffers[1], this->bloomBuffers[0], tile, BLOOM_RADIUS, false);
+            });
         }
 
-        // reflection
-        if (interInfo.diffuse + interInfo.refraction < sample)
+        // a tile pass, so the display follows the render
+        this->postProcessing.addPass("Display", [this, denoisedBuffer](const Region& tile)
         {
-            Material* material = (Material*)this->contentElements[interInfo.sceneElement->MaterialID].get();
-            float glossiness = material ? material->Glossiness : 1.0f;
-
-            Vector3 n = interInfo.normal;
-            if (glossiness > 0.0f && glossiness < 0.999f) // glossy
-                n = glossy(n, glossiness);
-
-            Vector3 dir = reflect(Vector3(rtcRay.dir[0], rtcRay.dir[1], rtcRay.dir[2]), n);
-            rtcNextRay = RTCRay(interInfo.interPos, dir, (uint)rtcRay.align0 + 1);
-            color = Color4::White();
-            pdf = interInfo.reflection;
-        }
-
-
-        // trace
-        rtcNextRay.align1 = rtcRay.align1;
-        embree::rtcIntersect(this->rtcScene, rtcNextRay);
-        const InterInfo& interInfoNext = this->getInterInfo(rtcNextRay);
-        result += this->getGILighting(rtcNextRay, interInfoNext, pathMultiplier * color * (1.0f / pdf));
-        result.a /= 2.0f;
+            const Buffer<Color4>& src = this->denoised ? *denoisedBuffer : *this->aovBuffers[EFinal];
+            PostProcessing::toDisplay(src, this->Bloom > 0.0f ? &this->bloomBuffers[0] : NULL, this->Bloom, this->Display, tile,
+                this->Exposure, this->ToneMapping, this->SRGB);
+        }, PostProcessing::ETilePass);
+    }
 
+    void CPURayRenderer::UpdateDisplay()
+    {
+        if (this->Display.data != NULL)
+            this->postProcessing.processTile(Region(0, 0, this->Width, this->Height));
+    }
 
-        // fog
-        float fogDensity = this->Owner->SceneManager->FogDensity;
-        if (fogDensity > 0.0f)
-        {
-            float fogFactor = pow(2.0f, -fogDensity * fogDensity * rtcRay.tfar * rtcRay.tfar * LOG2);
-            fogFactor = min(max(fogFactor, 0.0f), 1.0f);
-            result = this->Owner->SceneManager->FogColor * (1.0f - fogFactor) + result * fogFactor;
-        }
 
-        // inside of the object (in computeColor, getLighting.shadow, getGILighting too)
-        if (getFlag(rtcRay.align1, RayFlags::RAY_INSIDE))
-        {
-            Material* material = (Material*)this->contentElements[interInfo.sceneElement->MaterialID].get();
-            if (material && material->InnerColor.intensity() > 0.01f)
-            {
-                float absFactor = exp(-rtcRay.tfar * material->Absorption);
-                absFactor = min(max(absFactor, 0.0f), 1.0f);
-                result = material->InnerColor * (1.0f - absFactor) + result * absFactor;
-            }
-        }
+    bool CPURayRenderer::filterShadowHit(int instID, int primID, float u, float v, float dist, Color4& transmittance)
+    {
+        const InstanceInfo* instance = this->getInstanceInfo(instID);
+        if (!instance)
+            return true;
 
+        if (instance->light) // in case the ray masks are disabled in embree
+            return false;
 
-        result = interInfo.color * result;
-        const int tries = 3;
-        for (int i = 0; i < tries - 1; i++)
-        {
-            if (result.intensity() < 20.0f)
-                break;
-            embree::RTCRay rtcNextRay = rtcRay;
-            rtcNextRay.align0++;
-            result = this->getGILighting(rtcNextRay, interInfo, pathMultiplier);
+        embree::RTCRay rtcRay = RTCRay(Vector3(), Vector3(), 0, 0.0f, dist);
+        rtcRay.instID = instID;
+        rtcRay.primID = primID;
+        rtcRay.u = u;
+        rtcRay.v = v;
+        const InterInfo& interInfo = this->getInterInfo(rtcRay, true, true);
+        transmittance *= interInfo.color * (1.0f - interInfo.color.a);
+
+        // absorption of the inside of the object
+        const Material* material = interInfo.material;
+        if (material && material->InnerColor.intensity() > 0.01f && transmittance.intensity() > 0.001f)
+        {
+            float absFactor = exp(-dist * material->Absorption);
+            absFactor = min(max(absFactor, 0.0f), 1.0f);
+            transmittance *= material->InnerColor * (1.0f - absFactor) + Color4::White() * absFactor;
         }
 
-        // TODO: may be save LightCache and IrradianceMap to file?
-        // set to light cache
-        if (this->LightCache && interInfo.sceneElement->Type != SceneElementType::EDynamicObject)
-        {
-            // trace more rays
-            uint samples = adaptiveSampling(this->MinSamples, this->GISamples, this->SampleThreshold, [&](int)->Color4
-            {
-                embree::RTCRay rtcNextRay = rtcRay;
-                rtcNextRay.align0++;
-                const auto& temp = this->getGILighting(rtcNextRay, interInfo, pathMultiplier);
-                result += temp;
-                return temp;
-            });
-            result *= 1.0f / (samples + 1);
+        return transmittance.intensity() < 0.001f;
+    }
 
-            LightCacheSample sample;
-            sample.position = interInfo.interPos;
-            sample.color = result;
-            this->thread->rw_mutex("lightCache").write_lock();
-            this->lightCacheSamples.push_back(sample);
-            this->lightCacheKdTree.insert((int)this->lightCacheSamples.size() - 1, [&](int idx) { return this->lightCacheSamples[idx].position; });
-            this->thread->rw_mutex("lightCache").write_unlock();
-        }
+    void CPURayRenderer::occlusionFilter(void* ptr, embree::RTCRay& ray)
+    {
+        if (!shadowContext)
+            return;
 
-        return result;
+        CPURayRenderer* renderer = (CPURayRenderer*)ptr;
+        if (!renderer->filterShadowHit(ray.instID, ray.primID, ray.u, ray.v, ray.tfar, shadowContext->transmittance[0]))
+            ray.geomID = RTC_INVALID_GEOMETRY_ID; // reject the hit, continue to the light
     }
 
-    bool CPURayRenderer::postProcessing()
+    template <typename RTCRayN, int N>
+    void CPURayRenderer::occlusionFilterN(const void* valid, void* ptr, RTCRayN& ray)
     {
-        if (!this->IsStarted)
-            return false;
+        if (!shadowContext)
+            return;
 
-        // normalize depth buffer
-        float maxDepth = 0;
-        for (uint j = 0; j < this->Height; j++)
-        {
-            for (uint i = 0; i < this->Width; i++)
-            {
-                maxDepth = max(maxDepth, this->Buffers["Depth"].getElement(i, j).r);
-            }
-        }
-        for (uint j = 0; j < this->Height; j++)
+        CPURayRenderer* renderer = (CPURayRenderer*)ptr;
+        const int* validN = (const int*)valid;
+        for (int i = 0; i < N; i++)
         {
-            for (uint i = 0; i < this->Width; i++)
-            {
-                Color4 c = this->Buffers["Depth"].getElement(i, j);
-                c *= (1.0f / maxDepth);
-                c.a = 1.0f;
-                this->Buffers["Depth"].setElement(i, j, c);
-            }
-        }
+            if (validN[i] == 0)
+                continue;
 
-        return true;
+            if (!renderer->filterShadowHit(ray.instID[i], ray.primID[i], ray.u[i], ray.v[i], ray.tfar[i], shadowContext->transmittance[i]))
+                ray.geomID[i] = RTC_INVALID_GEOMETRY_ID; // reject the hit, continue to the light
+        }
     }
 
-
     void CPURayRenderer::onRTCError(const embree::RTCError, const char* str)
     {
         Engine::Log(LogType::EError, "CPURayRenderer", "Embree: " + string(str));
@@ -1910,7 +3811,7 @@ namespace MyEngine {
         }
         result.align0 = (float)depth; // depth
         result.align1 = 0; // flags
-        result.align2 = 0;
+        result.align2 = 0; // ray cone width at the start
         result.tnear = near;
         result.tfar = far;
         result.geomID = RTC_INVALID_GEOMETRY_ID;
@@ -1921,7 +3822,28 @@ namespace MyEngine {
         return result;
     }
 
-    void CPURayRenderer::setRTCRay4(embree::RTCRay4& ray_o, int i, const embree::RTCRay& ray_i)
+    void CPURayRenderer::rtcOccludedN(const int* valid, embree::RTCScene scene, embree::RTCRay4& ray)
+    {
+        embree::rtcOccluded4(valid, scene, ray);
+    }
+
+    void CPURayRenderer::rtcOccludedN(const int* valid, embree::RTCScene scene, embree::RTCRay8& ray)
+    {
+        embree::rtcOccluded8(valid, scene, ray);
+    }
+
+    void CPURayRenderer::rtcIntersectN(const int* valid, embree::RTCScene scene, embree::RTCRay4& ray)
+    {
+        embree::rtcIntersect4(valid, scene, ray);
+    }
+
+    void CPURayRenderer::rtcIntersectN(const int* valid, embree::RTCScene scene, embree::RTCRay8& ray)
+    {
+        embree::rtcIntersect8(valid, scene, ray);
+    }
+
+    template <typename RTCRayN>
+    void CPURayRenderer::setRTCRay(RTCRayN& ray_o, int i, const embree::RTCRay& ray_i)
     {
         ray_o.orgx[i] = ray_i.org[0];
         ray_o.orgy[i] = ray_i.org[1];
@@ -1944,7 +3866,8 @@ namespace MyEngine {
         ray_o.instID[i] = ray_i.instID;
     }
 
-    embree::RTCRay CPURayRenderer::getRTCRay(const embree::RTCRay4& ray_i, int i)
+    template <typename RTCRayN>
+    embree::RTCRay CPURayRenderer::getRTCRay(const RTCRayN& ray_i, int i)
     {
         embree::RTCRay ray_o;
         ray_o.org[0] = ray_i.orgx[i];
@@ -1972,25 +3895,34 @@ namespace MyEngine {
         return ray_o;
     }
 
+    // the packet helpers are used by the other ray renderers too
+    template void CPURayRenderer::setRTCRay(embree::RTCRay4& ray_o, int i, const embree::RTCRay& ray_i);
+    template void CPURayRenderer::setRTCRay(embree::RTCRay8& ray_o, int i, const embree::RTCRay& ray_i);
+    template embree::RTCRay CPURayRenderer::getRTCRay(const embree::RTCRay4& ray_i, int i);
+    template embree::RTCRay CPURayRenderer::getRTCRay(const embree::RTCRay8& ray_i, int i);
+
     template <typename Func>
     uint CPURayRenderer::adaptiveSampling(uint minSamples, uint maxSamples, float sampleThreshold, const Func& func)
     {
-        Color4 color;
+        RunningStats stats;
         uint sample = 0;
         for (sample = 1; sample <= maxSamples; sample++)
         {
-            Color4 c = func(sample);
-            color += c;
+            stats.add(func(sample).intensity());
 
-            if (sample > minSamples)
-            {
-                Color4 c1 = (color - c) * (1.0f / (sample - 1));
-                Color4 c2 = color * (1.0f / sample);
-                if (absolute(c1 - c2) < sampleThreshold)
-                    break;
-            }
+            if (sampleConverged(stats, minSamples, sampleThreshold))
+                break;
         }
         return min(sample, maxSamples);
     }
 
+    bool CPURayRenderer::sampleConverged(const RunningStats& stats, uint minSamples, float sampleThreshold)
+    {
+        // the standard error of the mean is estimated from the samples' variance, so it needs at least 2 of them
+        if (stats.count < max(minSamples, 2u))
+            return false;
+
+        return stats.relativeError(ERROR_MIN_MEAN) <= sampleThreshold;
+    }
+
 }
\ No newline at end of file
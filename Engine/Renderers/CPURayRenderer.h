@@ -6,13 +6,24 @@
 #include "Renderer.h"
 #include "..\Utils\Header.h"
 #include "..\Utils\RayUtils.h"
+#include "..\Utils\PostProcessing.h"
+#include "..\Utils\Socket.h"
+#include "..\Utils\Process.h"
+#include "..\Utils\ImageWriter.h"
+#include "..\Utils\ThreadLocal.h"
 #include "..\Utils\Types\Vector3.h"
+#include "..\Utils\Types\AOVColors.h"
 #include "..\Utils\Types\KdTree.h"
+#include "..\Utils\Types\HashGrid.h"
+#include "..\Utils\Types\LightTree.h"
+#include "..\Utils\Types\RunningStats.h"
+#include "..\Utils\Types\TileScheduler.h"
 
 namespace embree {
     enum RTCError;
     struct RTCRay;
     struct RTCRay4;
+    struct RTCRay8;
     struct __RTCDevice;
     struct __RTCScene;
 }
@@ -23,6 +34,10 @@ namespace MyEngine {
     class SceneElement;
     using SceneElementPtr = shared_ptr < SceneElement >;
     class Light;
+    class Mesh;
+    struct Triangle;
+    class Material;
+    class Texture;
     class ContentElement;
     using ContentElementPtr = shared_ptr < ContentElement >;
 
@@ -35,10 +50,12 @@ namespace MyEngine {
         bool VolumetricFog;
         // Samples Settings
         uint MinSamples, MaxSamples;
-        float SampleThreshold;
+        float SampleThreshold; // relative error of the samples' mean
+        SamplerType Sampling;
         // Limits
         uint MaxLights;
         uint MaxDepth;
+        uint RouletteDepth; // from this depth the GI paths end by Russian roulette on their throughput, 0 - never
         // Global Illumination
         bool GI;
         uint GISamples;
@@ -51,40 +68,263 @@ namespace MyEngine {
         // Global Illumination - LightCache
         bool LightCache;
         float LightCacheSampleSize;
+        // Global Illumination - cache file, the light cache and the irradiance map are saved and reused while the scene and settings don't change
+        bool GICache;
         // Animation
         bool Animation;
         bool AnimationResetCaches;
+        // Progressive, the whole image is rendered in iterations of MinSamples samples until a limit is reached
+        bool Progressive;
+        float ProgressiveTime; // in seconds, 0 - no limit
+        float ProgressiveNoise; // average relative error of the pixels, 0 - no limit
+        // Render nodes, worker processes on this machine rendering regions of the render phase, 0 - none
+        uint RenderNodes;
+        // Checkpoints, the render and refine phases are saved in the background so Resume can continue them after an interruption
+        float CheckpointTime; // in seconds between the checkpoints, 0 - none
+        // Post-processing, applied to the Display buffer only
+        float Exposure;
+        bool ToneMapping;
+        bool SRGB;
+        float Bloom; // factor of the blurred light above BLOOM_THRESHOLD, 0 - no bloom
+        bool Denoise; // the Denoised buffer is filtered from the Final one guided by the AOVs, then it's displayed
+        Buffer<uint> Display; // the Final buffer after the post-processing in 8-bit BGRA
 
     protected:
-        using ColorsMapType = map < string, Color4 >; // buffer name / color
+        struct RegionBuffer // worker's private accumulation buffer, flushed to the Buffers when the region is done
+        {
+            int width, height;
+            vector<Color4> colors[AOVS_COUNT];
+            vector<RunningStats> stats; // of the pixels, empty in the preview
+            uint giPaths, giRays; // traced for the region, added to the frame's in finishRegion
+        };
+
+        struct PixelSamples // adaptive sampling state of a pixel traced by the primary rays stage
+        {
+            int x, y;
+            uint samples;
+            uint firstSample; // samples of the previous passes / progressive iterations
+            uint maxSamples; // of this pass, the refine pass only adds up to MaxSamples in total
+            bool done;
+            RunningStats stats; // of the final intensity, including the previous passes
+            Color4 lastFinal; // final color of the last sample
+            AOVColors colors;
+        };
+
+        struct InstanceInfo // shading data of an rtcInstance resolved when the scene is created, so a hit doesn't look up any map
+        {
+            SceneElementPtr element;
+            Mesh* mesh;
+            Material* material;
+            Texture* diffuseMap; // scene element's map or else material's one
+            Texture* normalMap;
+            Vector3 scale;
+            Vector3 normalMatrix[3]; // columns of the rotation
+            bool light;
+
+            inline Vector3 rotateNormal(const Vector3& n) const
+            {
+                return this->normalMatrix[0] * n.x + this->normalMatrix[1] * n.y + this->normalMatrix[2] * n.z;
+            }
+        };
+
+        struct GeometryInfo // rtcScene of a mesh kept between the Starts
+        {
+            embree::__RTCScene* rtcGeometry;
+            ContentElementPtr mesh; // held, so a reloaded mesh never passes for the cached one
+            const Vector3* vertices; // mesh's arrays shared with the rtcMesh, valid while the mesh doesn't reallocate them
+            const Triangle* triangles;
+            size_t verticesCount;
+            size_t trianglesCount;
+            bool used; // by an instance of the current frame
+        };
+
+        struct InstanceState // rtcInstance of a scene element kept between the Starts
+        {
+            uint rtcInstance;
+            embree::__RTCScene* rtcGeometry;
+            vector<float> matrix;
+            bool used; // by the current frame
+        };
+
+        struct IrradianceMapSplit // of the edge (v1, v2) shared by the triangles (v0, v1, v2) and (v3, v2, v1)
+        {
+            int triangle1, triangle2;
+            int v0, v1, v2, v3;
+            IrradianceMapSample sample; // at the split point
+        };
+
+        enum RenderNodeMessage // first in a message, then the frame id except in ENodeHello
+        {
+            ENodeHello, // node: workers count
+            ENodeFrame, // coordinator: scene file, width, height, settings, GI caches
+            ENodeReady, // node: the frame is prepared
+            ENodeRegion, // coordinator: slot, region
+            ENodeRegionDone // node: slot, region, time, the AOVs' colors and the pixels' stats
+        };
+
+        struct RenderNode // connection of a worker process rendering regions for this renderer
+        {
+            Socket socket;
+            uint workers; // regions it renders at a time
+            int firstSlot; // its first worker's id in the tile scheduler
+            std::thread driver; // sends it the regions of the render phase
+        };
+
+        struct GICacheHeader // followed by the light cache's table, the irradiance map's samples and triangles
+        {
+            char magic[4];
+            uint version;
+            unsigned long long sceneKey; // static geometry and GI settings
+            unsigned long long irrMapKey; // scene key, camera and irradiance map settings
+            unsigned long long lightCacheSize; // bytes
+            uint lightCacheSamples;
+            uint irrMapSamples;
+            uint irrMapTriangles; // indices
+        };
+
+        struct CheckpointHeader // followed by the GI cache, the regions' times, the pixels' stats, the AOV buffers and the regions' completion
+        {
+            char magic[4];
+            uint version;
+            unsigned long long key; // scene, camera and settings
+            uint width, height;
+            uint regions;
+            uint aovs;
+            uint refinePass;
+        };
+
+        struct Checkpoint // render state copied for the background writer
+        {
+            CheckpointHeader header;
+            vector<float> regionTimes;
+            vector<RunningStats> pixelStats; // the samples' count is the sampler's state
+            vector<Color4> aovs[AOVS_COUNT];
+            vector<byte> regionsDone; // all the pixels are sampled, the resumed render phase skips it
+        };
+
+        struct PathVertex // of a GI path, its lighting is offset + multiplier * the next vertex's lighting
+        {
+            Vector3 position;
+            Color4 offset, multiplier;
+            bool cache; // its lighting goes to the light cache
+        };
+
+        struct LightSample
+        {
+            const Light* light;
+            float weight; // 1 / probability of the light to be sampled
+
+            LightSample(const Light* light, float weight) : light(light), weight(weight) {}
+        };
+
         static const uint RAYS = 4;
         static const int VALID[RAYS];
+        static const uint MAX_PACKET_SIZE = 8;
+        static const uint MAX_PATH_LENGTH = 16; // vertices of a GI path, it ends there as at MaxDepth
+        static const uint PACKETS_PER_STAGE = 16;
+        static const uint PRIMARY_DIMENSIONS = 4; // sampler dimensions of a primary ray: pixel position and lens
+        static const uint RENDER_PASS_SAMPLES_DIV = 4; // the render pass takes MaxSamples / it, the refine pass up to MaxSamples
+        static const float ERROR_MIN_MEAN; // darker means are compared to it in the relative error
+        static const float IRRADIANCE_MAP_MIN_DIST; // in pixels between the irradiance map samples
+        static const uint LIGHT_CACHE_CELLS = 1 << 20;
+        static const uint GI_CACHE_VERSION = 1;
+        static const uint CHECKPOINT_VERSION = 1;
+        static const uint FROXEL_TILE = 16; // froxel's width and height in pixels
+        static const uint FROXEL_SLICES = 64; // froxels' depth slices, denser near the camera
+        static const uint FOG_STEPS = 32; // of the fog lighting integral along a ray
+        static const float FOG_RANGE; // fog density * distance beyond which the fog is opaque
+        static const float BLOOM_THRESHOLD;
+        static const int BLOOM_RADIUS = 16; // in pixels
+        static const int DENOISE_ITERATIONS = 5; // the last one reaches 2 * 2^4 pixels
+
+        struct ShadowContext // transmittance of the shadow rays packet being traced, updated by the occlusion filter
+        {
+            Color4 transmittance[MAX_PACKET_SIZE];
+        };
+        static __declspec(thread) ShadowContext* shadowContext; // set by the thread tracing shadow rays
+        static ThreadLocal<vector<LightSample>> lightSamples; // getLights' result of the thread
+        struct GIPathCounts
+        {
+            uint paths, rays;
+        };
+        static __declspec(thread) GIPathCounts giPathCounts; // traced by the thread, taken by its next region
 
         Vector3 upLeft, dx, dy;
+        float pixelSpread; // ray cone spread angle
         Vector3 up, right, front;
         Vector3 pos;
         float focalPlaneDist, fNumber;
-        int nextRagion;
+        TileScheduler tileScheduler;
+        atomic_int progressPixels; // of the regions taken in the current pass
+        int nodesWorkers; // render nodes' workers in the tile scheduler of the current pass
+        uint packetSize; // primary rays packet size (4 or 8)
+        Buffer<Color4>* aovBuffers[AOVS_COUNT];
+        vector<RegionBuffer> regionBuffers; // worker id / region buffer
+        vector<RunningStats> pixelStats; // of the final intensity of the pixels' samples, the buffers hold their average
+        bool refinePass;
+        uint progressiveIteration; // 0 - not in the progressive phase
+        atomic_bool progressiveFinish;
 
         embree::__RTCDevice* rtcDevice;
         embree::__RTCScene* rtcScene;
         embree::__RTCScene* rtcSystemScene;
-        map<uint, embree::__RTCScene*> rtcGeometries; // mesh id / rtcScene(Geometry)
-        map<int, SceneElementPtr> rtcInstances; // rtcInstance id / scene element
+        map<uint, GeometryInfo> rtcGeometries; // mesh id / rtcScene(Geometry)
+        map<uint, GeometryInfo> rtcLightGeometries; // mesh id / rtcScene(Geometry) of the lights
+        map<uint, GeometryInfo> rtcDynamicGeometries; // scene element id / deformable rtcScene(Geometry) of the dynamic objects
+        vector<embree::__RTCScene*> rtcReleasedGeometries; // replaced geometries, deleted when no instance refers to them
+        map<uint, InstanceState> rtcSceneInstances; // scene element id / rtcInstance in rtcScene
+        map<uint, InstanceState> rtcSystemSceneInstances; // scene element id / rtcInstance in rtcSystemScene
+        vector<InstanceInfo> rtcInstances; // rtcInstance id / instance info
+        vector<InstanceInfo> rtcSystemInstances; // (-rtcInstance id - 2) / instance info of the system scene
 
         map<uint, ContentElementPtr> contentElements; // id / content element
-        vector<SceneElementPtr> lights;
+        vector<SceneElementPtr> lights; // visible lights
+        LightTree lightTree;
 
         vector<IrradianceMapSample> irrMapSamples;
         vector<int> irrMapTriangles;
+        vector<int> irrMapAdjacency; // half-edge (triangle * 3 + edge, the edge starts at the vertex) / opposite half-edge, -1 on the border
+        vector<int> irrMapPending; // triangles to check for splits in the next pass
+        vector<IrradianceMapSplit> irrMapSplits; // of the current pass
+        KdTree<Vector3> irrMapKdTree; // samples' screen positions
         embree::__RTCScene* rtcIrrMapScene;
-        vector<LightCacheSample> lightCacheSamples;
-        KdTree<Vector3> lightCacheKdTree;
+        HashGrid lightCache; // GI lighting averaged in cells of LightCacheSampleSize
+        vector<Color4> froxels; // fog lighting at the centers of the camera frustum's cells, (slice * froxelsY + y) * froxelsX + x
+        int froxelsX, froxelsY;
+        float froxelsFar; // depth of the last slice's end
+        PostProcessing postProcessing;
+        Buffer<Color4> bloomBuffers[2];
+        Buffer<Color4> denoiseBuffer; // the iterations alternate between it and the Denoised buffer
+        atomic_bool denoised; // the Denoised buffer has the filtered image
+        Socket nodesListener;
+        std::thread nodesAcceptor;
+        atomic_bool nodesListening;
+        vector<unique_ptr<Process>> nodesProcesses;
+        vector<unique_ptr<RenderNode>> renderNodes; // connected, "nodes" mutex
+        uint nodesFrame; // id of the frame sent to the render nodes
+        string nodeGICache; // GI caches of a render node's frame, written by its coordinator
+        bool lightCacheShared; // sent to the render nodes, so no region adds to it for the rest of the frame
+        Socket nodeSocket; // of a render node process to its coordinator
+        bool sequence; // rendering the frames of StartSequence
+        float sequenceFps, sequenceEndTime;
+        string sequencePath;
+        uint sequenceFrame; // number of the current frame's file
+        bool sequenceNext; // the next frame is prepared, set by the sequencePreparer
+        std::thread sequencePreparer; // updates the scene to the next frame while the current one is post-processed
+        ImageWriter imageWriter;
+        atomic_bool checkpoints; // the current pass takes checkpoints
+        atomic_bool checkpointing; // a checkpoint is copied or written
+        chrono::system_clock::time_point checkpointTime; // of the last one
+        unsigned long long checkpointKey;
+        std::thread checkpointWriter;
+        bool resuming; // the render phase continues the loaded checkpoint
+        vector<int> resumeRegions; // not done in the render phase of the checkpoint
+        atomic<unsigned long long> giPaths, giRays; // traced in the frame's regions, for the average path length
 
         shared_ptr<Profiler> phasePofiler;
 
 	public:
-        CPURayRenderer(Engine* owner);
+        CPURayRenderer(Engine* owner, RendererType type = RendererType::ECPURayRenderer);
         CPURayRenderer& operator=(const CPURayRenderer&) { return *this; }
         ~CPURayRenderer();
 
@@ -94,39 +334,142 @@ namespace MyEngine {
         virtual bool Init(uint width, uint height) override;
         virtual void Start() override;
         virtual void Stop() override;
+        void FinishProgressive(); // ends the progressive rendering after the current iteration
+        void UpdateDisplay(); // runs the display pass on the whole image, e.g. after the exposure is changed
+        bool RunRenderNode(const string& host, int port); // renders the regions sent by a coordinator until it disconnects
+        void Resume(); // Start that continues the checkpoint of the scene and camera if there is one
+        void StartSequence(float fps, float endTime, const string& filePath); // renders the animation from the current time until endTime (0 - until stopped) to the files filePath + number + ".png"
 
 
 	protected:
         void generateRegions();
-        bool sortRegions();
+        void scheduleRegions(bool split); // all the regions
+        void scheduleRegions(const vector<int>& regions, bool split);
+        void prepareFrame(); // the scene and the caches of the current time
+        void addFrameTasks();
+        void prepareSequenceFrame();
+        void joinSequencePreparer(); // a stopped sequence's preparer can still be updating the scene
+        bool nextSequenceFrame();
         void beginFrame();
         embree::RTCRay getRTCScreenRay(float x, float y) const;
 
         void createRTCScene();
+        void updateRTCScene(embree::__RTCScene* rtcScene, map<uint, InstanceState>& states, vector<InstanceInfo>& instances, const vector<SceneElementPtr>& sceneElements);
         embree::__RTCScene* createRTCGeometry(const SceneElementPtr sceneElement);
+        void setRTCBuffers(embree::__RTCScene* rtcGeometry, uint meshID, const Mesh* mesh);
         void cacheContentElements(const SceneElementPtr sceneElement);
+        void setInstanceInfo(vector<InstanceInfo>& instances, uint rtcInstance, const SceneElementPtr sceneElement);
+        ContentElement* getContentElement(uint id);
+        inline const InstanceInfo* getInstanceInfo(int instID) const
+        {
+            if (instID >= 0)
+                return instID < (int)this->rtcInstances.size() && this->rtcInstances[instID].element ? &this->rtcInstances[instID] : NULL;
+            instID = -instID - 2;
+            return instID >= 0 && instID < (int)this->rtcSystemInstances.size() && this->rtcSystemInstances[instID].element ? &this->rtcSystemInstances[instID] : NULL;
+        }
         InterInfo getInterInfo(const embree::RTCRay& rtcRay, bool onlyColor = false, bool noNormalMap = false);
+        float getRayConeWidth(const embree::RTCRay& rtcRay) const; // at the hit
+        float getTextureLod(const embree::RTCRay& rtcRay, const InstanceInfo& instance, const Triangle& triangle) const;
         void processRenderElements(embree::RTCRay& rtcRay, InterInfo& interInfo);
 
         bool generateIrradianceMap();
-        bool addIrradianceMapSample(float x, float y, KdTree<Vector3>& irrKdTree, float minDist);
-        void addIrradianceMapTriangle(int v1, int v2, int v3);
+        bool traceIrradianceMapRow();
+        bool triangulateIrradianceMap();
+        bool refineIrradianceMap(); // a pass of splits, queues the next one
+        bool traceIrradianceMapSplit();
+        bool finishIrradianceMap();
+        void createIrradianceMapScene();
+        void traceIrradianceMapSample(IrradianceMapSample& sample);
+        bool addIrradianceMapSample(const IrradianceMapSample& sample); // false if there is a sample too near
+        bool getIrradianceMapSplitEdge(int triangle, int& v0, int& v1, int& v2) const;
+        int addIrradianceMapTriangle(int v1, int v2, int v3);
+        void setIrradianceMapTriangle(int triangle, int v1, int v2, int v3);
+        int findIrradianceMapEdge(int triangle, int v1, int v2) const;
+        void linkIrradianceMapEdges(int edge1, int edge2);
+        void splitIrradianceMapTriangles(const IrradianceMapSplit& split, int sample);
+        void flipIrradianceMapTriangles(const IrradianceMapSplit& split);
         bool computeIrradianceMap();
 
-        bool render(bool preview);
-        Color4 renderPixel(int x, int y);
-        ColorsMapType computeColor(const embree::RTCRay& rtcRay, const InterInfo& interInfo, float contribution);
-        ColorsMapType getLighting(const embree::RTCRay& rtcRay, const InterInfo& interInfo); // diffuse light / sepcular light / samples
-        ColorsMapType getLighting(const embree::RTCRay& rtcRay, const Light* light, const InterInfo& interInfo); // diffuse light / sepcular light
+        bool getNextRegion(int id, Region& region);
+        void finishRegion(int id, float time);
+        bool nextProgressiveIteration();
+        bool scheduleRefinePass();
+        float getImageError();
+        void addRenderTasks();
+        void addFinishTasks();
+        void getSampleSettings(bool preview, uint& minSamples, uint& maxSamples, float& sampleThreshold);
+        void initPixel(PixelSamples& pixel, int x, int y, int delta, uint minSamples, uint maxSamples, float sampleThreshold);
+        bool renderRegions(int id, bool preview);
+        bool render(int id, bool preview); // a region, false if there is none left
+        virtual bool renderRegion(int id, const Region& region, bool preview); // false if the rendering is stopped
+        void renderPixels(int y, vector<PixelSamples>& pixels, uint minSamples, uint maxSamples, float sampleThreshold);
+        template <typename RTCRayN, int N>
+        void renderPixelsSample(int y, vector<PixelSamples>& pixels);
+        void storePixel(RegionBuffer& regionBuffer, const Region& region, int delta, PixelSamples& pixel, uint maxSamples);
+        void flushRegionBuffer(const RegionBuffer& regionBuffer, const Region& region);
+        AOVColors computeColor(const embree::RTCRay& rtcRay, const InterInfo& interInfo, float contribution);
+        bool getIrradianceMapLighting(const embree::RTCRay& rtcRay, Color4& indirectLight);
+        AOVColors getLighting(const embree::RTCRay& rtcRay, const InterInfo& interInfo); // diffuse light / sepcular light / samples
+        const vector<LightSample>& getLights(const embree::RTCRay& rtcRay, const InterInfo& interInfo); // the lights to sample, valid until the thread's next call
+        void buildLightTree();
+        void getLighting(const embree::RTCRay& rtcRay, const Light* light, const InterInfo& interInfo, Color4& directLight, Color4& specular);
+        bool getLightContribution(const Light* light, const InterInfo& interInfo, int numSamples, int sample, Color4& lighting, Vector3& dir, float& dist); // unoccluded lighting
         Vector3 getLightSample(const Light* light, int numSamples, int sample);
         Color4 getFogLighting(const embree::RTCRay& rtcRay);
+        void addFroxelTasks();
+        bool computeFroxelRow();
+        bool getFroxelLighting(const Vector3& position, Color4& lighting) const;
+        inline float getFroxelDepth(float slice) const
+        {
+            float z = slice / FROXEL_SLICES;
+            return this->froxelsFar * z * z;
+        }
         Color4 getGILighting(const embree::RTCRay& rtcRay, const InterInfo& interInfo, const Color4& pathMultiplier);
-        bool postProcessing();
+        Color4 traceGIPath(const embree::RTCRay& rtcRay, const InterInfo& interInfo, Color4 pathMultiplier, bool& shaded); // a single path, shaded - its first vertex isn't an end
+        void takeGIPathCounts(RegionBuffer& regionBuffer); // the thread's counts since its last region
+        float getSurvival(uint depth, const Color4& throughput) const; // Russian roulette probability of a GI path to trace the ray of the depth
+        bool getLightCacheLighting(const Vector3& pos, Color4& lighting);
+        void addLightCacheLighting(const Vector3& pos, const Color4& lighting);
+        void getGICacheKeys(unsigned long long& sceneKey, unsigned long long& irrMapKey) const;
+        static void hashTexture(unsigned long long& key, const Texture* texture);
+        string getGICachePath(unsigned long long sceneKey) const;
+        bool loadGICache();
+        bool saveGICache();
+        void writeGICache(ostream& file) const;
+        const byte* readGICache(const byte* data, size_t size, const string& filePath, bool checkKeys = true); // past the GI cache, NULL if it isn't valid for the scene
+        unsigned long long getCheckpointKey() const;
+        string getCheckpointPath(unsigned long long key) const;
+        void takeCheckpoint(); // copies the render state and writes it in the background
+        bool writeCheckpoint(const Checkpoint& checkpoint);
+        bool loadCheckpoint();
+        bool finishCheckpoints();
+        void initPostProcessing();
+        void startRenderNodes();
+        void acceptRenderNodes();
+        bool scheduleRenderPass(); // the regions of the render phase, with the render nodes
+        bool finishRenderPass();
+        void driveRenderNode(RenderNode* node);
+        bool readRenderNodeRegion(RenderNode* node, istream& message, vector<bool>& busy); // false if the message is invalid
+        bool renderNodeRegion(int id, uint frame, uint slot, const Region& region);
+        void writeRenderNodeSettings(ostream& message) const;
+        void readRenderNodeSettings(istream& message);
+
+        bool filterShadowHit(int instID, int primID, float u, float v, float dist, Color4& transmittance); // true if the hit blocks the light
+        static void occlusionFilter(void* ptr, embree::RTCRay& ray);
+        template <typename RTCRayN, int N>
+        static void occlusionFilterN(const void* valid, void* ptr, RTCRayN& ray);
 
         static void onRTCError(const embree::RTCError code, const char* str);
+        static void rtcOccludedN(const int* valid, embree::__RTCScene* scene, embree::RTCRay4& ray);
+        static void rtcOccludedN(const int* valid, embree::__RTCScene* scene, embree::RTCRay8& ray);
+        static void rtcIntersectN(const int* valid, embree::__RTCScene* scene, embree::RTCRay4& ray);
+        static void rtcIntersectN(const int* valid, embree::__RTCScene* scene, embree::RTCRay8& ray);
         static embree::RTCRay RTCRay(const Vector3& start, const Vector3& dir, uint depth, float near = 0.01f, float far = 10000.0f);
-        static void setRTCRay4(embree::RTCRay4& ray_o, int i, const embree::RTCRay& ray_i);
-        static embree::RTCRay getRTCRay(const embree::RTCRay4& ray_i, int i);
+        template <typename RTCRayN>
+        static void setRTCRay(RTCRayN& ray_o, int i, const embree::RTCRay& ray_i);
+        template <typename RTCRayN>
+        static embree::RTCRay getRTCRay(const RTCRayN& ray_i, int i);
+        static bool sampleConverged(const RunningStats& stats, uint minSamples, float sampleThreshold);
         template <typename Func>
         static uint adaptiveSampling(uint minSamples, uint maxSamples, float sampleThreshold, const Func& func);
 
@@ -18,6 +18,7 @@ namespace MyEngine {
 	{
 		EIrrRenderer,
 		ECPURayRenderer,
+		EWavefrontRenderer,
 		EGPURayRenderer
 	};
 
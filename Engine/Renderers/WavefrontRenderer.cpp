@@ -0,0 +1,708 @@
+// WavefrontRenderer.cpp
+
+#include "stdafx.h"
+#include "WavefrontRenderer.h"
+
+#pragma warning(push, 3)
+namespace embree {
+#include <Embree\rtcore.h>
+#include <Embree\rtcore_geometry.h>
+#include <Embree\rtcore_ray.h>
+#include <Embree\rtcore_scene.h>
+}
+#pragma warning(pop)
+
+#include "..\Engine.h"
+#include "..\Utils\Config.h"
+#include "..\Utils\Types\Random.h"
+#include "..\Utils\Types\Sampler.h"
+#include "..\Utils\Types\Thread.h"
+#include "..\Utils\Types\Profiler.h"
+#include "..\Managers\SceneManager.h"
+#include "..\Scene Elements\Light.h"
+#include "..\Content Elements\Material.h"
+
+
+namespace MyEngine {
+
+    struct WavefrontRenderer::PathState
+    {
+        embree::RTCRay ray; // align0 - depth, align1 - flags
+        PathType type;
+        int sample; // index in the samples queue
+        int aov; // the sample's AOV the path adds to
+        Color4 throughput;
+        Color4 pathMultiplier; // GI paths
+        float contribution; // primary and secondary paths
+        Sampler sampler; // the paths are shaded interleaved, so each keeps its own sampler state
+    };
+
+    struct WavefrontRenderer::ShadowRay
+    {
+        embree::RTCRay ray;
+        int sample;
+        int aov, specularAov;
+        Color4 lighting; // unoccluded light
+        Color4 diffuseFactor, specularFactor;
+    };
+
+    struct WavefrontRenderer::SampleState // a primary ray of a pixel
+    {
+        int pixel; // index in the pixels queue
+        bool hit;
+        AOVColors colors;
+        Color4 fogBase; // final = fogBase + fogScale * (lighted + refraction + reflection)
+        float fogScale;
+    };
+
+    struct WavefrontRenderer::Queues
+    {
+        vector<PixelSamples> pixels;
+        vector<SampleState> samples;
+        vector<PathState> paths, nextPaths;
+        vector<ShadowRay> shadowRays;
+        vector<pair<uint, int>> hits; // material id / path index
+        uint giPaths, giRays; // of the region
+    };
+
+
+    WavefrontRenderer::WavefrontRenderer(Engine* owner) :
+        CPURayRenderer(owner, RendererType::EWavefrontRenderer)
+    {
+        for (uint i = 0; i < this->thread->workersCount(); i++)
+            this->workerQueues.push_back(make_shared<Queues>());
+        this->thread->defMutex("queues");
+    }
+
+    WavefrontRenderer::~WavefrontRenderer()
+    {
+        this->IsStarted = false;
+        this->thread->joinWorkers();
+
+        Engine::Log(LogType::ELog, "WavefrontRenderer", "DeInit Wavefront Renderer");
+    }
+
+
+    bool WavefrontRenderer::renderRegion(int id, const Region& region, bool preview)
+    {
+        const int delta = preview ? this->RegionSize / 8 : 1;
+
+        RegionBuffer& regionBuffer = this->regionBuffers[id];
+        regionBuffer.width = region.w;
+        regionBuffer.height = region.h;
+        for (int k = 0; k < AOVS_COUNT; k++)
+            regionBuffer.colors[k].resize(region.w * region.h);
+        regionBuffer.stats.resize(preview ? 0 : region.w * region.h);
+
+        uint minSamples, maxSamples;
+        float sampleThreshold;
+        this->getSampleSettings(preview, minSamples, maxSamples, sampleThreshold);
+
+        // the whole region is one wavefront
+        Queues& queues = this->getQueues(id);
+        queues.pixels.clear();
+        queues.giPaths = 0;
+        queues.giRays = 0;
+        for (int j = 0; j < region.h; j += delta)
+        {
+            for (int i = 0; i < region.w; i += delta)
+            {
+                PixelSamples pixel;
+                this->initPixel(pixel, region.x + i, region.y + j, delta, minSamples, maxSamples, sampleThreshold);
+                queues.pixels.push_back(pixel);
+            }
+        }
+
+        // same adaptive sampling as the CPURayRenderer, a sample of all the unfinished pixels at a time
+        for (uint sample = 1; sample <= maxSamples; sample++)
+        {
+            if (!this->IsStarted)
+                return false;
+
+            this->renderSample(queues);
+
+            bool done = true;
+            for (auto& pixel : queues.pixels)
+            {
+                if (pixel.done)
+                    continue;
+
+                pixel.samples = sample;
+                pixel.stats.add(pixel.lastFinal.intensity());
+                if (sample >= pixel.maxSamples || sampleConverged(pixel.stats, minSamples, sampleThreshold))
+                    pixel.done = true;
+                else
+                    done = false;
+            }
+            if (done)
+                break;
+        }
+
+        for (auto& pixel : queues.pixels)
+            this->storePixel(regionBuffer, region, delta, pixel, maxSamples);
+        this->takeGIPathCounts(regionBuffer);
+        regionBuffer.giPaths += queues.giPaths;
+        regionBuffer.giRays += queues.giRays;
+        this->flushRegionBuffer(regionBuffer, region);
+
+        return true;
+    }
+
+    WavefrontRenderer::Queues& WavefrontRenderer::getQueues(int id)
+    {
+        // the slots of a lost render node are rendered locally, they have ids after the workers
+        lock lck(this->thread->mutex("queues"));
+        while ((int)this->workerQueues.size() <= id)
+            this->workerQueues.push_back(make_shared<Queues>());
+        return *this->workerQueues[id];
+    }
+
+    void WavefrontRenderer::renderSample(Queues& queues)
+    {
+        Profile;
+        Sampler& sampler = Sampler::getSampler();
+
+        // generate
+        queues.samples.clear();
+        queues.paths.clear();
+        for (int p = 0; p < (int)queues.pixels.size(); p++)
+        {
+            PixelSamples& pixel = queues.pixels[p];
+            pixel.lastFinal = Color4();
+            if (pixel.done)
+                continue;
+
+            for (int k = 0; k < RAYS; k++)
+            {
+                SampleState sample;
+                sample.pixel = p;
+                sample.hit = false;
+                sample.colors.clear();
+                sample.fogScale = 1.0f;
+                queues.samples.push_back(sample);
+
+                PathState path;
+                sampler.start(this->Sampling, pixel.x, pixel.y, (pixel.firstSample + pixel.samples) * RAYS + k);
+                float u, v;
+                sampler.next2D(u, v);
+                path.ray = this->getRTCScreenRay(pixel.x + u, pixel.y + v);
+                sampler.start(this->Sampling, pixel.x, pixel.y, (pixel.firstSample + pixel.samples) * RAYS + k, PRIMARY_DIMENSIONS);
+                path.sampler = sampler;
+                path.type = PathType::EPrimaryPath;
+                path.sample = (int)queues.samples.size() - 1;
+                path.aov = EFinal;
+                path.throughput = Color4::White();
+                path.pathMultiplier = Color4::White();
+                path.contribution = 1.0f;
+                queues.paths.push_back(path);
+            }
+        }
+
+        // a bounce of all the paths per iteration
+        while (!queues.paths.empty() && this->IsStarted)
+        {
+            this->intersectRays(queues.paths);
+
+            // sort the hits by material so the shading works on the same textures
+            queues.hits.clear();
+            for (int i = 0; i < (int)queues.paths.size(); i++)
+            {
+                const embree::RTCRay& ray = queues.paths[i].ray;
+                if (ray.instID == RTC_INVALID_GEOMETRY_ID)
+                    continue;
+
+                const InstanceInfo* instance = this->getInstanceInfo(ray.instID);
+                queues.hits.push_back(make_pair(instance ? instance->element->MaterialID : INVALID_ID, i));
+            }
+            sort(queues.hits.begin(), queues.hits.end());
+
+            // shade
+            queues.nextPaths.clear();
+            queues.shadowRays.clear();
+            for (const auto& hit : queues.hits)
+                this->shadePath(queues, queues.paths[hit.second]);
+
+            this->traceShadowRays(queues);
+            queues.paths.swap(queues.nextPaths);
+        }
+
+        // compose the samples as CPURayRenderer::computeColor does
+        const float div = 1.0f / RAYS;
+        for (auto& sample : queues.samples)
+        {
+            if (!sample.hit)
+                continue;
+
+            AOVColors& colors = sample.colors;
+            colors[EDirectLight].a = 1.0f;
+            colors[ESpecular].a = 1.0f;
+            colors[ETotalLight] = colors[EDirectLight] + colors[EIndirectLight];
+            colors[ETotalLight].a = 1.0f;
+            colors[ELighted] = colors[EDiffuse] * colors[ETotalLight] + colors[ESpecular];
+            colors[ELighted].a = 1.0f;
+            colors[ERefraction].a = 1.0f;
+            colors[EReflection].a = 1.0f;
+            colors[EFinal] = sample.fogBase + (colors[ELighted] + colors[ERefraction] + colors[EReflection]) * sample.fogScale;
+            colors[EFinal].a = 1.0f;
+
+            PixelSamples& pixel = queues.pixels[sample.pixel];
+            pixel.colors.add(colors, div);
+            pixel.lastFinal += colors[EFinal] * div;
+        }
+    }
+
+
+    template <typename T>
+    void WavefrontRenderer::intersectRays(vector<T>& items)
+    {
+        Profile;
+        if (this->packetSize == 8)
+            this->intersectPackets<embree::RTCRay8, 8>(items);
+        else
+            this->intersectPackets<embree::RTCRay4, 4>(items);
+    }
+
+    template <typename RTCRayN, int N, typename T>
+    void WavefrontRenderer::intersectPackets(vector<T>& items)
+    {
+        RTCRayN packet;
+        RTCORE_ALIGN(32) int valid[N];
+
+        for (uint i = 0; i < items.size(); i += N)
+        {
+            uint count = min((uint)N, (uint)items.size() - i);
+            for (uint k = 0; k < N; k++)
+            {
+                valid[k] = k < count ? -1 : 0;
+                if (k < count)
+                    setRTCRay(packet, k, items[i + k].ray);
+            }
+
+            rtcIntersectN(valid, this->rtcScene, packet);
+
+            // copy back only the hit, the depth and flags stay in the ray
+            for (uint k = 0; k < count; k++)
+            {
+                embree::RTCRay& ray = items[i + k].ray;
+                ray.tfar = packet.tfar[k];
+                ray.Ng[0] = packet.Ngx[k];
+                ray.Ng[1] = packet.Ngy[k];
+                ray.Ng[2] = packet.Ngz[k];
+                ray.u = packet.u[k];
+                ray.v = packet.v[k];
+                ray.geomID = packet.geomID[k];
+                ray.primID = packet.primID[k];
+                ray.instID = packet.instID[k];
+            }
+        }
+    }
+
+
+    void WavefrontRenderer::shadePath(Queues& queues, PathState& path)
+    {
+        Profile;
+        Sampler::getSampler() = path.sampler;
+        InterInfo interInfo = this->getInterInfo(path.ray);
+        if (path.type == PathType::EPrimaryPath)
+            this->processRenderElements(path.ray, interInfo);
+
+        if (path.type == PathType::EGIPath)
+            this->shadeGIPath(queues, path, interInfo);
+        else
+            this->shadeSurfacePath(queues, path, interInfo);
+    }
+
+    void WavefrontRenderer::shadeSurfacePath(Queues& queues, PathState& path, const InterInfo& interInfo)
+    {
+        const embree::RTCRay& rtcRay = path.ray;
+        SampleState& sample = queues.samples[path.sample];
+        bool primary = path.type == PathType::EPrimaryPath;
+        uint depth = (uint)rtcRay.align0;
+
+        if (!interInfo.sceneElement || path.contribution < 0.02f)
+            return;
+
+        Color4 diffuse = interInfo.color * interInfo.diffuse;
+        diffuse.a = 1.0f;
+
+        // fog and absorption are linear in the color behind them: final = base + scale * color
+        Color4 base;
+        float scale = 1.0f;
+        Color4 fogLighting(1.0f, 1.0f, 1.0f, 1.0f);
+        bool volumetric = !getFlag(rtcRay.align1, RayFlags::RAY_INDIRECT);
+        if (volumetric && ((this->VolumetricFog && this->Owner->SceneManager->FogDensity > 0.0f) || getFlag(rtcRay.align1, RayFlags::RAY_INSIDE)))
+            fogLighting += this->getFogLighting(rtcRay);
+
+        float fogDensity = this->Owner->SceneManager->FogDensity;
+        if (fogDensity > 0.0f)
+        {
+            float fogFactor = pow(2.0f, -fogDensity * fogDensity * rtcRay.tfar * rtcRay.tfar * LOG2);
+            fogFactor = min(max(fogFactor, 0.0f), 1.0f);
+
+            Color4 lighting = this->VolumetricFog && volumetric ? fogLighting : Color4(1.0f, 1.0f, 1.0f, 1.0f);
+            base = this->Owner->SceneManager->FogColor * lighting * (1.0f - fogFactor);
+            scale = fogFactor;
+        }
+        if (getFlag(rtcRay.align1, RayFlags::RAY_INSIDE))
+        {
+            const Material* material = interInfo.material;
+            if (material && material->InnerColor.intensity() > 0.01f)
+            {
+                float absFactor = exp(-rtcRay.tfar * material->Absorption);
+                absFactor = min(max(absFactor, 0.0f), 1.0f);
+
+                base = material->InnerColor * fogLighting * (1.0f - absFactor) + base * absFactor;
+                scale *= absFactor;
+            }
+        }
+
+        // the primary path fills the AOVs and composes them at the end, the others add to their path's AOV
+        int directAov = EDirectLight, specularAov = ESpecular, giAov = EIndirectLight;
+        int refractionAov = ERefraction, reflectionAov = EReflection;
+        Color4 diffuseFactor = Color4::White();
+        Color4 throughput = Color4::White();
+        if (primary)
+        {
+            sample.hit = true;
+            sample.colors[EDiffuse] = diffuse;
+            sample.colors[EDepth] = Color4(rtcRay.tfar, rtcRay.tfar, rtcRay.tfar);
+            sample.colors[ENormals] = (Color4(interInfo.normal.x, interInfo.normal.y, interInfo.normal.z) + Color4(1.0f, 1.0f, 1.0f)) * 0.5f; // from range [-1:1] to [0:1]
+            sample.fogBase = base;
+            sample.fogScale = scale;
+        }
+        else
+        {
+            sample.colors[path.aov] += path.throughput * base;
+            throughput = path.throughput * scale;
+            diffuseFactor = throughput * diffuse;
+            directAov = specularAov = giAov = refractionAov = reflectionAov = path.aov;
+        }
+
+        // calculate lighting
+        if ((interInfo.sceneElement->Type == SceneElementType::EStaticObject ||
+             interInfo.sceneElement->Type == SceneElementType::EDynamicObject) &&
+            interInfo.diffuse > 0.01f)
+        {
+            this->addShadowRays(queues, path, interInfo, directAov, diffuseFactor, specularAov, throughput);
+
+            // calculate GI
+            bool bruteForce = true;
+            if (this->GI && this->IrradianceMap && this->irrMapSamples.size() > 0 && depth == 0 &&
+                interInfo.sceneElement->Type != SceneElementType::EDynamicObject) // if irradiance map is enabled
+            {
+                Color4 indirectLight;
+                bruteForce = !this->getIrradianceMapLighting(rtcRay, indirectLight);
+                if (!bruteForce)
+                    sample.colors[giAov] += indirectLight * diffuseFactor;
+            }
+            if (bruteForce)
+            {
+                if (this->GI && (!this->IrradianceMap || (this->irrMapSamples.size() > 0 && depth != 0) ||
+                                 interInfo.sceneElement->Type == SceneElementType::EDynamicObject))
+                {
+                    uint giSamples = (uint)(this->GISamples * path.contribution * interInfo.diffuse);
+                    giSamples = max(1u, giSamples);
+                    uint flags = (uint)rtcRay.align1;
+                    setFlag(flags, RayFlags::RAY_INDIRECT, true);
+                    for (uint i = 0; i < giSamples; i++)
+                    {
+                        const Vector3& dir = hemisphereSample(interInfo.normal);
+                        this->addPath(queues, path, PathType::EGIPath, interInfo.interPos + interInfo.normal * 0.01f, dir, flags,
+                                      giAov, diffuseFactor * (1.0f / giSamples));
+                        queues.giPaths++;
+                        queues.giRays++;
+                    }
+                    if (primary)
+                        sample.colors[ESamples] = Color4(0, (float)(giSamples - 2) / (this->GISamples * 4 - 2), 0, 1.0f);
+                }
+                else
+                    sample.colors[giAov] += this->Owner->SceneManager->AmbientLight * diffuseFactor;
+            }
+        }
+        else if (interInfo.sceneElement->Type != SceneElementType::EStaticObject &&
+                 interInfo.sceneElement->Type != SceneElementType::EDynamicObject) // non static or dynamic objects
+            sample.colors[directAov] += diffuseFactor;
+
+        if (depth >= this->MaxDepth)
+            return;
+
+        // refraction
+        if (interInfo.refraction > 0.01f)
+        {
+            const Material* material = interInfo.material;
+            float glossiness = material ? material->Glossiness : 1.0f;
+
+            Vector3 n = interInfo.normal;
+            if (glossiness > 0.0f && glossiness < 0.999f) // glossy
+                n = glossy(n, glossiness);
+
+            float ior = 1.0f / (material ? material->IOR : 1.5f);
+            if (getFlag(rtcRay.align1, RayFlags::RAY_INSIDE))
+                ior = 1.0f / ior;
+            Vector3 dir = refract(Vector3(rtcRay.dir[0], rtcRay.dir[1], rtcRay.dir[2]), n, ior);
+
+            if (dir.length() > 0.001f) // total inner reflection
+            {
+                uint flags = (uint)rtcRay.align1;
+                setFlag(flags, RayFlags::RAY_INSIDE, !getFlag(flags, RayFlags::RAY_INSIDE));
+                this->addPath(queues, path, PathType::ESecondaryPath, interInfo.interPos, dir, flags, refractionAov, throughput * interInfo.refraction);
+                queues.nextPaths.back().contribution = path.contribution * interInfo.refraction;
+            }
+        }
+
+        // reflection
+        if (interInfo.reflection > 0.01f)
+        {
+            const Material* material = interInfo.material;
+            float glossiness = material ? material->Glossiness : 1.0f;
+
+            Vector3 n = interInfo.normal;
+            if (glossiness > 0.0f && glossiness < 0.999f) // glossy
+                n = glossy(n, glossiness);
+
+            Vector3 dir = reflect(Vector3(rtcRay.dir[0], rtcRay.dir[1], rtcRay.dir[2]), n);
+            this->addPath(queues, path, PathType::ESecondaryPath, interInfo.interPos, dir, (uint)rtcRay.align1, reflectionAov, throughput * interInfo.reflection);
+            queues.nextPaths.back().contribution = path.contribution * interInfo.reflection;
+        }
+    }
+
+    void WavefrontRenderer::shadeGIPath(Queues& queues, PathState& path, const InterInfo& interInfo)
+    {
+        const embree::RTCRay& rtcRay = path.ray;
+        SampleState& sample = queues.samples[path.sample];
+        Color4& result = sample.colors[path.aov];
+        const Color4& color = interInfo.color;
+
+        if (!interInfo.sceneElement)
+            return;
+
+        if ((uint)rtcRay.align0 >= this->MaxDepth || (this->RouletteDepth == 0 && path.pathMultiplier.intensity() < 0.02f))
+        {
+            result += path.throughput * color * this->Owner->SceneManager->AmbientLight;
+            return;
+        }
+
+        // get from light cache
+        Color4 cached;
+        if (this->getLightCacheLighting(interInfo.interPos, cached))
+        {
+            result += path.throughput * cached;
+            return;
+        }
+
+        // fog and absorption of the incoming segment, final = base + scale * color
+        Color4 base;
+        float scale = 1.0f;
+        float fogDensity = this->Owner->SceneManager->FogDensity;
+        if (fogDensity > 0.0f)
+        {
+            float fogFactor = pow(2.0f, -fogDensity * fogDensity * rtcRay.tfar * rtcRay.tfar * LOG2);
+            fogFactor = min(max(fogFactor, 0.0f), 1.0f);
+            base = this->Owner->SceneManager->FogColor * (1.0f - fogFactor);
+            scale = fogFactor;
+        }
+        if (getFlag(rtcRay.align1, RayFlags::RAY_INSIDE))
+        {
+            const Material* material = interInfo.material;
+            if (material && material->InnerColor.intensity() > 0.01f)
+            {
+                float absFactor = exp(-rtcRay.tfar * material->Absorption);
+                absFactor = min(max(absFactor, 0.0f), 1.0f);
+                base = material->InnerColor * (1.0f - absFactor) + base * absFactor;
+                scale *= absFactor;
+            }
+        }
+        Color4 throughput = path.throughput * color * scale;
+
+        float s = Sampler::getSampler().next();
+
+        Vector3 dir;
+        bool diffuseBounce = false;
+        uint flags = (uint)rtcRay.align1;
+        Color4 dirColor = Color4::White();
+        float pdf = 1.0f;
+
+        // diffuse
+        if ((interInfo.sceneElement->Type == SceneElementType::EStaticObject ||
+             interInfo.sceneElement->Type == SceneElementType::EDynamicObject) &&
+            s <= interInfo.diffuse)
+        {
+            this->addShadowRays(queues, path, interInfo, path.aov, throughput * path.pathMultiplier, path.aov, Color4::Black());
+
+            dir = hemisphereSample(interInfo.normal);
+            diffuseBounce = true;
+            dirColor = color * (1.0f / PI) * max(0.0f, dot(interInfo.normal, dir));
+            pdf = (1.0f / (2.0f * PI)) * interInfo.diffuse;
+        }
+        else if (s <= interInfo.diffuse) // non static objects
+        {
+            result += path.throughput * color;
+            return;
+        }
+        // refraction
+        else if (s <= interInfo.diffuse + interInfo.refraction)
+        {
+            const Material* material = interInfo.material;
+            float glossiness = material ? material->Glossiness : 1.0f;
+
+            Vector3 n = interInfo.normal;
+            if (glossiness > 0.0f && glossiness < 0.999f) // glossy
+                n = glossy(n, glossiness);
+
+            float ior = 1.0f / (material ? material->IOR : 1.5f);
+            if (getFlag(rtcRay.align1, RayFlags::RAY_INSIDE))
+                ior = 1.0f / ior;
+            dir = refract(Vector3(rtcRay.dir[0], rtcRay.dir[1], rtcRay.dir[2]), n, ior);
+
+            if (dir.length() < 0.001f) // total inner reflection
+                return;
+
+            setFlag(flags, RayFlags::RAY_INSIDE, !getFlag(flags, RayFlags::RAY_INSIDE));
+            pdf = interInfo.refraction;
+        }
+        // reflection
+        else
+        {
+            const Material* material = interInfo.material;
+            float glossiness = material ? material->Glossiness : 1.0f;
+
+            Vector3 n = interInfo.normal;
+            if (glossiness > 0.0f && glossiness < 0.999f) // glossy
+                n = glossy(n, glossiness);
+
+            dir = reflect(Vector3(rtcRay.dir[0], rtcRay.dir[1], rtcRay.dir[2]), n);
+            pdf = interInfo.reflection;
+        }
+
+        result += path.throughput * color * base;
+
+        // Russian roulette, a surviving path carries the lighting of the ended ones
+        Color4 pathMultiplier = path.pathMultiplier * dirColor * (1.0f / pdf);
+        float survival = this->getSurvival((uint)rtcRay.align0 + 1, throughput * pathMultiplier);
+        if (survival < 1.0f)
+        {
+            if (Sampler::getSampler().next() >= survival)
+                return;
+            throughput = throughput * Color4(1.0f / survival, 1.0f / survival, 1.0f / survival, 1.0f);
+        }
+
+        Vector3 start = interInfo.interPos;
+        if (diffuseBounce)
+            start += interInfo.normal * 0.01f;
+        this->addPath(queues, path, PathType::EGIPath, start, dir, flags, path.aov, throughput);
+        queues.nextPaths.back().pathMultiplier = pathMultiplier;
+        queues.giRays++;
+    }
+
+    void WavefrontRenderer::addShadowRays(Queues& queues, const PathState& path, const InterInfo& interInfo,
+                                          int aov, const Color4& diffuseFactor, int specularAov, const Color4& specularFactor)
+    {
+        const embree::RTCRay& rtcRay = path.ray;
+        const Vector3 rayDir(rtcRay.dir[0], rtcRay.dir[1], rtcRay.dir[2]);
+        const Material* material = interInfo.material;
+        bool specular = material && specularFactor.intensity() > 0.0f;
+
+        const auto& lights = this->getLights(rtcRay, interInfo);
+        for (const auto& light : lights)
+        {
+            for (int i = 0; i < RAYS; i++)
+            {
+                ShadowRay shadowRay;
+                Vector3 dir;
+                float dist;
+                if (!this->getLightContribution(light.light, interInfo, RAYS, i, shadowRay.lighting, dir, dist))
+                    continue;
+
+                // calculate diffuse
+                float cosTheta = dot(dir, interInfo.normal);
+                shadowRay.diffuseFactor = cosTheta > 0.0f ? diffuseFactor * cosTheta : Color4::Black();
+
+                // calculate specular
+                shadowRay.specularFactor = Color4::Black();
+                if (specular)
+                {
+                    Vector3 r = reflect(-dir, interInfo.normal);
+                    float cosGamma = dot(r, -rayDir);
+                    if (cosGamma > 0.0f)
+                        shadowRay.specularFactor = specularFactor * material->SpecularColor * pow(cosGamma, 0.3f * material->Shininess);
+                }
+
+                if (shadowRay.diffuseFactor.intensity() <= 0.0f && shadowRay.specularFactor.intensity() <= 0.0f)
+                    continue;
+
+                shadowRay.ray = RTCRay(interInfo.interPos, dir, 0, 0.1f, dist);
+                shadowRay.ray.mask = RayMasks::RAY_MASK_GEOMETRY;
+                shadowRay.sample = path.sample;
+                shadowRay.aov = aov;
+                shadowRay.specularAov = specularAov;
+                shadowRay.lighting *= light.weight / RAYS;
+                queues.shadowRays.push_back(shadowRay);
+            }
+        }
+    }
+
+    void WavefrontRenderer::traceShadowRays(Queues& queues)
+    {
+        Profile;
+        if (this->packetSize == 8)
+            this->occludePackets<embree::RTCRay8, 8>(queues);
+        else
+            this->occludePackets<embree::RTCRay4, 4>(queues);
+    }
+
+    template <typename RTCRayN, int N>
+    void WavefrontRenderer::occludePackets(Queues& queues)
+    {
+        RTCRayN packet;
+        RTCORE_ALIGN(32) int valid[N];
+        ShadowContext context;
+        vector<ShadowRay>& shadowRays = queues.shadowRays;
+
+        // the occlusion filter skips the lights and attenuates the light by the transparent occluders
+        shadowContext = &context;
+        for (uint i = 0; i < shadowRays.size(); i += N)
+        {
+            uint count = min((uint)N, (uint)shadowRays.size() - i);
+            for (uint k = 0; k < N; k++)
+            {
+                valid[k] = k < count ? -1 : 0;
+                context.transmittance[k] = Color4::White();
+                if (k < count)
+                    setRTCRay(packet, k, shadowRays[i + k].ray);
+            }
+
+            rtcOccludedN(valid, this->rtcScene, packet);
+
+            for (uint k = 0; k < count; k++)
+            {
+                if (packet.geomID[k] != RTC_INVALID_GEOMETRY_ID) // occluded
+                    continue;
+
+                const ShadowRay& shadowRay = shadowRays[i + k];
+                Color4 lighting = shadowRay.lighting * context.transmittance[k];
+                AOVColors& colors = queues.samples[shadowRay.sample].colors;
+                colors[shadowRay.aov] += lighting * shadowRay.diffuseFactor;
+                colors[shadowRay.specularAov] += lighting * shadowRay.specularFactor;
+            }
+        }
+        shadowContext = NULL;
+    }
+
+    void WavefrontRenderer::addPath(Queues& queues, const PathState& parent, PathType type, const Vector3& start, const Vector3& dir, uint flags,
+                                    int aov, const Color4& throughput)
+    {
+        PathState path;
+        path.ray = RTCRay(start, dir, (uint)parent.ray.align0 + 1);
+        path.ray.align1 = (float)flags;
+        path.ray.align2 = this->getRayConeWidth(parent.ray);
+        path.type = type;
+        path.sample = parent.sample;
+        path.aov = aov;
+        path.throughput = throughput;
+        path.pathMultiplier = Color4::White();
+        path.contribution = parent.contribution;
+        path.sampler = Sampler::getSampler();
+        queues.nextPaths.push_back(path);
+    }
+
+}
\ No newline at end of file
@@ -0,0 +1,56 @@
+// WavefrontRenderer.h
+#pragma once
+
+#include "CPURayRenderer.h"
+
+
+namespace MyEngine {
+
+    // Queue based version of the CPURayRenderer: instead of recursing one ray at a time, the paths of a region
+    // are kept in queues and advanced a bounce at a time in stages (generate, intersect, sort by material,
+    // shade, shadow rays), so every stage works on a batch of rays.
+    class WavefrontRenderer : public CPURayRenderer
+    {
+    protected:
+        enum PathType
+        {
+            EPrimaryPath,
+            ESecondaryPath, // reflection / refraction
+            EGIPath
+        };
+
+        struct PathState;
+        struct ShadowRay;
+        struct SampleState;
+        struct Queues;
+
+        vector<shared_ptr<Queues>> workerQueues; // worker id / queues, "queues" mutex
+
+    public:
+        WavefrontRenderer(Engine* owner);
+        WavefrontRenderer& operator=(const WavefrontRenderer&) { return *this; }
+        ~WavefrontRenderer();
+
+    protected:
+        virtual bool renderRegion(int id, const Region& region, bool preview) override;
+        Queues& getQueues(int id); // grown for the ids after the workers
+        void renderSample(Queues& queues);
+
+        template <typename T>
+        void intersectRays(vector<T>& items);
+        template <typename RTCRayN, int N, typename T>
+        void intersectPackets(vector<T>& items);
+
+        void shadePath(Queues& queues, PathState& path);
+        void shadeSurfacePath(Queues& queues, PathState& path, const InterInfo& interInfo);
+        void shadeGIPath(Queues& queues, PathState& path, const InterInfo& interInfo);
+        void addShadowRays(Queues& queues, const PathState& path, const InterInfo& interInfo,
+                           int aov, const Color4& diffuseFactor, int specularAov, const Color4& specularFactor);
+        void traceShadowRays(Queues& queues);
+        template <typename RTCRayN, int N>
+        void occludePackets(Queues& queues);
+        void addPath(Queues& queues, const PathState& parent, PathType type, const Vector3& start, const Vector3& dir, uint flags,
+                     int aov, const Color4& throughput);
+    };
+
+}
\ No newline at end of file
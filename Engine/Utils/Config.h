@@ -11,11 +11,19 @@
 
 #define BACKUP_FOLDER       "Backups"
 
+#define CACHE_FOLDER        "Cache"
+#define GI_CACHE_EXT        ".gic"
+#define CHECKPOINT_EXT      ".mcp"
+
 #define PACKAGE_EXT         ".mpk"
 #define SCENE_EXT           ".msn"
 
 #define DEFAULT_LAYER_NAME  "Default"
 
+#define RENDER_NODE_ARG     "-rendernode"
+#define RENDER_NODES_PORT   27015
+#define RENDER_NODES_SCENE  CACHE_FOLDER "\\RenderNodes" SCENE_EXT
+
 #define FPS                 30
 
 
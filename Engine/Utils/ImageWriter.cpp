@@ -0,0 +1,88 @@
+// ImageWriter.cpp
+
+#include "stdafx.h"
+#include "ImageWriter.h"
+#include "..\Engine.h"
+#include "External\lodepng.h"
+
+
+namespace MyEngine {
+
+    ImageWriter::ImageWriter()
+    {
+        this->closing = false;
+    }
+
+    ImageWriter::~ImageWriter()
+    {
+        this->finish();
+    }
+
+    void ImageWriter::add(const string& filePath, const Buffer<uint>& pixels)
+    {
+        unique_ptr<Image> image(new Image());
+        image->filePath = filePath;
+        image->pixels.init(pixels);
+
+        lock_guard<mutex> lck(this->mtx);
+        this->images.push_back(move(image));
+        if (!this->writer.joinable())
+        {
+            this->closing = false;
+            this->writer = std::thread(&ImageWriter::run, this);
+        }
+        this->cv.notify_one();
+    }
+
+    void ImageWriter::finish()
+    {
+        {
+            lock_guard<mutex> lck(this->mtx);
+            this->closing = true;
+            this->cv.notify_one();
+        }
+        if (this->writer.joinable())
+            this->writer.join();
+    }
+
+    bool ImageWriter::write(const string& filePath, const Buffer<uint>& pixels)
+    {
+        // from BGRA to RGBA
+        uint count = pixels.width * pixels.height;
+        vector<byte> rgba(count * 4);
+        for (uint i = 0; i < count; i++)
+        {
+            uint pixel = pixels.data[i];
+            rgba[i * 4 + 0] = (byte)(pixel >> 16);
+            rgba[i * 4 + 1] = (byte)(pixel >> 8);
+            rgba[i * 4 + 2] = (byte)pixel;
+            rgba[i * 4 + 3] = (byte)(pixel >> 24);
+        }
+
+        unsigned error = lodepng_encode32_file(filePath.c_str(), count > 0 ? &rgba[0] : NULL, pixels.width, pixels.height);
+        if (error != 0)
+        {
+            Engine::Log(LogType::EError, "ImageWriter", "Cannot write " + filePath + ": " + lodepng_error_text(error));
+            return false;
+        }
+        return true;
+    }
+
+    void ImageWriter::run()
+    {
+        while (true)
+        {
+            unique_ptr<Image> image;
+            {
+                unique_lock<mutex> lck(this->mtx);
+                this->cv.wait(lck, [&]() { return !this->images.empty() || this->closing; });
+                if (this->images.empty())
+                    return;
+                image = move(this->images.front());
+                this->images.pop_front();
+            }
+            ImageWriter::write(image->filePath, image->pixels);
+        }
+    }
+
+}
\ No newline at end of file
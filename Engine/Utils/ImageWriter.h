@@ -0,0 +1,45 @@
+// ImageWriter.h
+#pragma once
+
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+
+#include "Header.h"
+#include "Types\Buffer.h"
+
+
+namespace MyEngine {
+
+    // writes 8-bit BGRA images to PNG files on its own thread in the order they are added, so the encoding of a
+    // frame doesn't hold up the rendering of the next one
+    struct ImageWriter
+    {
+    private:
+        struct Image
+        {
+            string filePath;
+            Buffer<uint> pixels;
+        };
+
+        std::thread writer; // started by the first image
+        mutex mtx;
+        condition_variable cv;
+        deque<unique_ptr<Image>> images;
+        bool closing;
+
+    public:
+        ImageWriter();
+        ~ImageWriter(); // writes the images left
+
+        void add(const string& filePath, const Buffer<uint>& pixels); // copies the pixels
+        void finish(); // waits until the added images are written
+
+        static bool write(const string& filePath, const Buffer<uint>& pixels);
+
+    private:
+        void run();
+    };
+
+}
\ No newline at end of file
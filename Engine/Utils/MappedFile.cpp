@@ -0,0 +1,74 @@
+// MappedFile.cpp
+
+#include "stdafx.h"
+#include "MappedFile.h"
+
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+
+
+namespace MyEngine {
+
+    MappedFile::MappedFile()
+    {
+        this->file = NULL;
+        this->mapping = NULL;
+        this->view = NULL;
+        this->length = 0;
+    }
+
+    MappedFile::~MappedFile()
+    {
+        this->close();
+    }
+
+    bool MappedFile::open(const string& filePath)
+    {
+        this->close();
+
+        HANDLE file = CreateFileA(filePath.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+        if (file == INVALID_HANDLE_VALUE)
+            return false;
+        this->file = file;
+
+        LARGE_INTEGER size;
+        if (!GetFileSizeEx(file, &size) || size.QuadPart == 0)
+        {
+            this->close();
+            return false;
+        }
+
+        this->mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+        if (this->mapping == NULL)
+        {
+            this->close();
+            return false;
+        }
+
+        this->view = (const byte*)MapViewOfFile(this->mapping, FILE_MAP_READ, 0, 0, 0);
+        if (this->view == NULL)
+        {
+            this->close();
+            return false;
+        }
+        this->length = (size_t)size.QuadPart;
+        return true;
+    }
+
+    void MappedFile::close()
+    {
+        if (this->view != NULL)
+            UnmapViewOfFile(this->view);
+        if (this->mapping != NULL)
+            CloseHandle(this->mapping);
+        if (this->file != NULL)
+            CloseHandle(this->file);
+
+        this->file = NULL;
+        this->mapping = NULL;
+        this->view = NULL;
+        this->length = 0;
+    }
+
+}
\ No newline at end of file
@@ -0,0 +1,36 @@
+// MappedFile.h
+#pragma once
+
+#include "Header.h"
+
+
+namespace MyEngine {
+
+    // read only view of a whole file mapped to the memory, the pages are read when they are accessed
+    struct MappedFile
+    {
+    private:
+        void* file;
+        void* mapping;
+        const byte* view;
+        size_t length;
+
+    public:
+        MappedFile();
+        ~MappedFile();
+
+        bool open(const string& filePath);
+        void close();
+
+        inline const byte* data() const
+        {
+            return this->view;
+        }
+
+        inline size_t size() const
+        {
+            return this->length;
+        }
+    };
+
+}
\ No newline at end of file
@@ -0,0 +1,265 @@
+// PostProcessing.cpp
+
+#include "stdafx.h"
+#include "PostProcessing.h"
+
+#include <cfloat>
+#include <intrin.h>
+
+#include "Types\Thread.h"
+
+
+namespace MyEngine {
+
+    // linear [0..1] in SRGB_STEPS steps / 8-bit sRGB
+    static const int SRGB_STEPS = 4096;
+    struct SRGBTable
+    {
+        byte values[SRGB_STEPS];
+
+        SRGBTable()
+        {
+            for (int i = 0; i < SRGB_STEPS; i++)
+            {
+                float c = (float)i / (SRGB_STEPS - 1);
+                c = c <= 0.0031308f ? c * 12.92f : 1.055f * pow(c, 1.0f / 2.4f) - 0.055f;
+                this->values[i] = (byte)(c * 255.0f + 0.5f);
+            }
+        }
+    };
+    static const SRGBTable srgbTable;
+
+    // edge stopping of the denoiser
+    static const float DENOISE_NORMAL_POWER = 128.0f;
+    static const float DENOISE_DEPTH_SIGMA = 0.01f; // relative depth change per pixel
+    static const float DENOISE_ALBEDO_SIGMA = 0.1f;
+    static const float DENOISE_LUMINANCE_SIGMA = 4.0f; // in the pixel's standard errors
+
+
+    void PostProcessing::clear()
+    {
+        this->passes.clear();
+    }
+
+    void PostProcessing::addPass(const string& name, const PassFunc& process, PassType type /* = PassType::EImagePass */)
+    {
+        Pass pass;
+        pass.name = name;
+        pass.process = process;
+        pass.type = type;
+        pass.nextTile = make_shared<atomic_int>(0);
+        this->passes.push_back(pass);
+    }
+
+    void PostProcessing::processTile(const Region& tile) const
+    {
+        for (const auto& pass : this->passes)
+        {
+            if (pass.type == PassType::ETilePass)
+                pass.process(tile);
+        }
+    }
+
+    void PostProcessing::addTasks(Thread* thread, const vector<Region>& tiles, bool finished /* = true */)
+    {
+        bool afterImagePass = false;
+        for (const auto& pass : this->passes)
+        {
+            if (pass.type == PassType::EFinalPass && !finished)
+                continue;
+            afterImagePass = afterImagePass || pass.type != PassType::ETilePass;
+            if (!afterImagePass) // done on the rendered tiles
+                continue;
+
+            // the workers take the tiles until there are no more
+            *pass.nextTile = 0;
+            PassFunc process = pass.process;
+            shared_ptr<atomic_int> nextTile = pass.nextTile;
+            thread->addNTasks([process, nextTile, &tiles](int)
+            {
+                for (int i = (*nextTile)++; i < (int)tiles.size(); i = (*nextTile)++)
+                    process(tiles[i]);
+                return true;
+            });
+            thread->addWaitTask();
+        }
+    }
+
+
+    float PostProcessing::getMax(const Buffer<Color4>& buffer, const Region& tile)
+    {
+        __m128 result = _mm_setzero_ps();
+        for (int j = tile.y; j < tile.y + tile.h; j++)
+        {
+            const float* row = &buffer.data[j * buffer.width + tile.x].r;
+            for (int i = 0; i < tile.w; i++)
+                result = _mm_max_ps(result, _mm_loadu_ps(row + i * 4));
+        }
+
+        float values[4];
+        _mm_storeu_ps(values, result);
+        return max(max(values[0], values[1]), values[2]);
+    }
+
+    void PostProcessing::scale(Buffer<Color4>& buffer, const Region& tile, float factor)
+    {
+        const __m128 factors = _mm_setr_ps(factor, factor, factor, 1.0f);
+        for (int j = tile.y; j < tile.y + tile.h; j++)
+        {
+            float* row = &buffer.data[j * buffer.width + tile.x].r;
+            for (int i = 0; i < tile.w; i++)
+                _mm_storeu_ps(row + i * 4, _mm_mul_ps(_mm_loadu_ps(row + i * 4), factors));
+        }
+    }
+
+    void PostProcessing::brightPass(const Buffer<Color4>& src, Buffer<Color4>& dst, const Region& tile, float threshold)
+    {
+        // the light above the threshold, no alpha
+        const __m128 thresholds = _mm_setr_ps(threshold, threshold, threshold, FLT_MAX);
+        const __m128 zero = _mm_setzero_ps();
+        for (int j = tile.y; j < tile.y + tile.h; j++)
+        {
+            const float* srcRow = &src.data[j * src.width + tile.x].r;
+            float* dstRow = &dst.data[j * dst.width + tile.x].r;
+            for (int i = 0; i < tile.w; i++)
+                _mm_storeu_ps(dstRow + i * 4, _mm_max_ps(_mm_sub_ps(_mm_loadu_ps(srcRow + i * 4), thresholds), zero));
+        }
+    }
+
+    void PostProcessing::blur(const Buffer<Color4>& src, Buffer<Color4>& dst, const Region& tile, int radius, bool horizontal)
+    {
+        // normalized gaussian weights, sigma is the half of the radius
+        vector<float> weights(radius + 1);
+        float sum = 0.0f;
+        for (int k = 0; k <= radius; k++)
+        {
+            float x = (float)k / max(radius * 0.5f, 0.5f);
+            weights[k] = exp(-0.5f * x * x);
+            sum += k == 0 ? weights[k] : 2.0f * weights[k];
+        }
+        for (auto& weight : weights)
+            weight /= sum;
+
+        // the samples outside of the image are clamped to its border
+        int size = horizontal ? src.width : src.height;
+        int stride = horizontal ? 4 : src.width * 4;
+        for (int j = tile.y; j < tile.y + tile.h; j++)
+        {
+            for (int i = tile.x; i < tile.x + tile.w; i++)
+            {
+                int pos = horizontal ? i : j;
+                const float* center = &src.data[j * src.width + i].r;
+                __m128 result = _mm_mul_ps(_mm_loadu_ps(center), _mm_set1_ps(weights[0]));
+                for (int k = 1; k <= radius; k++)
+                {
+                    int prev = max(pos - k, 0) - pos;
+                    int next = min(pos + k, size - 1) - pos;
+                    __m128 pair = _mm_add_ps(_mm_loadu_ps(center + prev * stride), _mm_loadu_ps(center + next * stride));
+                    result = _mm_add_ps(result, _mm_mul_ps(pair, _mm_set1_ps(weights[k])));
+                }
+                _mm_storeu_ps(&dst.data[j * dst.width + i].r, result);
+            }
+        }
+    }
+
+    void PostProcessing::denoise(const Buffer<Color4>& src, Buffer<Color4>& dst, const DenoiseGuides& guides, const Region& tile, int iteration)
+    {
+        static const float kernel[5] = { 1.0f / 16, 1.0f / 4, 3.0f / 8, 1.0f / 4, 1.0f / 16 }; // B3 spline
+        const int step = 1 << iteration;
+        const int width = (int)src.width;
+        const int height = (int)src.height;
+        for (int j = tile.y; j < tile.y + tile.h; j++)
+        {
+            for (int i = tile.x; i < tile.x + tile.w; i++)
+            {
+                int p = j * width + i;
+                const Color4& normal = guides.normals->data[p];
+                const Color4& albedo = guides.albedo->data[p];
+                float depth = guides.depth->data[p].r;
+                float luminance = src.data[p].intensity();
+                float invLuminanceSigma = 1.0f / (DENOISE_LUMINANCE_SIGMA * guides.noise->data[p].r * abs(luminance) + 0.0001f);
+                float invDepthSigma = 1.0f / (DENOISE_DEPTH_SIGMA * depth * step + 0.0001f);
+
+                // the center's guides are equal, so it has the kernel weight only
+                float weights = kernel[2] * kernel[2];
+                __m128 result = _mm_mul_ps(_mm_loadu_ps(&src.data[p].r), _mm_set1_ps(weights));
+                for (int y = -2; y <= 2; y++)
+                {
+                    int jj = j + y * step;
+                    if (jj < 0 || jj >= height)
+                        continue;
+                    for (int x = -2; x <= 2; x++)
+                    {
+                        int ii = i + x * step;
+                        if ((x == 0 && y == 0) || ii < 0 || ii >= width)
+                            continue;
+
+                        int q = jj * width + ii;
+                        const Color4& normalQ = guides.normals->data[q];
+                        const Color4& albedoQ = guides.albedo->data[q];
+                        float cosNormals = (2.0f * normal.r - 1.0f) * (2.0f * normalQ.r - 1.0f) + (2.0f * normal.g - 1.0f) * (2.0f * normalQ.g - 1.0f) +
+                            (2.0f * normal.b - 1.0f) * (2.0f * normalQ.b - 1.0f);
+                        if (cosNormals <= 0.0f)
+                            continue;
+                        float albedoDist = (albedo.r - albedoQ.r) * (albedo.r - albedoQ.r) + (albedo.g - albedoQ.g) * (albedo.g - albedoQ.g) +
+                            (albedo.b - albedoQ.b) * (albedo.b - albedoQ.b);
+
+                        float weight = kernel[x + 2] * kernel[y + 2] * pow(min(cosNormals, 1.0f), DENOISE_NORMAL_POWER) *
+                            exp(-abs(depth - guides.depth->data[q].r) * invDepthSigma / max(abs(x), abs(y)) -
+                            albedoDist / (DENOISE_ALBEDO_SIGMA * DENOISE_ALBEDO_SIGMA) -
+                            abs(luminance - src.data[q].intensity()) * invLuminanceSigma);
+                        result = _mm_add_ps(result, _mm_mul_ps(_mm_loadu_ps(&src.data[q].r), _mm_set1_ps(weight)));
+                        weights += weight;
+                    }
+                }
+                _mm_storeu_ps(&dst.data[p].r, _mm_mul_ps(result, _mm_set1_ps(1.0f / weights)));
+            }
+        }
+    }
+
+    void PostProcessing::toDisplay(const Buffer<Color4>& src, const Buffer<Color4>* bloom, float bloomFactor, Buffer<uint>& dst, const Region& tile,
+        float exposure, bool toneMapping, bool sRGB)
+    {
+        const __m128 zero = _mm_setzero_ps();
+        const __m128 one = _mm_set1_ps(1.0f);
+        const __m128 exposures = _mm_setr_ps(exposure, exposure, exposure, 1.0f); // the alpha is kept
+        const __m128 bloomFactors = _mm_setr_ps(bloomFactor, bloomFactor, bloomFactor, 0.0f);
+        const __m128 alphaMask = _mm_castsi128_ps(_mm_setr_epi32(0, 0, 0, -1));
+        const __m128 scale = _mm_set1_ps(sRGB ? SRGB_STEPS - 1.0f : 255.0f);
+        for (int j = tile.y; j < tile.y + tile.h; j++)
+        {
+            const float* srcRow = &src.data[j * src.width + tile.x].r;
+            const float* bloomRow = bloom ? &bloom->data[j * bloom->width + tile.x].r : NULL;
+            uint* dstRow = &dst.data[j * dst.width + tile.x];
+            for (int i = 0; i < tile.w; i++)
+            {
+                __m128 c = _mm_loadu_ps(srcRow + i * 4);
+                if (bloomRow)
+                    c = _mm_add_ps(c, _mm_mul_ps(_mm_loadu_ps(bloomRow + i * 4), bloomFactors));
+                c = _mm_mul_ps(c, exposures);
+                if (toneMapping)
+                {
+                    __m128 mapped = _mm_div_ps(c, _mm_add_ps(one, _mm_max_ps(c, zero)));
+                    c = _mm_or_ps(_mm_andnot_ps(alphaMask, mapped), _mm_and_ps(alphaMask, c));
+                }
+                c = _mm_mul_ps(_mm_min_ps(_mm_max_ps(c, zero), one), scale);
+
+                // from RGBA to BGRA
+                __m128i values = _mm_cvtps_epi32(_mm_shuffle_ps(c, c, _MM_SHUFFLE(3, 0, 1, 2)));
+                if (sRGB)
+                {
+                    int steps[4];
+                    _mm_storeu_si128((__m128i*)steps, values);
+                    uint alpha = (uint)(steps[3] * (255.0f / (SRGB_STEPS - 1)) + 0.5f);
+                    dstRow[i] = srgbTable.values[steps[0]] | (srgbTable.values[steps[1]] << 8) | (srgbTable.values[steps[2]] << 16) | (alpha << 24);
+                }
+                else
+                {
+                    values = _mm_packs_epi32(values, values);
+                    dstRow[i] = (uint)_mm_cvtsi128_si32(_mm_packus_epi16(values, values));
+                }
+            }
+        }
+    }
+
+}
\ No newline at end of file
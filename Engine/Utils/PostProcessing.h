@@ -0,0 +1,72 @@
+// PostProcessing.h
+#pragma once
+
+#include <atomic>
+#include <functional>
+
+#include "Header.h"
+#include "Types\Color4.h"
+#include "Types\Buffer.h"
+#include "RayUtils.h"
+
+
+namespace MyEngine {
+
+    struct Thread;
+
+    // post-processing stage of a production renderer: a list of passes over the image, each one split in the render's
+    // tiles and run on the thread pool, a pass starts when the previous one finished the whole image. A tile pass reads
+    // only its own tile, so it also runs on every tile as soon as it's rendered; the ones after an image pass are then
+    // only a preview and they run again at the end.
+    class PostProcessing
+    {
+    public:
+        using PassFunc = function<void(const Region&)>;
+
+        enum PassType
+        {
+            ETilePass,
+            EImagePass,
+            EFinalPass // image pass only for the finished image, e.g. it changes a buffer the next samples are added to
+        };
+
+        struct DenoiseGuides
+        {
+            const Buffer<Color4>* normals; // in [0..1]
+            const Buffer<Color4>* depth;
+            const Buffer<Color4>* albedo;
+            const Buffer<Color4>* noise; // relative error of the pixels' mean
+        };
+
+    protected:
+        struct Pass
+        {
+            string name;
+            PassFunc process;
+            PassType type;
+            shared_ptr<atomic_int> nextTile;
+        };
+
+        vector<Pass> passes;
+
+    public:
+        void clear();
+        void addPass(const string& name, const PassFunc& process, PassType type = PassType::EImagePass);
+        void processTile(const Region& tile) const; // the tile passes on a rendered tile
+        // the passes not done on the rendered tiles, ends with a wait task. Between the progressive iterations the image
+        // isn't finished, then the final passes are left out.
+        void addTasks(Thread* thread, const vector<Region>& tiles, bool finished = true);
+
+        // the kernels work on a pixel's 4 channels at once
+        static float getMax(const Buffer<Color4>& buffer, const Region& tile); // of the r, g, b channels
+        static void scale(Buffer<Color4>& buffer, const Region& tile, float factor); // r, g, b channels
+        static void brightPass(const Buffer<Color4>& src, Buffer<Color4>& dst, const Region& tile, float threshold);
+        static void blur(const Buffer<Color4>& src, Buffer<Color4>& dst, const Region& tile, int radius, bool horizontal); // gaussian
+        // an iteration of the edge-avoiding a-trous wavelet filter (Dammertz et al. 2010), its taps are 2^iteration pixels apart
+        static void denoise(const Buffer<Color4>& src, Buffer<Color4>& dst, const DenoiseGuides& guides, const Region& tile, int iteration);
+        // 8-bit BGRA of (src + bloom * bloomFactor) * exposure, tone mapped (Reinhard) and gamma corrected if asked
+        static void toDisplay(const Buffer<Color4>& src, const Buffer<Color4>* bloom, float bloomFactor, Buffer<uint>& dst, const Region& tile,
+            float exposure, bool toneMapping, bool sRGB);
+    };
+
+}
\ No newline at end of file
@@ -0,0 +1,60 @@
+// Process.cpp
+
+#include "stdafx.h"
+#include "Process.h"
+
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+
+
+namespace MyEngine {
+
+    Process::Process()
+    {
+        this->process = NULL;
+    }
+
+    Process::~Process()
+    {
+        this->close();
+    }
+
+    bool Process::start(const string& arguments)
+    {
+        this->close();
+
+        char path[MAX_PATH];
+        if (GetModuleFileNameA(NULL, path, MAX_PATH) == 0)
+            return false;
+
+        string commandLine = "\"" + string(path) + "\" " + arguments;
+        vector<char> buffer(commandLine.begin(), commandLine.end());
+        buffer.push_back('\0');
+
+        STARTUPINFOA startupInfo = {};
+        startupInfo.cb = sizeof(startupInfo);
+        PROCESS_INFORMATION processInfo = {};
+        if (!CreateProcessA(path, &buffer[0], NULL, NULL, FALSE, CREATE_NO_WINDOW, NULL, NULL, &startupInfo, &processInfo))
+            return false;
+
+        CloseHandle(processInfo.hThread);
+        this->process = processInfo.hProcess;
+        return true;
+    }
+
+    bool Process::isRunning() const
+    {
+        return this->process != NULL && WaitForSingleObject(this->process, 0) == WAIT_TIMEOUT;
+    }
+
+    void Process::close()
+    {
+        if (this->process == NULL)
+            return;
+
+        CloseHandle(this->process);
+        this->process = NULL;
+    }
+
+}
\ No newline at end of file
@@ -0,0 +1,24 @@
+// Process.h
+#pragma once
+
+#include "Header.h"
+
+
+namespace MyEngine {
+
+    // child process running this executable
+    struct Process
+    {
+    private:
+        void* process;
+
+    public:
+        Process();
+        ~Process(); // doesn't end the process
+
+        bool start(const string& arguments);
+        bool isRunning() const;
+        void close();
+    };
+
+}
\ No newline at end of file
@@ -2,6 +2,7 @@
 #pragma once
 
 #include "Types\Random.h"
+#include "Types\Sampler.h"
 #include "Types\Vector3.h"
 #include "Types\Quaternion.h"
 
@@ -10,6 +11,7 @@ namespace MyEngine {
 
     class SceneElement;
     using SceneElementPtr = shared_ptr < SceneElement >;
+    class Material;
 
     struct Region
     {
@@ -40,7 +42,8 @@ namespace MyEngine {
 
     struct InterInfo
     {
-        SceneElementPtr sceneElement;
+        SceneElement* sceneElement; // owned by the renderer's instances, valid while the scene is rendered
+        Material* material;
         Vector3 interPos;
         Vector3 UV;
 
@@ -50,6 +53,8 @@ namespace MyEngine {
         float diffuse;
         float refraction;
         float reflection;
+
+        InterInfo() : sceneElement(NULL), material(NULL) {}
     };
 
     
@@ -59,6 +64,12 @@ namespace MyEngine {
         RAY_INSIDE = (1 << 1),
     };
 
+    enum RayMasks
+    {
+        RAY_MASK_GEOMETRY = (1 << 0),
+        RAY_MASK_LIGHT = (1 << 1),
+    };
+
     inline bool getFlag(uint flags, uint flag)
     {
         return (flags & flag) != 0;
@@ -85,12 +96,6 @@ namespace MyEngine {
     }
 
 
-    struct LightCacheSample
-    {
-        Vector3 position;
-        Color4 color;
-    };
-
     struct IrradianceMapSample
     {
         float x, y;
@@ -101,6 +106,31 @@ namespace MyEngine {
     };
 
 
+    // FNV-1a of the bytes combined with the hash
+    inline void hashBytes(unsigned long long& hash, const void* data, size_t size)
+    {
+        const unsigned char* bytes = (const unsigned char*)data;
+        for (size_t i = 0; i < size; i++)
+        {
+            hash ^= bytes[i];
+            hash *= 1099511628211ULL;
+        }
+    }
+
+    template <typename T>
+    inline void hashCombine(unsigned long long& hash, const T& value)
+    {
+        hashBytes(hash, &value, sizeof(T));
+    }
+
+    template <typename T>
+    inline void hashCombine(unsigned long long& hash, const vector<T>& values)
+    {
+        hashCombine(hash, values.size());
+        if (!values.empty())
+            hashBytes(hash, &values[0], values.size() * sizeof(T));
+    }
+
     inline vector<float> getMatrix(const Vector3& pos, Quaternion rot, const Vector3& scl)
     {
         vector<float> result(16);
@@ -154,11 +184,10 @@ namespace MyEngine {
     void orthonormedSystem(const Vector3& a, Vector3& b, Vector3& c);
     inline Vector3 glossy(const Vector3& n, float glossiness)
     {
-        Random& rand = Random::getRandomGen();
         Vector3 pn1, pn2;
         orthonormedSystem(n, pn1, pn2);
         float x, y;
-        rand.unitDiscSample(x, y);
+        Sampler::getSampler().unitDiscSample(x, y);
         Vector3 newN = n + (pn1 * x + pn2 * y) * tan((1.0f -  glossiness) * PI / 2.0f);
         newN.normalize();
         return newN;
@@ -191,9 +220,10 @@ namespace MyEngine {
 
     inline Vector3 hemisphereSample(const Vector3& normal)
     {
-        Random& rand = Random::getRandomGen();
-        float z = rand.randFloat() * 2.0f - 1.0f;
-        float t = rand.randFloat() * 2.0f * PI;
+        float u, v;
+        Sampler::getSampler().next2D(u, v);
+        float z = u * 2.0f - 1.0f;
+        float t = v * 2.0f * PI;
         float r = sqrt(1.0f - z * z);
         
         Vector3 res;
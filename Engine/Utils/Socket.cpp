@@ -0,0 +1,184 @@
+// Socket.cpp
+
+#include "stdafx.h"
+#include "Socket.h"
+
+#include <mutex>
+
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <winsock2.h>
+#include <ws2tcpip.h>
+
+
+namespace MyEngine {
+
+    static once_flag winsockInit;
+
+    static void initWinsock()
+    {
+        call_once(winsockInit, []()
+        {
+            WSADATA data;
+            WSAStartup(MAKEWORD(2, 2), &data);
+        });
+    }
+
+
+    Socket::Socket()
+    {
+        this->handle = INVALID_SOCKET;
+    }
+
+    Socket::~Socket()
+    {
+        this->close();
+    }
+
+    bool Socket::listen(int port)
+    {
+        this->close();
+        initWinsock();
+
+        SOCKET s = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+        if (s == INVALID_SOCKET)
+            return false;
+
+        sockaddr_in address = {};
+        address.sin_family = AF_INET;
+        address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        address.sin_port = htons((u_short)port);
+        if (::bind(s, (sockaddr*)&address, sizeof(address)) == SOCKET_ERROR || ::listen(s, SOMAXCONN) == SOCKET_ERROR)
+        {
+            closesocket(s);
+            return false;
+        }
+
+        this->handle = s;
+        return true;
+    }
+
+    bool Socket::accept(Socket& client, int timeout)
+    {
+        if (!this->isOpen() || !this->wait(timeout))
+            return false;
+
+        SOCKET s = ::accept((SOCKET)this->handle, NULL, NULL);
+        if (s == INVALID_SOCKET)
+            return false;
+
+        // the messages are small requests and answers, don't wait to fill the packets
+        BOOL noDelay = TRUE;
+        setsockopt(s, IPPROTO_TCP, TCP_NODELAY, (const char*)&noDelay, sizeof(noDelay));
+
+        client.close();
+        client.handle = s;
+        return true;
+    }
+
+    bool Socket::connect(const string& host, int port)
+    {
+        this->close();
+        initWinsock();
+
+        addrinfo hints = {};
+        hints.ai_family = AF_INET;
+        hints.ai_socktype = SOCK_STREAM;
+        hints.ai_protocol = IPPROTO_TCP;
+        addrinfo* result = NULL;
+        if (getaddrinfo(host.c_str(), to_string(port).c_str(), &hints, &result) != 0)
+            return false;
+
+        SOCKET s = INVALID_SOCKET;
+        for (addrinfo* info = result; info != NULL && s == INVALID_SOCKET; info = info->ai_next)
+        {
+            s = socket(info->ai_family, info->ai_socktype, info->ai_protocol);
+            if (s != INVALID_SOCKET && ::connect(s, info->ai_addr, (int)info->ai_addrlen) == SOCKET_ERROR)
+            {
+                closesocket(s);
+                s = INVALID_SOCKET;
+            }
+        }
+        freeaddrinfo(result);
+        if (s == INVALID_SOCKET)
+            return false;
+
+        BOOL noDelay = TRUE;
+        setsockopt(s, IPPROTO_TCP, TCP_NODELAY, (const char*)&noDelay, sizeof(noDelay));
+
+        this->handle = s;
+        return true;
+    }
+
+    void Socket::close()
+    {
+        if (!this->isOpen())
+            return;
+
+        closesocket((SOCKET)this->handle);
+        this->handle = INVALID_SOCKET;
+    }
+
+    bool Socket::send(const string& message)
+    {
+        int size = (int)message.size();
+        return this->sendAll((const char*)&size, sizeof(size)) && this->sendAll(message.data(), size);
+    }
+
+    bool Socket::receive(string& message)
+    {
+        int size = 0;
+        if (!this->receiveAll((char*)&size, sizeof(size)) || size < 0)
+            return false;
+
+        message.resize(size);
+        return size == 0 || this->receiveAll(&message[0], size);
+    }
+
+    bool Socket::wait(int timeout)
+    {
+        if (!this->isOpen())
+            return false;
+
+        fd_set set;
+        FD_ZERO(&set);
+        FD_SET((SOCKET)this->handle, &set);
+        timeval time;
+        time.tv_sec = timeout / 1000;
+        time.tv_usec = (timeout % 1000) * 1000;
+        return select(0, &set, NULL, NULL, &time) != 0; // an error is reported by the next receive
+    }
+
+    bool Socket::sendAll(const char* data, int size)
+    {
+        while (size > 0 && this->isOpen())
+        {
+            int sent = ::send((SOCKET)this->handle, data, size, 0);
+            if (sent == SOCKET_ERROR)
+            {
+                this->close();
+                return false;
+            }
+            data += sent;
+            size -= sent;
+        }
+        return this->isOpen();
+    }
+
+    bool Socket::receiveAll(char* data, int size)
+    {
+        while (size > 0 && this->isOpen())
+        {
+            int received = recv((SOCKET)this->handle, data, size, 0);
+            if (received == SOCKET_ERROR || received == 0)
+            {
+                this->close();
+                return false;
+            }
+            data += received;
+            size -= received;
+        }
+        return this->isOpen();
+    }
+
+}
\ No newline at end of file
@@ -0,0 +1,38 @@
+// Socket.h
+#pragma once
+
+#include "Header.h"
+
+
+namespace MyEngine {
+
+    // blocking TCP socket sending length prefixed messages
+    struct Socket
+    {
+    private:
+        size_t handle; // SOCKET
+
+    public:
+        Socket();
+        ~Socket();
+
+        bool listen(int port); // on the loopback interface
+        bool accept(Socket& client, int timeout); // timeout in milliseconds
+        bool connect(const string& host, int port);
+        void close();
+
+        bool send(const string& message);
+        bool receive(string& message);
+        bool wait(int timeout); // true if a message or the disconnection can be received
+
+        inline bool isOpen() const
+        {
+            return this->handle != ~(size_t)0; // INVALID_SOCKET
+        }
+
+    private:
+        bool sendAll(const char* data, int size);
+        bool receiveAll(char* data, int size);
+    };
+
+}
\ No newline at end of file
@@ -0,0 +1,59 @@
+// ThreadLocal.cpp
+
+#include "stdafx.h"
+#include "ThreadLocal.h"
+
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+
+
+namespace MyEngine {
+
+    struct ThreadStorageValue
+    {
+        void* value;
+        void (*free)(void*);
+    };
+
+    static void WINAPI freeThreadStorageValue(void* data)
+    {
+        ThreadStorageValue* entry = (ThreadStorageValue*)data;
+        entry->free(entry->value);
+        delete entry;
+    }
+
+    ThreadStorage::ThreadStorage()
+    {
+        this->index = FlsAlloc(freeThreadStorageValue);
+        if (this->index == FLS_OUT_OF_INDEXES)
+            throw "OutOfMemoryException: No fiber local storage index is left";
+    }
+
+    ThreadStorage::~ThreadStorage()
+    {
+        // calls the callback for the values of all the threads
+        FlsFree(this->index);
+    }
+
+    void* ThreadStorage::get() const
+    {
+        ThreadStorageValue* entry = (ThreadStorageValue*)FlsGetValue(this->index);
+        return entry ? entry->value : NULL;
+    }
+
+    void ThreadStorage::set(void* value, void (*free)(void*))
+    {
+        ThreadStorageValue* entry = (ThreadStorageValue*)FlsGetValue(this->index);
+        if (entry == NULL)
+        {
+            entry = new ThreadStorageValue();
+            FlsSetValue(this->index, entry);
+        }
+        else
+            entry->free(entry->value);
+        entry->value = value;
+        entry->free = free;
+    }
+
+}
\ No newline at end of file
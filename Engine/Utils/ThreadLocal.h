@@ -0,0 +1,44 @@
+// ThreadLocal.h
+#pragma once
+
+#include "Header.h"
+
+
+namespace MyEngine {
+
+    // pointer of the calling thread which is deleted when the thread exits (fiber local storage), for the objects
+    // a __declspec(thread) variable can't hold
+    struct ThreadStorage
+    {
+    private:
+        unsigned long index;
+
+    public:
+        ThreadStorage();
+        ~ThreadStorage();
+
+        void* get() const;
+        void set(void* value, void (*free)(void*)); // free is called with the value at the thread's exit
+    };
+
+    template <typename T>
+    struct ThreadLocal
+    {
+    private:
+        ThreadStorage storage;
+
+    public:
+        // the thread's object, created on the first call
+        inline T& get()
+        {
+            T* value = (T*)this->storage.get();
+            if (value == NULL)
+            {
+                value = new T();
+                this->storage.set(value, [](void* p) { delete (T*)p; });
+            }
+            return *value;
+        }
+    };
+
+}
\ No newline at end of file
@@ -0,0 +1,81 @@
+// AOVColors.h
+#pragma once
+
+#include "Color4.h"
+
+
+namespace MyEngine {
+
+    // render buffers (AOVs) filled by the production renderers, "Final" should be the last one
+    enum AOVType
+    {
+        EDiffuse,
+        ESpecular,
+        EDirectLight,
+        EIndirectLight,
+        ETotalLight,
+        ELighted,
+        EReflection,
+        ERefraction,
+        ESamples,
+        EDepth,
+        ENormals,
+        ENoise, // relative error of the pixel
+        EFinal,
+        AOVS_COUNT
+    };
+
+    inline const char* getAOVName(int aov)
+    {
+        static const char* names[AOVS_COUNT] = { "Diffuse", "Specular", "DirectLight", "IndirectLight", "TotalLight", "Lighted",
+            "Reflection", "Refraction", "Samples", "Depth", "Normals", "Noise", "Final" };
+        return names[aov];
+    }
+
+
+    // fixed size record with a color for every AOV, no allocations so it could be used per ray / sample
+    struct AOVColors
+    {
+        Color4 colors[AOVS_COUNT];
+
+        inline const Color4& operator[](int aov) const
+        {
+            return this->colors[aov];
+        }
+
+        inline Color4& operator[](int aov)
+        {
+            return this->colors[aov];
+        }
+
+        inline void clear()
+        {
+            memset(this->colors, 0, sizeof(this->colors));
+        }
+
+        inline void operator +=(const AOVColors& c)
+        {
+            float* dst = &this->colors[0].r;
+            const float* src = &c.colors[0].r;
+            for (int i = 0; i < AOVS_COUNT * 4; i++)
+                dst[i] += src[i];
+        }
+
+        inline void operator *=(float multiplier)
+        {
+            float* dst = &this->colors[0].r;
+            for (int i = 0; i < AOVS_COUNT * 4; i++)
+                dst[i] *= multiplier;
+        }
+
+        // this += c * multiplier
+        inline void add(const AOVColors& c, float multiplier)
+        {
+            float* dst = &this->colors[0].r;
+            const float* src = &c.colors[0].r;
+            for (int i = 0; i < AOVS_COUNT * 4; i++)
+                dst[i] += src[i] * multiplier;
+        }
+    };
+
+}
\ No newline at end of file
@@ -0,0 +1,184 @@
+// HashGrid.h
+#pragma once
+
+#include <atomic>
+#include <memory>
+#include <cmath>
+#include <cstring>
+
+#include "Vector3.h"
+#include "Color4.h"
+
+using namespace std;
+
+namespace MyEngine {
+
+    // concurrent spatial hash of cubic cells, a cell keeps the sum of the colors added in it so a lookup is a single
+    // cell read. The table is open addressed with a fixed capacity and the keys are never removed: an insert claims
+    // an empty slot with a compare and swap and adds to the sums atomically, a read doesn't wait at all. When the
+    // probed slots are full the new cell is dropped.
+    struct HashGrid
+    {
+    private:
+        struct Cell
+        {
+            atomic<unsigned long long> key; // 0 - empty
+            atomic<unsigned> count;
+            atomic<float> sum[4];
+        };
+
+        static const int MAX_PROBES = 32;
+
+        unique_ptr<Cell[]> cells;
+        unsigned capacity; // power of 2
+        float cellSize;
+        atomic<unsigned> samples;
+
+    public:
+        HashGrid()
+        {
+            this->capacity = 0;
+            this->cellSize = 1.0f;
+            this->samples = 0;
+        }
+
+        // allocates the table if the capacity changes and clears it
+        void init(unsigned capacity, float cellSize)
+        {
+            unsigned size = 1;
+            while (size < capacity)
+                size <<= 1;
+            if (size != this->capacity)
+            {
+                this->cells.reset(new Cell[size]);
+                this->capacity = size;
+            }
+            this->cellSize = cellSize;
+            this->clear();
+        }
+
+        void clear()
+        {
+            for (unsigned i = 0; i < this->capacity; i++)
+            {
+                Cell& cell = this->cells[i];
+                cell.key = 0;
+                cell.count = 0;
+                for (int c = 0; c < 4; c++)
+                    cell.sum[c] = 0.0f;
+            }
+            this->samples = 0;
+        }
+
+        inline unsigned size() const
+        {
+            return this->samples;
+        }
+
+        inline bool empty() const
+        {
+            return this->samples == 0;
+        }
+
+        // raw table for the cache files, a cell's atomics have the layout of their values
+        inline const void* data() const
+        {
+            return this->cells.get();
+        }
+
+        inline size_t dataSize() const
+        {
+            return this->capacity * sizeof(Cell);
+        }
+
+        void setData(const void* data, size_t dataSize, float cellSize, unsigned samples)
+        {
+            this->init((unsigned)(dataSize / sizeof(Cell)), cellSize);
+            memcpy((void*)this->cells.get(), data, this->dataSize());
+            this->samples = samples;
+        }
+
+        bool add(const Vector3& pos, const Color4& color)
+        {
+            Cell* cell = this->find(this->getKey(pos), true);
+            if (cell == NULL)
+                return false;
+
+            // the sums first, so a reader never divides fewer colors by the new count
+            for (int c = 0; c < 4; c++)
+            {
+                float old = cell->sum[c].load();
+                while (!cell->sum[c].compare_exchange_weak(old, old + color[c]));
+            }
+            cell->count++;
+            this->samples++;
+            return true;
+        }
+
+        // average color of the position's cell
+        bool get(const Vector3& pos, Color4& color) const
+        {
+            if (this->samples == 0)
+                return false;
+
+            const Cell* cell = this->find(this->getKey(pos), false);
+            unsigned count = cell ? cell->count.load() : 0;
+            if (count == 0)
+                return false;
+
+            float invCount = 1.0f / count;
+            for (int c = 0; c < 4; c++)
+                color[c] = cell->sum[c].load() * invCount;
+            return true;
+        }
+
+    private:
+        Cell* find(unsigned long long key, bool insert) const
+        {
+            if (this->capacity == 0)
+                return NULL;
+
+            unsigned mask = this->capacity - 1;
+            unsigned idx = hash(key) & mask;
+            for (int i = 0; i < MAX_PROBES; i++, idx = (idx + 1) & mask)
+            {
+                Cell& cell = this->cells[idx];
+                unsigned long long k = cell.key.load();
+                if (k == key)
+                    return &cell;
+                if (k == 0)
+                {
+                    if (!insert)
+                        return NULL;
+                    // another thread can take the slot first, maybe for the same cell
+                    if (cell.key.compare_exchange_strong(k, key) || k == key)
+                        return &cell;
+                }
+            }
+            return NULL;
+        }
+
+        // 21 bits per coordinate and the top bit set, so no key is 0
+        inline unsigned long long getKey(const Vector3& pos) const
+        {
+            unsigned long long key = 1ULL << 63;
+            for (int j = 0; j < 3; j++)
+            {
+                long long coord = (long long)floor(pos[j] / this->cellSize);
+                key |= ((unsigned long long)coord & 0x1fffffULL) << (21 * j);
+            }
+            return key;
+        }
+
+        static inline unsigned hash(unsigned long long x)
+        {
+            x ^= x >> 33;
+            x *= 0xff51afd7ed558ccdULL;
+            x ^= x >> 33;
+            x *= 0xc4ceb3fe1a85ec53ULL;
+            x ^= x >> 33;
+            return (unsigned)x;
+        }
+    };
+
+}
\ No newline at end of file
@@ -0,0 +1,197 @@
+// LightTree.h
+#pragma once
+
+#include <vector>
+#include <algorithm>
+
+#include "Vector3.h"
+
+using namespace std;
+
+namespace MyEngine {
+
+    // bounding volume hierarchy over the lights, a light is sampled in proportion to its estimated
+    // contribution to a point by walking down the tree (Conty & Kulla style importance)
+    struct LightTree
+    {
+    public:
+        struct LightInfo
+        {
+            Vector3 position;
+            float range; // no lighting further than this
+            float power;
+            Vector3 direction; // spot direction
+            float cutoff; // spot cone half-angle in radians, PI for omni lights
+        };
+
+    protected:
+        struct Node
+        {
+            Vector3 min, max;
+            float power;
+            float range;
+            Vector3 axis; // bound of the emission directions
+            float angle;
+            int left, right; // children, -1 in the leaves
+            int light; // light index in the leaves
+        };
+
+        vector<Node> nodes;
+
+    public:
+        inline void clear()
+        {
+            this->nodes.clear();
+        }
+
+        inline bool empty() const
+        {
+            return this->nodes.empty();
+        }
+
+        template <typename Func>
+        void build(int size, const Func& getLight)
+        {
+            this->clear();
+            if (size == 0)
+                return;
+
+            vector<LightInfo> lights(size);
+            vector<int> indices(size);
+            for (int i = 0; i < size; i++)
+            {
+                lights[i] = getLight(i);
+                indices[i] = i;
+            }
+
+            this->nodes.reserve(2 * size - 1);
+            this->build(lights, indices, 0, size);
+        }
+
+        // returns the sampled light index and its probability, -1 if no light reaches the point
+        int sample(const Vector3& pos, float u, float& pdf) const
+        {
+            pdf = 1.0f;
+            if (this->nodes.empty() || this->importance(this->nodes[0], pos) <= 0.0f)
+                return -1;
+
+            const Node* node = &this->nodes[0];
+            while (node->light == -1)
+            {
+                const Node& left = this->nodes[node->left];
+                const Node& right = this->nodes[node->right];
+                float leftImportance = this->importance(left, pos);
+                float rightImportance = this->importance(right, pos);
+                float sum = leftImportance + rightImportance;
+                if (sum <= 0.0f)
+                    return -1;
+
+                // reuse the random number for the next level
+                float p = leftImportance / sum;
+                if (u < p)
+                {
+                    u = u / p;
+                    pdf *= p;
+                    node = &left;
+                }
+                else
+                {
+                    u = min((u - p) / (1.0f - p), 0.99999f);
+                    pdf *= 1.0f - p;
+                    node = &right;
+                }
+            }
+            return node->light;
+        }
+
+    protected:
+        int build(const vector<LightInfo>& lights, vector<int>& indices, int begin, int end)
+        {
+            int index = (int)this->nodes.size();
+            this->nodes.push_back(Node());
+
+            Node node;
+            node.min = node.max = lights[indices[begin]].position;
+            node.power = 0.0f;
+            node.range = 0.0f;
+            node.axis = Vector3();
+            node.angle = 0.0f;
+            node.left = node.right = -1;
+            node.light = -1;
+            for (int i = begin; i < end; i++)
+            {
+                const LightInfo& light = lights[indices[i]];
+                for (int j = 0; j < 3; j++)
+                {
+                    node.min[j] = min(node.min[j], light.position[j]);
+                    node.max[j] = max(node.max[j], light.position[j]);
+                }
+                node.power += light.power;
+                node.range = max(node.range, light.range);
+                node.axis += light.direction * light.power;
+            }
+
+            // emission cone, the average direction widened to cover every light's cone
+            if (node.axis.length() > 0.0001f)
+                node.axis.normalize();
+            else
+                node.axis = lights[indices[begin]].direction;
+            for (int i = begin; i < end; i++)
+            {
+                const LightInfo& light = lights[indices[i]];
+                float angle = acos(min(max(dot(node.axis, light.direction), -1.0f), 1.0f));
+                node.angle = min(max(node.angle, angle + light.cutoff), PI);
+            }
+
+            if (end - begin == 1)
+                node.light = indices[begin];
+            else
+            {
+                // split in the middle of the longest axis
+                Vector3 size = node.max - node.min;
+                int axis = size.x > size.y ? (size.x > size.z ? 0 : 2) : (size.y > size.z ? 1 : 2);
+                int middle = (begin + end) / 2;
+                nth_element(indices.begin() + begin, indices.begin() + middle, indices.begin() + end,
+                    [&](int a, int b) { return lights[a].position[axis] < lights[b].position[axis]; });
+
+                node.left = this->build(lights, indices, begin, middle);
+                node.right = this->build(lights, indices, middle, end);
+            }
+
+            this->nodes[index] = node;
+            return index;
+        }
+
+        float importance(const Node& node, const Vector3& pos) const
+        {
+            if (node.power <= 0.0f)
+                return 0.0f;
+
+            // out of range
+            Vector3 closest;
+            for (int j = 0; j < 3; j++)
+                closest[j] = min(max(pos[j], node.min[j]), node.max[j]);
+            if ((pos - closest).length() > node.range)
+                return 0.0f;
+
+            Vector3 center = (node.min + node.max) * 0.5f;
+            Vector3 dir = pos - center;
+            float dist = dir.length();
+            float radius = (node.max - node.min).length() * 0.5f;
+
+            // outside of the emission cone
+            if (node.angle < PI && dist > radius)
+            {
+                dir *= 1.0f / dist;
+                float angle = acos(min(max(dot(node.axis, dir), -1.0f), 1.0f));
+                float boundAngle = asin(radius / dist);
+                if (angle - node.angle - boundAngle > 0.0f)
+                    return 0.0f;
+            }
+
+            float distSqr = max(dist * dist, max(radius * radius, 1.0f));
+            return node.power / distSqr;
+        }
+    };
+
+}
\ No newline at end of file
@@ -2,7 +2,7 @@
 #pragma once
 
 #include <vector>
-#include <random>
+#include <cmath>
 
 
 namespace MyEngine {
@@ -10,7 +10,7 @@ namespace MyEngine {
     struct Random
     {
     private:
-        std::mt19937 generator; // mersenne twister generator
+        unsigned long long state, inc; // pcg32 generator
 
     public:
         Random(unsigned seed = 123u)
@@ -20,28 +20,33 @@ namespace MyEngine {
 
         inline void seed(unsigned seed)
         {
-            generator.seed(seed);
+            this->state = 0u;
+            this->inc = ((unsigned long long)seed << 1u) | 1u;
+            this->_next();
+            this->state += 0x853c49e6748fea9bULL + seed;
+            this->_next();
         }
 
         // returns a raw 32-bit unbiased random integer
         inline unsigned _next(void) 
         {
-            std::uniform_int_distribution<unsigned> gen;
-            return gen(generator);
+            unsigned long long old = this->state;
+            this->state = old * 6364136223846793005ULL + this->inc;
+            unsigned xorshifted = (unsigned)(((old >> 18u) ^ old) >> 27u);
+            unsigned rot = (unsigned)(old >> 59u);
+            return (xorshifted >> rot) | (xorshifted << ((32u - rot) & 31u));
         }
 
         // returns a random integer in [a..b] (a and b can be negative as well)
         inline int randInt(int a, int b)
         {
-            std::uniform_int_distribution<int> gen(a, b);
-            return gen(generator);
+            return a + (int)(this->_next() % (unsigned)(b - a + 1));
         }
 
         // return a floating-point number in [0..1)
         inline float randFloat(void)
         {
-            std::uniform_real_distribution<float> gen;
-            return gen(generator);
+            return (this->_next() >> 8) * (1.0f / 16777216.0f);
         }
 
         inline float randSample(int samples)
@@ -63,8 +68,10 @@ namespace MyEngine {
         // return a random number in normal distribution
         inline double gaussian(double mean = 0.0, double sigma = 1.0)
         {
-            std::normal_distribution<double> gen(mean, sigma);
-            return gen(generator);
+            // Box-Muller transform
+            double u = 1.0 - this->_next() * (1.0 / 4294967296.0);
+            double v = this->_next() * (1.0 / 4294967296.0);
+            return mean + sigma * sqrt(-2.0 * log(u)) * cos(2.0 * 3.14159265358979 * v);
         }
 
         // get a random point in the unit disc (x*x + y*y <= 1)
@@ -83,6 +90,9 @@ namespace MyEngine {
         static const int RGENS = 257; // 257 is a prime number
         static pair<unsigned, Random> rg_table[RGENS];
         static function<int()> threadIdFunc;
+        static unsigned tableVersion; // incremented by initRandom so the threads fetch their generator again
+        static __declspec(thread) Random* threadGen;
+        static __declspec(thread) unsigned threadGenVersion;
 
     public:
         // seed the whole array of random generators.
@@ -108,6 +118,7 @@ namespace MyEngine {
             }
 
             threadIdFunc = _threadIdFunc;
+            tableVersion++;
         }
 
         // fetch the idx-th random generator. There are at least 250 random generators, which are prepared and ready.
@@ -137,9 +148,15 @@ namespace MyEngine {
         // fetch a fixed random generator, based on the calling thread's ID. I.e., within each thread, all calls to getRandomGen()
         // are guaranteed to return the same object; in the same time, different threads get different random generators
         // thus no locking is required, and no performance degradation can occur.
+        // The generator is looked up once per thread and kept in a thread local pointer.
         static inline Random& getRandomGen(void)
         {
-            return getRandomGen(threadIdFunc());
+            if (threadGenVersion != tableVersion)
+            {
+                threadGen = &getRandomGen(threadIdFunc());
+                threadGenVersion = tableVersion;
+            }
+            return *threadGen;
         }
 
     };
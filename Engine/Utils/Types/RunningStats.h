@@ -0,0 +1,64 @@
+// RunningStats.h
+#pragma once
+
+#include <cmath>
+
+
+namespace MyEngine {
+
+    // running mean and variance of the samples (Welford's algorithm)
+    struct RunningStats
+    {
+        unsigned count;
+        float mean;
+        float m2; // sum of the squared differences from the mean
+
+        RunningStats()
+        {
+            this->clear();
+        }
+
+        inline void clear()
+        {
+            this->count = 0;
+            this->mean = 0.0f;
+            this->m2 = 0.0f;
+        }
+
+        inline void add(float x)
+        {
+            this->count++;
+            float delta = x - this->mean;
+            this->mean += delta / this->count;
+            this->m2 += delta * (x - this->mean);
+        }
+
+        // combine with the stats of other samples (Chan et al.)
+        inline void merge(const RunningStats& s)
+        {
+            if (s.count == 0)
+                return;
+
+            unsigned count = this->count + s.count;
+            float delta = s.mean - this->mean;
+            this->mean += delta * s.count / count;
+            this->m2 += s.m2 + delta * delta * ((float)this->count * s.count / count);
+            this->count = count;
+        }
+
+        inline float variance() const
+        {
+            return this->count > 1 ? this->m2 / (this->count - 1) : 0.0f;
+        }
+
+        // standard error of the mean relative to the mean, the mean is clamped to minMean so the dark samples
+        // don't need an absolute precision
+        inline float relativeError(float minMean) const
+        {
+            if (this->count < 2)
+                return INFINITY;
+            return sqrt(this->variance() / this->count) / (this->mean > minMean ? this->mean : minMean);
+        }
+    };
+
+}
\ No newline at end of file
@@ -0,0 +1,164 @@
+// Sampler.h
+#pragma once
+
+#include "Random.h"
+
+
+namespace MyEngine {
+
+    enum SamplerType
+    {
+        ERandomSampler,
+        ESobolSampler
+    };
+
+    // source of the sample values of the calling thread: start() selects the pixel and the sample and every next()
+    // returns the following dimension. ESobolSampler gives a shuffled Owen scrambled Sobol sequence (Burley 2020)
+    // seeded per pixel, so the pixels are decorrelated, ERandomSampler takes the values from the thread's Random.
+    struct Sampler
+    {
+    private:
+        SamplerType type;
+        unsigned seed; // pixel's scramble seed
+        unsigned index; // sample index in the pixel
+        unsigned dimension;
+
+        static const int SOBOL_DIMENSIONS = 4; // the dimensions are padded in groups of 4 with their own shuffle
+        static unsigned directions[SOBOL_DIMENSIONS][32];
+        static __declspec(thread) Sampler current;
+
+    public:
+        inline void start(SamplerType type, int x, int y, unsigned sample, unsigned dimension = 0)
+        {
+            this->type = type;
+            this->seed = hash((unsigned)x * 0x8da6b343u ^ (unsigned)y * 0xd8163841u);
+            this->index = sample;
+            this->dimension = dimension;
+        }
+
+        // returns a number in [0..1)
+        inline float next()
+        {
+            unsigned dim = this->dimension++;
+            if (this->type == SamplerType::ERandomSampler)
+                return Random::getRandomGen().randFloat();
+
+            unsigned groupSeed = hashCombine(this->seed, dim / SOBOL_DIMENSIONS);
+            unsigned i = nestedUniformScramble(this->index, groupSeed);
+            unsigned x = nestedUniformScramble(sobol(i, dim % SOBOL_DIMENSIONS), hashCombine(groupSeed, dim % SOBOL_DIMENSIONS));
+            return (x >> 8) * (1.0f / 16777216.0f);
+        }
+
+        inline void next2D(float& u, float& v)
+        {
+            // keep the pair in the same group so the two values are stratified together
+            if (this->dimension % 2 == 1)
+                this->dimension++;
+            u = this->next();
+            v = this->next();
+        }
+
+        // stratified in numSamples strata
+        inline float nextSample(int numSamples, int sample)
+        {
+            if (numSamples > 0)
+                return (sample % numSamples + this->next()) / numSamples;
+            else
+                return this->next();
+        }
+
+        // a point in the unit disc (x*x + y*y <= 1)
+        inline void unitDiscSample(float& x, float& y)
+        {
+            float u, v;
+            this->next2D(u, v);
+            float angle = u * 2.0f * 3.14159265359f;
+            float rad = sqrt(v);
+            x = sinf(angle) * rad;
+            y = cosf(angle) * rad;
+        }
+
+        // the calling thread's sampler
+        static inline Sampler& getSampler()
+        {
+            return current;
+        }
+
+        // generator matrices of the first Sobol dimensions (Joe & Kuo direction numbers)
+        static void initSobol()
+        {
+            static const unsigned s[SOBOL_DIMENSIONS] = { 0, 1, 2, 3 };
+            static const unsigned a[SOBOL_DIMENSIONS] = { 0, 0, 1, 1 };
+            static const unsigned m[SOBOL_DIMENSIONS][3] = { { 0, 0, 0 }, { 1, 0, 0 }, { 1, 3, 0 }, { 1, 3, 1 } };
+
+            for (int i = 0; i < 32; i++)
+                directions[0][i] = 1u << (31 - i); // van der Corput
+
+            for (int d = 1; d < SOBOL_DIMENSIONS; d++)
+            {
+                for (unsigned i = 0; i < 32; i++)
+                {
+                    if (i < s[d])
+                        directions[d][i] = m[d][i] << (31 - i);
+                    else
+                    {
+                        unsigned v = directions[d][i - s[d]];
+                        v ^= v >> s[d];
+                        for (unsigned k = 1; k < s[d]; k++)
+                            v ^= ((a[d] >> (s[d] - 1 - k)) & 1) * directions[d][i - k];
+                        directions[d][i] = v;
+                    }
+                }
+            }
+        }
+
+    private:
+        static inline unsigned sobol(unsigned index, unsigned dim)
+        {
+            unsigned x = 0;
+            for (int bit = 0; index != 0; bit++, index >>= 1)
+            {
+                if (index & 1)
+                    x ^= directions[dim][bit];
+            }
+            return x;
+        }
+
+        static inline unsigned reverseBits(unsigned x)
+        {
+            x = ((x >> 1) & 0x55555555u) | ((x & 0x55555555u) << 1);
+            x = ((x >> 2) & 0x33333333u) | ((x & 0x33333333u) << 2);
+            x = ((x >> 4) & 0x0f0f0f0fu) | ((x & 0x0f0f0f0fu) << 4);
+            x = ((x >> 8) & 0x00ff00ffu) | ((x & 0x00ff00ffu) << 8);
+            return (x >> 16) | (x << 16);
+        }
+
+        // Laine-Karras style permutation, an Owen scramble when applied to the reversed bits
+        static inline unsigned nestedUniformScramble(unsigned x, unsigned seed)
+        {
+            x = reverseBits(x);
+            x += seed;
+            x ^= x * 0x6c50b47cu;
+            x ^= x * 0xb82f1e52u;
+            x ^= x * 0xc7afe638u;
+            x ^= x * 0x8d22f6e6u;
+            return reverseBits(x);
+        }
+
+        static inline unsigned hash(unsigned x)
+        {
+            x ^= x >> 16;
+            x *= 0x7feb352du;
+            x ^= x >> 15;
+            x *= 0x846ca68bu;
+            x ^= x >> 16;
+            return x;
+        }
+
+        static inline unsigned hashCombine(unsigned seed, unsigned v)
+        {
+            return seed ^ (hash(v) + (seed << 6) + (seed >> 2));
+        }
+    };
+
+}
\ No newline at end of file
@@ -0,0 +1,252 @@
+// TileScheduler.h
+#pragma once
+
+#include <vector>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <thread>
+#include <algorithm>
+
+using namespace std;
+
+namespace MyEngine {
+
+    // work stealing scheduler of the image tiles. The tiles are ordered along a Morton curve and dealt to the workers
+    // in runs of about the same estimated cost, a worker takes its tiles from the front of its deque so the tiles it
+    // renders one after another are neighbors, an idle worker steals from the back of the deque with the most cost
+    // left. When there are fewer tiles left than workers the stolen tiles are split in quarters, so the last tiles of
+    // the frame don't keep a single worker busy.
+    struct TileScheduler
+    {
+    public:
+        struct Tile
+        {
+            int x, y, w, h;
+            int index; // of the tile it was split from
+            float cost; // estimated
+        };
+
+    private:
+        struct Worker
+        {
+            mutex mtx;
+            deque<Tile> tiles;
+            atomic_int count; // of the tiles, read by the thieves without the lock
+            atomic<float> cost; // of the tiles left
+            Tile active;
+            bool busy;
+        };
+
+        static const int MIN_SPLIT_SIZE = 8; // the tiles smaller than twice it aren't split
+
+        vector<unique_ptr<Worker>> workers;
+        atomic_int tilesLeft; // in the deques or about to be pushed to them
+        bool split;
+
+    public:
+        TileScheduler()
+        {
+            this->tilesLeft = 0;
+            this->split = false;
+        }
+
+        // not thread safe, the workers must not take tiles while it's called. A tile with no cost estimate is
+        // estimated by its area if no tile has one, cellSize is the size of the tiles' grid for the Morton order
+        void init(int workersCount, vector<Tile> tiles, int cellSize, bool split)
+        {
+            if ((int)this->workers.size() != workersCount)
+            {
+                this->workers.clear();
+                for (int i = 0; i < workersCount; i++)
+                    this->workers.push_back(unique_ptr<Worker>(new Worker()));
+            }
+            for (auto& worker : this->workers)
+            {
+                worker->tiles.clear();
+                worker->count = 0;
+                worker->cost = 0.0f;
+                worker->busy = false;
+            }
+            this->split = split;
+            this->tilesLeft = (int)tiles.size();
+            if (tiles.empty() || this->workers.empty())
+                return;
+
+            cellSize = max(cellSize, 1);
+            sort(tiles.begin(), tiles.end(), [&](const Tile& a, const Tile& b) -> bool
+            {
+                return morton(a.x / cellSize, a.y / cellSize) < morton(b.x / cellSize, b.y / cellSize);
+            });
+
+            float totalCost = 0.0f;
+            for (const auto& tile : tiles)
+                totalCost += tile.cost;
+            if (totalCost <= 0.0f)
+            {
+                for (auto& tile : tiles)
+                {
+                    tile.cost = (float)(tile.w * tile.h);
+                    totalCost += tile.cost;
+                }
+            }
+
+            // the tile goes to the worker of its cost's middle on the curve
+            float cost = 0.0f;
+            for (const auto& tile : tiles)
+            {
+                int i = min((int)((cost + tile.cost * 0.5f) / totalCost * this->workers.size()), (int)this->workers.size() - 1);
+                Worker& worker = *this->workers[i];
+                worker.tiles.push_back(tile);
+                worker.count++;
+                worker.cost = worker.cost + tile.cost;
+                cost += tile.cost;
+            }
+        }
+
+        // the next tile of the worker, false if all the tiles are taken
+        bool pop(int worker, Tile& tile)
+        {
+            Worker& own = *this->workers[worker];
+            {
+                lock_guard<mutex> lck(own.mtx);
+                if (!own.tiles.empty())
+                {
+                    tile = own.tiles.front();
+                    own.tiles.pop_front();
+                    own.count--;
+                    own.cost = own.cost - tile.cost;
+                    own.active = tile;
+                    own.busy = true;
+                    this->tilesLeft--;
+                    return true;
+                }
+            }
+
+            vector<Tile> pieces;
+            if (!this->steal(tile, pieces))
+                return false;
+
+            lock_guard<mutex> lck(own.mtx);
+            for (const auto& piece : pieces)
+            {
+                own.tiles.push_back(piece);
+                own.count++;
+                own.cost = own.cost + piece.cost;
+            }
+            own.active = tile;
+            own.busy = true;
+            return true;
+        }
+
+        // the worker is done with its tile, returns it
+        Tile finish(int worker)
+        {
+            Worker& own = *this->workers[worker];
+            lock_guard<mutex> lck(own.mtx);
+            own.busy = false;
+            return own.active;
+        }
+
+        // puts the worker's tile back to the front of its deque, e.g. when its render node is lost
+        void requeue(int worker)
+        {
+            Worker& own = *this->workers[worker];
+            lock_guard<mutex> lck(own.mtx);
+            if (!own.busy)
+                return;
+
+            own.tiles.push_front(own.active);
+            own.count++;
+            own.cost = own.cost + own.active.cost;
+            own.busy = false;
+            this->tilesLeft++;
+        }
+
+        inline bool hasTiles() const
+        {
+            return this->tilesLeft > 0;
+        }
+
+        vector<Tile> getActive()
+        {
+            vector<Tile> result;
+            for (auto& worker : this->workers)
+            {
+                lock_guard<mutex> lck(worker->mtx);
+                if (worker->busy)
+                    result.push_back(worker->active);
+            }
+            return result;
+        }
+
+    private:
+        bool steal(Tile& tile, vector<Tile>& pieces)
+        {
+            while (this->tilesLeft > 0)
+            {
+                // the deques are read without their locks, it's only a hint
+                Worker* victim = NULL;
+                for (auto& worker : this->workers)
+                {
+                    if (worker->count > 0 && (victim == NULL || worker->cost > victim->cost))
+                        victim = worker.get();
+                }
+                if (victim == NULL)
+                {
+                    // another thief is splitting its tile
+                    this_thread::yield();
+                    continue;
+                }
+
+                lock_guard<mutex> lck(victim->mtx);
+                if (victim->tiles.empty())
+                    continue;
+
+                tile = victim->tiles.back();
+                victim->tiles.pop_back();
+                victim->count--;
+                victim->cost = victim->cost - tile.cost;
+                if (this->split && this->tilesLeft <= (int)this->workers.size() &&
+                    tile.w >= 2 * MIN_SPLIT_SIZE && tile.h >= 2 * MIN_SPLIT_SIZE)
+                {
+                    // counted before the victim is unlocked so the other thieves wait for the pieces
+                    this->tilesLeft += 3;
+                    int w = tile.w / 2;
+                    int h = tile.h / 2;
+                    tile.cost *= 0.25f;
+                    Tile piece = tile;
+                    piece.x = tile.x + w; piece.y = tile.y;     piece.w = tile.w - w; piece.h = h;
+                    pieces.push_back(piece);
+                    piece.x = tile.x;     piece.y = tile.y + h; piece.w = w;          piece.h = tile.h - h;
+                    pieces.push_back(piece);
+                    piece.x = tile.x + w; piece.y = tile.y + h; piece.w = tile.w - w; piece.h = tile.h - h;
+                    pieces.push_back(piece);
+                    tile.w = w;
+                    tile.h = h;
+                }
+                this->tilesLeft--;
+                return true;
+            }
+            return false;
+        }
+
+        // interleaved bits of the coordinates
+        static inline unsigned morton(unsigned x, unsigned y)
+        {
+            return spreadBits(x) | (spreadBits(y) << 1);
+        }
+
+        static inline unsigned spreadBits(unsigned x)
+        {
+            x &= 0xffff;
+            x = (x | (x << 8)) & 0x00ff00ffu;
+            x = (x | (x << 4)) & 0x0f0f0f0fu;
+            x = (x | (x << 2)) & 0x33333333u;
+            x = (x | (x << 1)) & 0x55555555u;
+            return x;
+        }
+    };
+
+}
\ No newline at end of file
@@ -3,6 +3,7 @@
 
 #include <vector>
 #include <string>
+#include <intrin.h>
 
 namespace MyEngine {
 
@@ -43,4 +44,16 @@ namespace MyEngine {
 		return fileName.str();
 	}
 
+	// AVX needs both the cpu support and the OS saving the ymm registers
+	inline bool cpuSupportsAVX()
+	{
+		int info[4];
+		__cpuid(info, 1);
+		bool osxsave = (info[2] & (1 << 27)) != 0;
+		bool avx = (info[2] & (1 << 28)) != 0;
+		if (!osxsave || !avx)
+			return false;
+		return (_xgetbv(0) & 0x6) == 0x6;
+	}
+
 }
\ No newline at end of file
@@ -5,6 +5,7 @@ using System.Data;
 using System.Linq;
 using System.Threading.Tasks;
 using System.Windows;
+using MyEngine;
 
 namespace MCS
 {
@@ -13,5 +14,24 @@ namespace MCS
     /// </summary>
     public partial class App : Application
     {
+        protected override void OnStartup(StartupEventArgs e)
+        {
+            base.OnStartup(e);
+
+            // a render node process: -rendernode host port rendererType, renders the regions of the coordinator and exits
+            if (e.Args.Length == 4 && e.Args[0] == "-rendernode")
+            {
+                MEngine.Mode = EEngineMode.Engine;
+                using (MEngine engine = new MEngine())
+                {
+                    engine.SetProductionRenderer((ERendererType)int.Parse(e.Args[3]));
+                    engine.ProductionRenderer.RunRenderNode(e.Args[1], int.Parse(e.Args[2]));
+                }
+                this.Shutdown();
+                return;
+            }
+
+            new MainWindow().Show();
+        }
     }
 }
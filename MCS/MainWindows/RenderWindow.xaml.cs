@@ -143,18 +143,7 @@ namespace MCS.MainWindows
                 return new DelegateCommand((o) =>
                 {
                     if (!this.engine.ProductionRenderer.IsStarted)
-                    {
-                        if (RenderWindow.renderSettings.Animation)
-                        {
-                            ScriptWindow.StartScript(this.engine);
-                            System.Threading.Thread.Sleep(100);
-                            this.engine.AnimationManager.MoveTime(RenderWindow.renderSettings.AnimationStartTime);
-                        }
-
-                        this.engine.ProductionRenderer.Init(this.RenderSettings);
-                        this.engine.ProductionRenderer.Start();
-                        this.timer.Start();
-                    }
+                        this.startRender(false);
                     else
                     {
                         this.engine.ProductionRenderer.Stop();
@@ -174,6 +163,40 @@ namespace MCS.MainWindows
             get { return "Render " + WindowsManager.GetHotkey(this.GetType(), "RenderCommand", true); }
         }
 
+        public ICommand ResumeCommand
+        {
+            get
+            {
+                return new DelegateCommand((o) =>
+                {
+                    // continues the checkpoint of the interrupted render with the same scene and settings
+                    if (!this.engine.ProductionRenderer.IsStarted)
+                        this.startRender(true);
+                });
+            }
+        }
+        public string ResumeCommandTooltip
+        {
+            get { return "Resume " + WindowsManager.GetHotkey(this.GetType(), "ResumeCommand", true); }
+        }
+
+        public ICommand FinishProgressiveCommand
+        {
+            get
+            {
+                return new DelegateCommand((o) =>
+                {
+                    // the current iteration is finished and post-processed
+                    if (this.engine.ProductionRenderer.IsStarted && RenderWindow.renderSettings.Progressive)
+                        this.engine.ProductionRenderer.FinishProgressive();
+                });
+            }
+        }
+        public string FinishProgressiveCommandTooltip
+        {
+            get { return "Finish Progressive " + WindowsManager.GetHotkey(this.GetType(), "FinishProgressiveCommand", true); }
+        }
+
         public ICommand SaveBufferCommand
         {
             get
@@ -202,9 +225,11 @@ namespace MCS.MainWindows
             RenderWindow.renderSettings.Preview = true;
             RenderWindow.renderSettings.MinSamples = 1;
             RenderWindow.renderSettings.MaxSamples = 4;
-            RenderWindow.renderSettings.SampleThreshold = 0.01;
+            RenderWindow.renderSettings.SampleThreshold = 0.05;
+            RenderWindow.renderSettings.Sampling = ESamplerType.Sobol;
             RenderWindow.renderSettings.MaxLights = 8;
             RenderWindow.renderSettings.MaxDepth = 4;
+            RenderWindow.renderSettings.RouletteDepth = 2;
             RenderWindow.renderSettings.GI = true;
             RenderWindow.renderSettings.GISamples = 4;
             RenderWindow.renderSettings.IrradianceMap = true;
@@ -214,11 +239,21 @@ namespace MCS.MainWindows
             RenderWindow.renderSettings.IrradianceMapColorThreshold = 0.3f;         // 0.3 high // 0.4 medium low
             RenderWindow.renderSettings.LightCache = true;
             RenderWindow.renderSettings.LightCacheSampleSize = 0.1;
+            RenderWindow.renderSettings.GICache = false;
             RenderWindow.renderSettings.Animation = false;
             RenderWindow.renderSettings.AnimationFPS = 30;
             RenderWindow.renderSettings.AnimationResetCaches = false;
             RenderWindow.renderSettings.AnimationStartTime = 0.0;
             RenderWindow.renderSettings.AnimationEndTime = 0.0;
+            RenderWindow.renderSettings.Progressive = false;
+            RenderWindow.renderSettings.ProgressiveTime = 0.0;
+            RenderWindow.renderSettings.ProgressiveNoise = 0.01;
+            RenderWindow.renderSettings.RenderNodes = 0;
+            RenderWindow.renderSettings.CheckpointTime = 0.0;
+            RenderWindow.renderSettings.ToneMapping = false;
+            RenderWindow.renderSettings.SRGB = false;
+            RenderWindow.renderSettings.Bloom = 0.0;
+            RenderWindow.renderSettings.Denoise = false;
         }
 
         public RenderWindow(MEngine engine)
@@ -231,7 +266,7 @@ namespace MCS.MainWindows
             this.DataContext = this;
             this.engine = engine;
 
-            this.SelectedRendererType = this.RendererTypes[0];
+            this.SelectedRendererType = this.engine.ProductionRenderer.Type;
             this.SelectedBufferName = this.BuffersNames[this.BuffersNames.Count - 1];
             
             this.timer = new DispatcherTimer();
@@ -243,6 +278,26 @@ namespace MCS.MainWindows
             this.KeyDown += RenderWindow_KeyDown;
         }
 
+        private void startRender(bool resume)
+        {
+            if (RenderWindow.renderSettings.Animation)
+            {
+                ScriptWindow.StartScript(this.engine);
+                System.Threading.Thread.Sleep(100);
+                this.engine.AnimationManager.MoveTime(RenderWindow.renderSettings.AnimationStartTime);
+            }
+
+            this.engine.SetProductionRenderer(this.SelectedRendererType);
+            this.engine.ProductionRenderer.Init(this.RenderSettings);
+            if (RenderWindow.renderSettings.Animation) // the engine renders the frames and saves them
+                this.engine.ProductionRenderer.StartSequence(RenderWindow.renderSettings.AnimationFPS, RenderWindow.renderSettings.AnimationEndTime, "ScreenShots\\" + this.getSceneName());
+            else if (resume)
+                this.engine.ProductionRenderer.Resume();
+            else
+                this.engine.ProductionRenderer.Start();
+            this.timer.Start();
+        }
+
         private void Window_Closing(object sender, CancelEventArgs e)
         {
             this.timer.Stop();
@@ -267,33 +322,12 @@ namespace MCS.MainWindows
 
             if (!this.engine.ProductionRenderer.IsStarted)
             {
-                if (RenderWindow.renderSettings.Animation)
+                this.timer.Stop();
+                if (RenderWindow.renderSettings.Animation) // the sequence is done
                 {
-                    this.saveBufferToFile(BuffersNames[BuffersNames.Count - 1], true); // save last buffer to file incrementally
-
-                    this.engine.AnimationManager.MoveTime(1.0 / RenderWindow.renderSettings.AnimationFPS);
-                    if (RenderWindow.renderSettings.AnimationEndTime != 0.0 &&
-                        this.engine.AnimationManager.GetTime() > RenderWindow.renderSettings.AnimationEndTime) // stop if end time is set and we reached it
-                    {
-                        this.timer.Stop();
-                        this.engine.AnimationManager.ResetTime();
-                        ScriptWindow.StopScript();
-                    }
-                    else
-                    {
-                        double time = this.engine.AnimationManager.GetTime();
-                        if ((time - Math.Truncate(time)) < 1.0 / (RenderWindow.renderSettings.AnimationFPS + 1))
-                            RenderWindow.renderSettings.Preview = true;
-                        else
-                            RenderWindow.renderSettings.Preview = false;
-                        this.OnPropertyChanged("RenderSettings");
-
-                        this.engine.ProductionRenderer.Init(this.RenderSettings);
-                        this.engine.ProductionRenderer.Start();
-                    }
+                    this.engine.AnimationManager.ResetTime();
+                    ScriptWindow.StopScript();
                 }
-                else
-                    this.timer.Stop();
             }
         }
 
@@ -355,15 +389,21 @@ namespace MCS.MainWindows
         }
 
 
-        private void saveBufferToFile(string bufferName, bool incremental)
+        private string getSceneName()
         {
             MainWindow mainWindow = this.Owner as MainWindow;
-            if (mainWindow == null)
-                return;
-
-            string sceneName = Path.GetFileNameWithoutExtension(mainWindow.SceneFilePath);
+            string sceneName = mainWindow != null ? Path.GetFileNameWithoutExtension(mainWindow.SceneFilePath) : null;
             if (string.IsNullOrEmpty(sceneName))
                 sceneName = "Scene";
+            return sceneName;
+        }
+
+        private void saveBufferToFile(string bufferName, bool incremental)
+        {
+            if (!(this.Owner is MainWindow))
+                return;
+
+            string sceneName = this.getSceneName();
 
             System.Drawing.Bitmap bmp = this.engine.ProductionRenderer.GetBuffer(bufferName);
             if (bmp == null)
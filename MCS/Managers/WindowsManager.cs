@@ -156,6 +156,8 @@ namespace MCS.Managers
             // RenderWindow
             keys = new List<HotKeyInfo>();
             keys.Add(new HotKeyInfo(Key.F9, false, false, false, "", "RenderCommand"));
+            keys.Add(new HotKeyInfo(Key.F9, true, false, false, "", "ResumeCommand"));
+            keys.Add(new HotKeyInfo(Key.F9, false, false, true, "", "FinishProgressiveCommand"));
             keys.Add(new HotKeyInfo(Key.F11, false, false, false, "", "SaveBufferCommand"));
             keys.Add(new HotKeyInfo(Key.F11, true, false, false, "", "SaveBufferCommand"));
             hotkeys.Add(typeof(RenderWindow), keys);
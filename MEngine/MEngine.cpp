@@ -95,6 +95,13 @@ namespace MyEngine {
         this->IsStarted = false;
     }
 
+    void MEngine::SetProductionRenderer(ERendererType type)
+    {
+        delete this->ProductionRenderer;
+        this->engine->SetProductionRenderer((RendererType)type);
+        this->ProductionRenderer = gcnew MProductionRenderer(this->engine->ProductionRenderer.get());
+    }
+
 
 	void MEngine::Log(ELogType type, String^ category, String^ text)
 	{
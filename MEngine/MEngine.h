@@ -69,6 +69,7 @@ namespace MyEngine {
 
         void Start();
         void Stop();
+        void SetProductionRenderer(ERendererType type);
 
 		static void Log(ELogType type, String^ category, String^ text);
 
@@ -10,6 +10,12 @@
 using namespace System::Drawing;
 
 namespace MyEngine {
+
+    public enum class ESamplerType
+    {
+        Random,
+        Sobol
+    };
     
     public ref class MProductionRenderer : MRenderer
     {
@@ -20,6 +26,7 @@ namespace MyEngine {
         }
 
         Bitmap^ buffer;
+        double exposure;
 
 	public:
         ref struct MRenderSettings
@@ -41,10 +48,14 @@ namespace MyEngine {
             property uint MaxSamples;
             [MPropertyAttribute(SortName = "03", Group = "02. Samples Settings")]
             property double SampleThreshold;
+            [MPropertyAttribute(SortName = "04", Group = "02. Samples Settings")]
+            property ESamplerType Sampling;
             [MPropertyAttribute(SortName = "01", Group = "03. Limits")]
             property uint MaxLights;
             [MPropertyAttribute(SortName = "02", Group = "03. Limits")]
             property uint MaxDepth;
+            [MPropertyAttribute(SortName = "03", Group = "03. Limits")]
+            property uint RouletteDepth;
             [MPropertyAttribute(SortName = "01", Group = "04. Global Illumination")]
             property bool GI;
             [MPropertyAttribute(SortName = "02", Group = "04. Global Illumination", Name = "Samples")]
@@ -63,6 +74,8 @@ namespace MyEngine {
             property bool LightCache;
             [MPropertyAttribute(SortName = "09", Group = "04. Global Illumination", Name = "SampleSize")]
             property double LightCacheSampleSize;
+            [MPropertyAttribute(SortName = "10", Group = "04. Global Illumination", Name = "CacheFile")]
+            property bool GICache;
             [MPropertyAttribute(SortName = "01", Group = "05. Animation")]
             property bool Animation;
             [MPropertyAttribute(SortName = "02", Group = "05. Animation", Name = "FPS")]
@@ -73,6 +86,24 @@ namespace MyEngine {
             property double AnimationStartTime;
             [MPropertyAttribute(SortName = "05", Group = "05. Animation", Name = "EndTime")]
             property double AnimationEndTime;
+            [MPropertyAttribute(SortName = "01", Group = "06. Progressive")]
+            property bool Progressive;
+            [MPropertyAttribute(SortName = "02", Group = "06. Progressive", Name = "Time")]
+            property double ProgressiveTime;
+            [MPropertyAttribute(SortName = "03", Group = "06. Progressive", Name = "Noise")]
+            property double ProgressiveNoise;
+            [MPropertyAttribute(SortName = "01", Group = "08. Render Nodes", Name = "Processes")]
+            property uint RenderNodes;
+            [MPropertyAttribute(SortName = "01", Group = "09. Checkpoints", Name = "Time")]
+            property double CheckpointTime;
+            [MPropertyAttribute(SortName = "01", Group = "07. Post-processing")]
+            property bool ToneMapping;
+            [MPropertyAttribute(SortName = "02", Group = "07. Post-processing", Name = "sRGB")]
+            property bool SRGB;
+            [MPropertyAttribute(SortName = "03", Group = "07. Post-processing")]
+            property double Bloom;
+            [MPropertyAttribute(SortName = "04", Group = "07. Post-processing")]
+            property bool Denoise;
         };
 
         property bool IsStarted
@@ -80,7 +111,19 @@ namespace MyEngine {
             bool get() { return this->Renderer->IsStarted; }
         }
 
-        property double Exposure;
+        property double Exposure
+        {
+            double get() { return this->exposure; }
+            void set(double value)
+            {
+                this->exposure = value;
+                if (this->Type == ERendererType::CPURayRenderer || this->Type == ERendererType::WavefrontRenderer)
+                {
+                    ((CPURayRenderer*)this->Renderer)->Exposure = (float)value;
+                    ((CPURayRenderer*)this->Renderer)->UpdateDisplay();
+                }
+            }
+        }
 
         property List<String^>^ BuffersNames
         {
@@ -130,7 +173,7 @@ namespace MyEngine {
 
         void Init(MRenderSettings^ settings)
         {
-            if (this->Type == ERendererType::CPURayRenderer)
+            if (this->Type == ERendererType::CPURayRenderer || this->Type == ERendererType::WavefrontRenderer) // WavefrontRenderer has the same settings
             {
                 CPURayRenderer* rayRenderer = (CPURayRenderer*)this->Renderer;
                 rayRenderer->RegionSize = settings->RegionSize;
@@ -139,8 +182,10 @@ namespace MyEngine {
                 rayRenderer->MinSamples = settings->MinSamples;
                 rayRenderer->MaxSamples = settings->MaxSamples;
                 rayRenderer->SampleThreshold = (float)settings->SampleThreshold;
+                rayRenderer->Sampling = (SamplerType)settings->Sampling;
                 rayRenderer->MaxLights = settings->MaxLights;
                 rayRenderer->MaxDepth = settings->MaxDepth;
+                rayRenderer->RouletteDepth = settings->RouletteDepth;
                 rayRenderer->GI = settings->GI;
                 rayRenderer->GISamples = settings->GISamples;
                 rayRenderer->IrradianceMap = settings->IrradianceMap;
@@ -150,8 +195,19 @@ namespace MyEngine {
                 rayRenderer->IrradianceMapColorThreshold = (float)settings->IrradianceMapColorThreshold;
                 rayRenderer->LightCache = settings->LightCache;
                 rayRenderer->LightCacheSampleSize = (float)settings->LightCacheSampleSize;
+                rayRenderer->GICache = settings->GICache;
                 rayRenderer->Animation = settings->Animation;
                 rayRenderer->AnimationResetCaches = settings->AnimationResetCaches;
+                rayRenderer->Progressive = settings->Progressive;
+                rayRenderer->ProgressiveTime = (float)settings->ProgressiveTime;
+                rayRenderer->ProgressiveNoise = (float)settings->ProgressiveNoise;
+                rayRenderer->RenderNodes = settings->RenderNodes;
+                rayRenderer->CheckpointTime = (float)settings->CheckpointTime;
+                rayRenderer->ToneMapping = settings->ToneMapping;
+                rayRenderer->SRGB = settings->SRGB;
+                rayRenderer->Bloom = (float)settings->Bloom;
+                rayRenderer->Denoise = settings->Denoise;
+                rayRenderer->Exposure = (float)this->exposure;
             }
             this->Renderer->Init(settings->Width, settings->Height);
 
@@ -163,11 +219,43 @@ namespace MyEngine {
             this->Renderer->Start();
         }
 
+        // continues the checkpoint of an interrupted render
+        void Resume()
+        {
+            if (this->Type == ERendererType::CPURayRenderer || this->Type == ERendererType::WavefrontRenderer)
+                ((CPURayRenderer*)this->Renderer)->Resume();
+            else
+                this->Renderer->Start();
+        }
+
         void Stop()
         {
             this->Renderer->Stop();
         }
 
+        // blocks until the coordinator disconnects, a render node process does nothing else
+        bool RunRenderNode(String^ host, int port)
+        {
+            if (this->Type == ERendererType::CPURayRenderer || this->Type == ERendererType::WavefrontRenderer)
+                return ((CPURayRenderer*)this->Renderer)->RunRenderNode(to_string(host), port);
+            return false;
+        }
+
+        // the frames of the animation until endTime (0 - until stopped) are written to filePath + number + ".png"
+        void StartSequence(double fps, double endTime, String^ filePath)
+        {
+            if (this->Type == ERendererType::CPURayRenderer || this->Type == ERendererType::WavefrontRenderer)
+                ((CPURayRenderer*)this->Renderer)->StartSequence((float)fps, (float)endTime, to_string(filePath));
+            else
+                this->Renderer->Start();
+        }
+
+        void FinishProgressive()
+        {
+            if (this->Type == ERendererType::CPURayRenderer || this->Type == ERendererType::WavefrontRenderer)
+                ((CPURayRenderer*)this->Renderer)->FinishProgressive();
+        }
+
         Bitmap^ GetBuffer(String^ name)
         {
             if (this->Renderer->Buffers.find(to_string(name)) == this->Renderer->Buffers.end()) // doesn't contin
@@ -178,6 +266,14 @@ namespace MyEngine {
                 Imaging::ImageLockMode::WriteOnly, Imaging::PixelFormat::Format32bppArgb);
             const auto& buffer = this->Renderer->Buffers[to_string(name)];
             byte* dataByte = (byte*)data->Scan0.ToPointer();
+            if (name->Equals("Final") && (this->Type == ERendererType::CPURayRenderer || this->Type == ERendererType::WavefrontRenderer))
+            {
+                // post-processed by the renderer
+                const auto& display = ((CPURayRenderer*)this->Renderer)->Display;
+                memcpy(dataByte, display.data, display.width * display.height * sizeof(uint));
+                this->buffer->UnlockBits(data);
+                return this->buffer;
+            }
             for (uint i = 0; i < buffer.width * buffer.height; i++)
             {
                 // from RGBA to BGRA
@@ -14,6 +14,7 @@ namespace MyEngine {
 	{
 		IrrRenderer,
 		CPURayRenderer,
+		WavefrontRenderer,
 		GPURayRenderer
 	};
 
@@ -55,7 +56,7 @@ namespace MyEngine {
             {
                 List<ERendererType>^ collection = gcnew List<ERendererType>();
                 collection->Add(ERendererType::CPURayRenderer);
-                collection->Add(ERendererType::GPURayRenderer);
+                collection->Add(ERendererType::WavefrontRenderer);
                 return collection;
             }
         }